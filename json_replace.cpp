@@ -1,206 +1,521 @@
 /**
- * This file contains the function json_replace, which gets a string or
- * C-string and returns a new string where each key that ends with
- * TARGET_SUFFIX will have its corresponding value replaced with REPLACE_SUFFIX.
- *
- * Current functionality only works with values that are strings or arrays of
- * strings. This does not account for numbers, booleans, nested jsons, or nested brackets. Using
- * this function with other json values or invalid json causes undefined behavior, such as:
- *     segmentation fault,
- *     throwing std::invalid_argument,
- *     returning a partial json,
- *     not replacing values.
- *
- *
- * Ex. 1) "key_X" : "value" --> "key_X" : "*"
- *     2) "key_X" : ["val1", "val2"] --> "key_X" : ["*", "*"]
+ * This file contains the json_replace command line tool and the tests of json_replace.hpp and
+ * json_replace.h, along with their fuzz target and benchmarks. It is linked with the
+ * json_replace_c library, which the tests of the C interface call.
  */
 
-#include <iostream>
-#include <string>
-#include <cassert>
-#include <cstring>
+#include "json_replace.hpp"
+#include "json_replace.h"
 
-#define TARGET_SUFFIX "_X"
-#define REPLACE_CHAR '*'
-#define ESCAPED_TARGET_SUFFIX TARGET_SUFFIX"\""
-#define JSON_READ_ERROR_MSG "json_replace only allows for strings and "\
-"array of strings as json values."
+#include <charconv>
+#include <sys/socket.h>
+
+#if defined(JSON_REPLACE_BENCHMARK)
+#include <benchmark/benchmark.h>
+#include <regex>
+#endif
+
+using namespace jr;
+using namespace jr::detail;
+
+/**
+ * Options of the json_replace command line tool, as described by print_usage.
+ */
+struct cli_options
+{
+  std::vector<std::string> suffixes;
+  std::vector<std::string> prefixes;
+  char replace = JSON_REPLACE_CHAR;
+  bool pad = false;
+  std::optional<std::string> literal;
+  std::optional<std::array<uint64_t, 2>> hash_key;
+  std::optional<size_t> hash_digits;
+  size_t threads = 1;
+  bool document = false;
+  bool decompress = false;
+  json_codec compress = json_codec::plain;
+  bool stats = false;
+  json_engine engine = json_engine::scanner;
+  std::optional<std::string> key_index;
+  std::string input = "-";
+  std::string output = "-";
+};
+
+void print_usage (std::ostream &out)
+{
+  out << "usage: json_replace [options] [input [output]]\n"
+         "       json_replace --test\n"
+         "Replaces the values of matching keys in the json read from input, and writes the\n"
+         "result to output. Either one can be \"-\", or left out, for stdin and stdout.\n"
+         "  -s, --suffix SUFFIX  replace values of keys that end with SUFFIX, can be repeated\n"
+         "                       (default " JSON_REPLACE_TARGET_SUFFIX ")\n"
+         "  -p, --prefix PREFIX  replace values of keys that start with PREFIX, can be repeated\n"
+         "  -r, --replace CHAR   character replaced values are replaced with (default "
+      << JSON_REPLACE_CHAR << ")\n"
+         "  --pad                replace every character of a value with the replace character\n"
+         "  --literal TEXT       replace values with TEXT\n"
+         "  --hash KEY           replace values with the first hex digits of their SipHash-2-4\n"
+         "                       under KEY, given as 32 hex digits\n"
+         "  --hash-digits N      number of hex digits --hash writes, from 1 to 16 (default 16)\n"
+         "  -j, --threads N      split newline delimited json between N threads, or all cores\n"
+         "                       for 0 (default 1)\n"
+         "  --document           split a single json document between the threads, instead\n"
+         "                       of newline delimited records\n"
+         "  -d, --decompress     read gzip or zstd input, as told by its first bytes, or plain\n"
+         "                       json otherwise\n"
+         "  --compress CODEC     write the output compressed with gzip or zstd\n"
+         "  --stats              write counters and cycles spent in every phase to stderr,\n"
+         "                       in the Prometheus text format, with one thread only\n"
+         "  --key-index FILE     replace from the offsets of the keys and values of the input\n"
+         "                       saved in FILE, which are found and saved there first if it\n"
+         "                       does not exist, with one thread only\n"
+         "  -e, --engine ENGINE  scanner, index for the structural index, which is faster\n"
+         "                       for long documents with short values, or validate to read\n"
+         "                       strict json and report where it is not valid\n"
+         "                       (default scanner)\n"
+         "  --test               run the tests\n";
+}
 
 /**
- * Reads whitespace from the C-string into new C-string.
- * Terminating character ('\0') is not counted as whitespace, and is not read.
- * @param p_src pointer to original C-string
- * @param p_dest pointer to new C-string
+ * Reads the command line into options.
+ * @return whether the command line was valid
  */
-void read_json_filler (const char **p_src, char **p_dest)
+bool parse_cli_options (int argc, char **argv, cli_options &options)
 {
-  while (**p_src != '\0' && **p_src != '"' && **p_src != '[')
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if ((arg == "-s" || arg == "--suffix") && has_value)
+      options.suffixes.push_back (argv[++i]);
+    else if ((arg == "-p" || arg == "--prefix") && has_value)
+      options.prefixes.push_back (argv[++i]);
+    else if ((arg == "-r" || arg == "--replace") && has_value)
+    {
+      std::string replace = argv[++i];
+      if (replace.size () != 1 || replace[0] == '"' || replace[0] == '\\')
+      {
+        std::cerr << "json_replace: the replace value has to be a single character, other than a "
+                     "quote or a backslash" << std::endl;
+        return false;
+      }
+      options.replace = replace[0];
+    }
+    else if (arg == "--pad")
+      options.pad = true;
+    else if (arg == "--stats")
+      options.stats = true;
+    else if (arg == "--key-index" && has_value)
+      options.key_index = argv[++i];
+    else if (arg == "--document")
+      options.document = true;
+    else if (arg == "-d" || arg == "--decompress")
+      options.decompress = true;
+    else if (arg == "--compress" && has_value)
+    {
+      std::string codec = argv[++i];
+      if (codec != "gzip" && codec != "zstd")
+      {
+        std::cerr << "json_replace: the codec has to be gzip or zstd" << std::endl;
+        return false;
+      }
+      options.compress = codec == "gzip" ? json_codec::gzip : json_codec::zstd;
+      if (!json_codec_available (options.compress))
+      {
+        std::cerr << "json_replace: " JSON_REPLACE_CODEC_SUPPORT_ERROR_MSG << std::endl;
+        return false;
+      }
+    }
+    else if (arg == "--literal" && has_value)
+    {
+      std::string literal = argv[++i];
+      if (literal.find_first_of ("\"\\") != std::string::npos)
+      {
+        std::cerr << "json_replace: " JSON_REPLACE_LITERAL_REPLACEMENT_ERROR_MSG << std::endl;
+        return false;
+      }
+      options.literal = literal;
+    }
+    else if (arg == "--hash" && has_value)
+    {
+      std::string key = argv[++i];
+      if (key.size () != 32 || key.find_first_not_of ("0123456789abcdefABCDEF") !=
+          std::string::npos)
+      {
+        std::cerr << "json_replace: the hash key has to be 32 hex digits" << std::endl;
+        return false;
+      }
+      // the key is read as 16 bytes, each half of them little endian
+      std::array<uint64_t, 2> words {};
+      for (size_t byte = 0; byte < 16; ++byte)
+        words[byte / 8] |= std::stoull (key.substr (2 * byte, 2), nullptr, 16) << (8 * (byte % 8));
+      options.hash_key = words;
+    }
+    else if (arg == "--hash-digits" && has_value)
+    {
+      std::string_view text = argv[++i];
+      size_t digits = 0;
+      auto [end, error] = std::from_chars (text.data (), text.data () + text.size (), digits);
+      if (error != std::errc () || end != text.data () + text.size () || digits < 1 ||
+          digits > 16)
+      {
+        std::cerr << "json_replace: " JSON_REPLACE_HASH_DIGITS_ERROR_MSG << std::endl;
+        return false;
+      }
+      options.hash_digits = digits;
+    }
+    else if ((arg == "-j" || arg == "--threads") && has_value)
+    {
+      std::string_view threads = argv[++i];
+      auto [end, error] = std::from_chars (threads.data (), threads.data () + threads.size (),
+                                           options.threads);
+      if (error != std::errc () || end != threads.data () + threads.size ())
+      {
+        std::cerr << "json_replace: the number of threads has to be a number" << std::endl;
+        return false;
+      }
+    }
+    else if ((arg == "-e" || arg == "--engine") && has_value)
+    {
+      std::string engine = argv[++i];
+      if (engine != "scanner" && engine != "index" && engine != "validate")
+      {
+        std::cerr << "json_replace: the engine has to be scanner, index or validate" << std::endl;
+        return false;
+      }
+      options.engine = engine == "index" ? json_engine::structural_index
+          : engine == "validate" ? json_engine::validating : json_engine::scanner;
+    }
+    else if (arg == "-" || arg.empty () || arg[0] != '-')
+      files.push_back (arg);
+    else
+    {
+      std::cerr << "json_replace: unknown or incomplete option " << arg << std::endl;
+      return false;
+    }
+  }
+  if (files.size () > 2)
+  {
+    std::cerr << "json_replace: too many files" << std::endl;
+    return false;
+  }
+  if (options.pad + options.literal.has_value () + options.hash_key.has_value () > 1)
+  {
+    std::cerr << "json_replace: only one of --pad, --literal and --hash can be used" << std::endl;
+    return false;
+  }
+  if (options.hash_digits && !options.hash_key)
   {
-    *((*p_dest)++) = *((*p_src)++);
+    std::cerr << "json_replace: --hash-digits needs --hash" << std::endl;
+    return false;
   }
+  if ((options.decompress || options.compress != json_codec::plain) &&
+      (options.pad || options.literal || options.hash_key || options.threads != 1 ||
+       options.stats || options.engine == json_engine::validating))
+  {
+    std::cerr << "json_replace: --decompress and --compress only replace with a single "
+                 "character, on one thread, without validating" << std::endl;
+    return false;
+  }
+  if (options.stats && options.threads != 1)
+  {
+    std::cerr << "json_replace: --stats only counts on one thread" << std::endl;
+    return false;
+  }
+  if (options.key_index && (options.threads != 1 || options.stats || options.decompress ||
+                            options.compress != json_codec::plain))
+  {
+    std::cerr << "json_replace: --key-index only replaces plain json, on one thread, without "
+                 "--stats" << std::endl;
+    return false;
+  }
+  if (options.suffixes.empty () && options.prefixes.empty ())
+    options.suffixes.push_back (JSON_REPLACE_TARGET_SUFFIX);
+  if (!files.empty ())
+    options.input = files[0];
+  if (files.size () > 1)
+    options.output = files[1];
+  return true;
 }
 
+
 /**
- * Reads a quoted string from the C-string, and writes the replace value into the new string.
- * If there is nothing between the quotes, no replacing will be done
- * @param p_src pointer to original C-string
- * @param p_dest pointer to new C-string
+ * Owns a file descriptor, and a mapping of the file if there is one.
  */
-void read_and_replace_json_string (const char **p_src, char **p_dest)
+struct cli_file
 {
-  *((*p_dest)++) = *((*p_src)++);
-  bool escaped = false;
-  // will not replace an empty string
-  if (**p_src == '"')
+  int fd = -1;
+  char *map = nullptr;
+  size_t map_len = 0;
+
+  ~cli_file ()
   {
-    *((*p_dest)++) = *((*p_src)++);
-    return;
+    if (map)
+      munmap (map, map_len);
+    if (fd > STDERR_FILENO)
+      close (fd);
   }
-  // read body of string. allows for reading internal escaped quotes.
-  while (**p_src != '"' || escaped)
+
+  /**
+   * Maps len bytes of the file, and tells the kernel they will be read or written in order.
+   */
+  void map_sequential (size_t len, int prot) noexcept (false)
   {
-    escaped = false;
-    if (**p_src == '\\')
-      escaped = true;
-    ++(*p_src);
+    void *addr = mmap (nullptr, len, prot, prot & PROT_WRITE ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+      throw_system_error ("mmap");
+    map = static_cast<char *> (addr);
+    map_len = len;
+    madvise (map, map_len, MADV_SEQUENTIAL);
   }
+};
+
+/**
+ * Calls run with the replacement the options ask for.
+ */
+template <typename Run>
+auto with_cli_replacement (const cli_options &options, const Run &run) noexcept (false)
+{
+  if (options.pad)
+    return run (pad_replacement {options.replace});
+  if (options.literal)
+    return run (literal_replacement (*options.literal));
+  if (options.hash_key)
+    return run (hash_replacement {(*options.hash_key)[0], (*options.hash_key)[1],
+                                  options.hash_digits.value_or (16)});
+  return run (runtime_char_replacement {options.replace});
+}
 
-  *((*p_dest)++) = REPLACE_CHAR;
-  *((*p_dest)++) = *((*p_src)++);
+/**
+ * @return the longest the output of the options can get for len bytes of input
+ */
+size_t cli_max_len (const cli_options &options, size_t len) noexcept (false)
+{
+  return with_cli_replacement (options, [len] (const auto &replacement)
+  {
+    return max_replaced_len (len, replacement);
+  });
 }
 
 /**
- * Reads a json string from a C-string, starting and ending with quotes, into a new C-string.
- * @param p_src pointer to original C-string
- * @param p_dest pointer to new C-string
+ * Reads the JsonKeyIndex of src from file, or builds it and writes it there if file does not
+ * exist.
  */
-void read_json_string (const char **p_src, char **p_dest)
+JsonKeyIndex cli_key_index (const std::string &file, const char *src,
+                            size_t len) noexcept (false)
 {
-  *((*p_dest)++) = *((*p_src)++);
-  bool escaped = false;
-  // read body of string. allows for reading internal escaped quotes.
-  while (**p_src != '"' || escaped)
+  struct stat file_stat;
+  if (stat (file.c_str (), &file_stat) == 0)
   {
-    escaped = false;
-    if (**p_src == '\\')
-      escaped = true;
-    *((*p_dest)++) = *((*p_src)++);
+    std::ifstream in (file, std::ios::binary);
+    if (!in)
+      throw std::runtime_error ("could not read " + file);
+    return JsonKeyIndex::load (std::string ((std::istreambuf_iterator<char> (in)),
+                                            std::istreambuf_iterator<char> ()));
   }
+  if (errno != ENOENT)
+    throw_system_error (file);
+  JsonKeyIndex index (std::string_view (src, len));
+  std::string saved = index.save ();
+  std::ofstream out (file, std::ios::binary);
+  out.write (saved.data (), saved.size ());
+  if (!out)
+    throw std::runtime_error ("could not write " + file);
+  return index;
+}
 
-  *((*p_dest)++) = *((*p_src)++);
+/**
+ * Runs the replacer the options ask for over the whole of src.
+ * @param dest buffer of at least cli_max_len (options, len) bytes
+ * @return Length of the copy.
+ */
+size_t cli_replace (const cli_options &options, const KeyMatcher &matcher, const char *src,
+                    size_t len, char *dest) noexcept (false)
+{
+  return with_cli_replacement (options, [&] (const auto &replacement)
+  {
+    if (options.key_index)
+      return json_remask_into_with (src, len, cli_key_index (*options.key_index, src, len), dest,
+                                    max_replaced_len (len, replacement), matcher, replacement);
+    if (options.stats)
+    {
+      json_timed_stats stats;
+      size_t out_len = json_replace_into_with (src, len, dest, max_replaced_len (len, replacement),
+                                               matcher, replacement, stats);
+      stats.write_prometheus (std::cerr);
+      return out_len;
+    }
+    if (options.threads == 1)
+      return json_replace_into_with (src, len, dest, max_replaced_len (len, replacement), matcher,
+                                     replacement);
+    WorkStealingPool pool (options.threads);
+    if (options.document)
+    {
+      json_split_buffers buffers;
+      ReplaceError error;
+      size_t out_len = json_replace_parallel_into_with (std::string_view (src, len), pool, dest,
+                                                        matcher, replacement, buffers, error);
+      if (error)
+        throw_replace_error (error);
+      return out_len;
+    }
+    json_batch_buffers buffers;
+    return json_replace_batch_into_with (std::string_view (src, len), pool, dest, matcher,
+                                         replacement, buffers);
+  });
 }
 
 /**
- * Reads a json value from the string, including "[] characters, into new string.
- * C-strings will be left pointing to '\0', ',', or right after '"', ']'.
- * Only strings or arrays of strings can be read.
- *
- * @param p_src pointer to original C-string
- * @param p_dest pointer to new C-string
- * @param replace whether or not to replace the value or values
+ * Replaces the already open input file of options into its output file, as described by
+ * run_cli.
  */
-void read_json_value (const char **p_src, char **p_dest, bool replace) noexcept (false)
+void cli_copy (const cli_options &options, const KeyMatcher &matcher, cli_file &in,
+               const struct stat &in_stat, cli_file &out,
+               const struct stat &out_stat) noexcept (false)
 {
-  if (**p_src == '"')
+  bool mappable = S_ISREG (in_stat.st_mode) && in_stat.st_size > 0;
+  bool codec = options.decompress || options.compress != json_codec::plain;
+
+  if (codec)
   {
-    if (replace)
-      read_and_replace_json_string (p_src, p_dest);
+    // the plain json only ever exists a block at a time, between the two codecs
+    JsonCompressSink compress (options.compress, [&out] (const char *data, size_t len)
+                               { write_all (out.fd, data, len); });
+    JsonReplaceStream stream ([&compress] (const char *data, size_t len)
+                              { compress.write (data, len); }, matcher, options.replace);
+    JsonDecompressStream decompress (stream);
+    std::vector<char> in_buf (1 << 20);
+    ssize_t read_len;
+    while ((read_len = read (in.fd, in_buf.data (), in_buf.size ())) != 0)
+    {
+      if (read_len < 0 && errno != EINTR)
+        throw_system_error ("read");
+      if (read_len > 0 && options.decompress)
+        decompress.feed (in_buf.data (), read_len);
+      else if (read_len > 0)
+        stream.feed (in_buf.data (), read_len);
+    }
+    if (options.decompress)
+      decompress.finish ();
     else
-      read_json_string (p_src, p_dest);
+      stream.finish ();
+    compress.finish ();
     return;
   }
 
-  if (**p_src == '[')
+  if (mappable)
   {
-    *((*p_dest)++) = *((*p_src)++);
-    while (**p_src != ']')
+    size_t len = in_stat.st_size;
+    in.map_sequential (len, PROT_READ);
+    if (options.output != "-" && S_ISREG (out_stat.st_mode))
     {
-      if (**p_src == '"')
-      {
-        if (replace)
-          read_and_replace_json_string (p_src, p_dest);
-        else
-          read_json_string (p_src, p_dest);
-        continue;
-      }
-      *((*p_dest)++) = *((*p_src)++);
+      size_t max_len = cli_max_len (options, len);
+      if (ftruncate (out.fd, max_len) < 0)
+        throw_system_error (options.output);
+      out.map_sequential (max_len, PROT_READ | PROT_WRITE);
+      size_t out_len = cli_replace (options, matcher, in.map, len, out.map);
+      munmap (out.map, out.map_len);
+      out.map = nullptr;
+      if (ftruncate (out.fd, out_len) < 0)
+        throw_system_error (options.output);
+      return;
+    }
+    std::string out_buf (cli_max_len (options, len), '\0');
+    out_buf.resize (cli_replace (options, matcher, in.map, len, &out_buf[0]));
+    write_all (out.fd, out_buf.data (), out_buf.size ());
+    return;
+  }
+
+  std::vector<char> in_buf (1 << 20);
+  // the stream only replaces with a single character, and does not count or validate
+  bool single_char = !options.pad && !options.literal && !options.hash_key;
+  if (options.threads != 1 || !single_char || options.stats || options.key_index ||
+      options.engine == json_engine::validating)
+  {
+    std::string input;
+    ssize_t read_len;
+    while ((read_len = read (in.fd, in_buf.data (), in_buf.size ())) != 0)
+    {
+      if (read_len < 0 && errno != EINTR)
+        throw_system_error ("read");
+      if (read_len > 0)
+        input.append (in_buf.data (), read_len);
     }
-    *((*p_dest)++) = *((*p_src)++);
+    std::string out_buf (cli_max_len (options, input.size ()), '\0');
+    out_buf.resize (cli_replace (options, matcher, input.data (), input.size (), &out_buf[0]));
+    write_all (out.fd, out_buf.data (), out_buf.size ());
     return;
   }
 
-  throw std::invalid_argument (JSON_READ_ERROR_MSG);
+  // on epoll, stdin and stdout are nonblocking while the pipeline runs, for the shell as well
+  JsonReplacePipeline pipeline (in.fd, out.fd, matcher, options.replace);
+  pipeline.run ();
 }
 
 /**
- * Reads through the json and creates a copy of it where all keys that end with TARGET_SUFFIX
- * have their corresponding values replaced with REPLACE_CHAR. Only works for json values of
- * strings or arrays of strings.
- * @param src C-string to read from.
- * @return New string with replaced values.
+ * Replaces the input file of options into its output file.
+ * Regular input files are mapped into memory, and when the output is a regular file as well,
+ * it is grown to the size of the input, mapped, written in place and then cut down to the size
+ * of the output. Otherwise the output is written in large blocks.
+ * Input that can not be mapped, such as a pipe, is fed through JsonReplacePipeline, unless it
+ * has to be split between threads or validated. Compressed input or output goes through JsonReplaceStream
+ * between JsonDecompressStream and JsonCompressSink instead. With a key index, the input is
+ * replaced from its JsonKeyIndex, by json_remask_into_with.
+ * An input and output that are the same file are refused, since the output is cut before the
+ * input is read, and an output file named on the command line is removed if the replacement
+ * fails, rather than left half written.
  */
-void json_replace_no_try_catch (const char *src, char *dest)
+void run_cli (const cli_options &options) noexcept (false)
 {
-  // loop reads ("key" : "value" ,? ) each iteration
-  size_t min_key_len = strlen (ESCAPED_TARGET_SUFFIX);
-  while (*src != 0)
-  {
-    read_json_filler (&src, &dest);
-
-    // read key
-    char *temp = dest;
-    read_json_string (&src, &dest);
-    bool replace = dest - temp >= min_key_len &&
-                   strncmp (dest - min_key_len, ESCAPED_TARGET_SUFFIX, min_key_len) == 0;
+  KeyMatcher matcher (options.suffixes, options.prefixes);
+  replace_engine = options.engine;
 
-    // read ws:ws
-    read_json_filler (&src, &dest);
+  cli_file in;
+  in.fd = options.input == "-" ? STDIN_FILENO : open (options.input.c_str (), O_RDONLY);
+  if (in.fd < 0)
+    throw_system_error (options.input);
+  struct stat in_stat;
+  if (fstat (in.fd, &in_stat) < 0)
+    throw_system_error (options.input);
 
-    // read value
-    read_json_value (&src, &dest, replace);
-
-    // add '}' or comma
-    read_json_filler (&src, &dest);
-  }
-  *dest = '\0';
-}
+  cli_file out;
+  // the output is only cut once it is known not to be the input
+  out.fd = options.output == "-" ? STDOUT_FILENO
+                                 : open (options.output.c_str (), O_RDWR | O_CREAT, 0644);
+  if (out.fd < 0)
+    throw_system_error (options.output);
+  struct stat out_stat;
+  if (fstat (out.fd, &out_stat) < 0)
+    throw_system_error (options.output);
+  if (S_ISREG (in_stat.st_mode) && S_ISREG (out_stat.st_mode) &&
+      in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino)
+    throw std::runtime_error ("the input and the output are the same file");
+  bool owns_output = options.output != "-" && S_ISREG (out_stat.st_mode);
+  if (owns_output && ftruncate (out.fd, 0) < 0)
+    throw_system_error (options.output);
 
-/**
- * Reads through the json and creates a copy of it where all keys that end with TARGET_SUFFIX
- * have their corresponding values replaced with REPLACE_CHAR. Only works for json values of
- * strings or arrays of strings.
- * @param str C-string to read from.
- * @return New string with replaced values.
- */
-std::string json_replace (const char *str) noexcept (false)
-{
   try
   {
-    char *dest = new char[strlen (str) + 1];
-    json_replace_no_try_catch (str, dest);
-    std::string new_str (dest);
-    delete[] dest;
-    return new_str;
+    cli_copy (options, matcher, in, in_stat, out, out_stat);
   }
-  catch (std::invalid_argument &e)
+  catch (...)
   {
-    throw std::invalid_argument (JSON_READ_ERROR_MSG);
+    if (owns_output)
+      unlink (options.output.c_str ());
+    throw;
   }
 }
 
 /**
- * Reads through the json and creates a copy of it where all keys that end with TARGET_SUFFIX
- * have their corresponding values replaced with REPLACE_CHAR. Only works for json values of
- * strings or arrays of strings.
- * @param str string to read from.
- * @return New string with replaced values.
+ * Number of checks of json_test_compare that failed, which json_replace_tests reports.
  */
-std::string json_replace (const std::string &str) noexcept (false)
-{
-  return json_replace (str.c_str ());
-}
+static size_t json_test_failures = 0;
 
+/**
+ * Checks that a test gives what it is expected to, and counts it in json_test_failures if it
+ * does not, so that every test runs and a build with NDEBUG defined still fails.
+ */
 void json_test_compare (int testNum, const std::string &testName, const std::string &expected,
                         const std::string &actual)
 {
@@ -208,12 +523,18 @@ void json_test_compare (int testNum, const std::string &testName, const std::str
   if (expected != actual)
   {
     std::cout << "Expected: " << expected << "\nActual  : " << actual << std::endl;
+    std::cout << "Test " << testNum << " failed: " << testName << std::endl;
+    ++json_test_failures;
+    return;
   }
-  assert(expected == actual);
   std::cout << "Test " << testNum << " passed: " << testName << std::endl;
 }
 
-void json_replace_tests ()
+/**
+ * Runs every test.
+ * @return Whether all of them passed.
+ */
+bool json_replace_tests ()
 {
   std::cout << "running tests..." << std::endl;
 
@@ -250,11 +571,2087 @@ void json_replace_tests ()
   std::string expected8 = R"("k":"val", "_X": "*", "": "")";
   json_test_compare (8, "short keys", expected8, json_replace (input8));
 
-  std::cout << "Passed all tests!" << std::endl;
-}
+  // values long enough to span several simd blocks, with escapes landing on every offset
+  const json_string_kernel *default_kernel = string_kernel;
+  for (size_t k = 0; k < available_string_kernels (); ++k)
+  {
+    string_kernel = &string_kernels[k];
+    std::string input9, expected9;
+    for (size_t len = 0; len < 80; ++len)
+    {
+      std::string value (len, 'v');
+      if (len > 1)
+        value.replace (len / 2, 2, len % 2 ? "\\\"" : "\\\\");
+      input9 += std::string (len % 7, ' ') + "\"k" + value + "\": \"" + value + "\", ";
+      expected9 += std::string (len % 7, ' ') + "\"k" + value + "\": \"" + value + "\", ";
+      input9 += "\"k_X\": [\"" + value + "\"], ";
+      expected9 += "\"k_X\": [\"" + std::string (len ? "*" : "") + "\"], ";
+    }
+    json_test_compare (9, std::string ("long values, ") + string_kernel->name + " kernel",
+                       expected9, json_replace (input9));
+  }
+  string_kernel = default_kernel;
 
-int main ()
-{
-  json_replace_tests ();
-  return EXIT_SUCCESS;
-}
\ No newline at end of file
+  std::string input10 = R"("key" : "value", "k2_X": "value2", "k3_X": ["abc"])";
+  std::string expected10 = R"("key" : "value", "k2_X": "*", "k3_X": ["*"])";
+  char buffer10[128];
+  size_t len10 = json_replace_into (input10, buffer10, input10.size ());
+  json_test_compare (10, "caller supplied buffer", expected10, std::string (buffer10, len10));
+
+  bool threw11 = false;
+  try
+  {
+    json_replace_into (input10, buffer10, input10.size () - 1);
+  }
+  catch (std::length_error &e)
+  {
+    threw11 = true;
+  }
+  json_test_compare (11, "caller supplied buffer too small", "true", threw11 ? "true" : "false");
+
+  // inputs are read from exactly sized buffers, so reading past the end is caught by sanitizers
+  std::string record12 = R"("k_X": "v", "k": "v")";
+  std::vector<char> input12 (record12.begin (), record12.end ());
+  std::string_view view12 (input12.data (), 12);
+  json_test_compare (12, "not null terminated", R"("k_X": "*", )", json_replace (view12));
+
+  for (std::string malformed : {R"("k_X": "v)", R"("k": "v\)", R"("k": ["v")", R"("k_X")", R"("k)"})
+  {
+    std::vector<char> input13 (malformed.begin (), malformed.end ());
+    bool threw13 = false;
+    try
+    {
+      json_replace (std::string_view (input13.data (), input13.size ()));
+    }
+    catch (std::invalid_argument &e)
+    {
+      threw13 = true;
+    }
+    json_test_compare (13, "unterminated " + malformed, "true", threw13 ? "true" : "false");
+  }
+
+  std::string input14 = R"("ssn" : "1", "user_SSN": "123", "_SSN": ["4", ""], "k_X": "v")";
+  std::string expected14 = R"("ssn" : "1", "user_SSN": "#", "_SSN": ["#", ""], "k_X": "v")";
+  json_test_compare (14, "compile time suffix", expected14,
+                     json_replacer<"_SSN", '#'>::replace (input14));
+
+  std::string input15 = R"("secret":"a", "my_secret":"b", "_secret":"c", "password_hash_v2":"d")";
+  std::string expected15 = R"("secret":"a", "my_secret":"-", "_secret":"-", "password_hash_v2":"d")";
+  json_test_compare (15, "eight byte suffix", expected15,
+                     json_replacer<"_secret", '-'>::replace (input15));
+  std::string expected15b = R"("secret":"a", "my_secret":"b", "_secret":"c", "password_hash_v2":"?")";
+  json_test_compare (15, "long suffix", expected15b,
+                     json_replacer<"password_hash_v2", '?'>::replace (input15));
+
+  KeyMatcher matcher16 ({"_X", "_ssn", "card_number", "X"}, {"secret_", "pin"});
+  std::string input16 = R"("a_X": "1", "user_ssn": "2", "card": "3", "card_number": "4", )"
+                        R"("secret_key": "5", "secret": "6", "pin_code": ["7"], "": "8", "x": "9")";
+  std::string expected16 = R"("a_X": "*", "user_ssn": "*", "card": "3", "card_number": "*", )"
+                           R"("secret_key": "*", "secret": "6", "pin_code": ["*"], "": "8", "x": "9")";
+  json_test_compare (16, "runtime patterns", expected16, json_replace (input16, matcher16));
+  json_test_compare (16, "runtime patterns, custom replace", R"("pin": "#", "pi": "v")",
+                     json_replace<'#'> (R"("pin": "v", "pi": "v")", matcher16));
+
+  KeyMatcher everything17 ({""});
+  json_test_compare (17, "empty pattern", R"("": "*", "k": ["*"])",
+                     json_replace (R"("": "v", "k": ["v"])", everything17));
+
+  for (const std::string &input18 :
+       {input1, input2, input4, input5, input6, input7, input8, input16})
+  {
+    for (size_t chunk = 1; chunk <= 17; chunk += 4)
+    {
+      std::string output18;
+      JsonReplaceStream stream18 ([&output18] (const char *data, size_t len)
+                                  { output18.append (data, len); });
+      for (size_t i = 0; i < input18.size (); i += chunk)
+        stream18.feed (std::string_view (input18).substr (i, chunk));
+      stream18.finish ();
+      json_test_compare (18, "stream in chunks of " + std::to_string (chunk),
+                         json_replace (input18), output18);
+    }
+  }
+
+  std::string output19;
+  JsonReplaceStream stream19 ([&output19] (const char *data, size_t len)
+                              { output19.append (data, len); }, matcher16, '#');
+  for (char c : input16)
+    stream19.feed (&c, 1);
+  stream19.finish ();
+  json_test_compare (19, "stream with runtime patterns", json_replace<'#'> (input16, matcher16),
+                     output19);
+
+  bool threw20 = false;
+  JsonReplaceStream stream20 ([] (const char *, size_t) {});
+  stream20.feed (R"("k_X": ["v", )");
+  try
+  {
+    stream20.finish ();
+  }
+  catch (std::invalid_argument &e)
+  {
+    threw20 = true;
+  }
+  json_test_compare (20, "stream ends inside a value", "true", threw20 ? "true" : "false");
+
+  std::string input21;
+  for (size_t i = 0; i < 20000; ++i)
+    input21 += (i % 3 ? input2 : input4) + "\n";
+  std::string expected21 = json_replace (input21);
+  for (size_t threads21 : {1, 3})
+  {
+    WorkStealingPool pool21 (threads21);
+    json_test_compare (21, "batch on " + std::to_string (threads21) + " threads", expected21,
+                       json_replace_batch (input21, pool21));
+    json_test_compare (21, "batch with runtime patterns", json_replace (input21, matcher16),
+                       json_replace_batch (input21, pool21, matcher16));
+  }
+
+  char path22[] = "/tmp/json_replace_testXXXXXX";
+  int fd22 = mkstemp (path22);
+  json_test_compare (22, "temporary file", "true", fd22 >= 0 ? "true" : "false");
+  write_all (fd22, input16.data (), input16.size ());
+  close (fd22);
+  std::string out_path22 = std::string (path22) + ".out";
+  for (size_t threads22 : {1, 2})
+  {
+    const char *argv22[] = {"json_replace", "-s", "_X", "-s", "_ssn", "-s", "card_number", "-s",
+                            "X", "-p", "secret_", "--prefix", "pin", "-r", "#", "-j",
+                            threads22 == 1 ? "1" : "2", path22, out_path22.c_str ()};
+    cli_options options22;
+    bool parsed22 = parse_cli_options (sizeof (argv22) / sizeof (argv22[0]),
+                                       const_cast<char **> (argv22), options22);
+    json_test_compare (22, "parsed options", "true", parsed22 ? "true" : "false");
+    if (parsed22)
+      run_cli (options22);
+    std::ifstream out22 (out_path22);
+    json_test_compare (22, "file to file on " + std::to_string (threads22) + " threads",
+                       json_replace<'#'> (input16, matcher16),
+                       std::string ((std::istreambuf_iterator<char> (out22)),
+                                    std::istreambuf_iterator<char> ()));
+  }
+  unlink (path22);
+  unlink (out_path22.c_str ());
+
+  std::string input23 = R"({"id": 12, "ok": true, "v": null, "n_X": -1.5e3, "s_X": "a", "t": false})";
+  std::string expected23 = R"({"id": 12, "ok": true, "v": null, "n_X": -1.5e3, "s_X": "*", "t": false})";
+  json_test_compare (23, "numbers, booleans and null", expected23, json_replace (input23));
+
+  std::string input24 = R"({"user": {"name": "a", "card_X": "b", "tags": ["c", {"pin_X": "d"}]}, "e": "f"})";
+  std::string expected24 = R"({"user": {"name": "a", "card_X": "*", "tags": ["c", {"pin_X": "*"}]}, "e": "f"})";
+  json_test_compare (24, "nested keys", expected24, json_replace (input24));
+
+  std::string input25 = R"({"k_X": {"a": "b", "c": [1, "d", ["e", {"f": "g"}]], "h": 2}, "i": "j"})";
+  std::string expected25 = R"({"k_X": {"a": "*", "c": [1, "*", ["*", {"f": "*"}]], "h": 2}, "i": "j"})";
+  json_test_compare (25, "nested values replaced", expected25, json_replace (input25));
+
+  std::string input26 = R"({"a": [[], {}, [1, 2], {"b": [true]}], "c_X": [[["x"]]], "d": {}}
+{"e_X": "y"} ["z", {"f_X": "w"}])";
+  std::string expected26 = R"({"a": [[], {}, [1, 2], {"b": [true]}], "c_X": [[["*"]]], "d": {}}
+{"e_X": "*"} ["z", {"f_X": "*"}])";
+  json_test_compare (26, "several top level values", expected26, json_replace (input26));
+
+  std::string too_deep27 = std::string (JSON_REPLACE_MAX_DEPTH + 1, '[') +
+                          std::string (JSON_REPLACE_MAX_DEPTH + 1, ']');
+  for (const std::string &unbalanced : {std::string (R"({"a": "b"]})"), std::string (R"("a": "b"})"),
+                                        std::string (R"({"a": ["b"})"), too_deep27})
+  {
+    bool threw27 = false;
+    try
+    {
+      json_replace (unbalanced);
+    }
+    catch (std::invalid_argument &e)
+    {
+      threw27 = true;
+    }
+    json_test_compare (27, "unbalanced " + unbalanced.substr (0, 12), "true",
+                       threw27 ? "true" : "false");
+  }
+  std::string deep28 = std::string (JSON_REPLACE_MAX_DEPTH, '[') +
+                       std::string (JSON_REPLACE_MAX_DEPTH, ']');
+  json_test_compare (28, "deepest nesting", deep28, json_replace (deep28));
+
+  for (const std::string &input29 : {input23, input24, input25, input26})
+  {
+    std::string output29;
+    JsonReplaceStream stream29 ([&output29] (const char *data, size_t len)
+                                { output29.append (data, len); });
+    for (char c : input29)
+      stream29.feed (&c, 1);
+    stream29.finish ();
+    json_test_compare (29, "stream nested json", json_replace (input29), output29);
+  }
+
+  for (const std::string &input30 : {input1, input2, input4, input16, input23, input25, input26})
+  {
+    std::string buffer30 = input30;
+    json_replace_inplace (buffer30);
+    json_test_compare (30, "in place", json_replace (input30), buffer30);
+    buffer30 = input30;
+    buffer30.resize (json_replace_inplace<'#'> (buffer30.data (), buffer30.size (), matcher16));
+    json_test_compare (30, "in place with runtime patterns", json_replace<'#'> (input30, matcher16),
+                       buffer30);
+  }
+
+  // a read only page would fault on any write
+  std::string input31 = R"({"key": "value", "k": ["v", {"a_Y": 1}]})";
+  long page31 = sysconf (_SC_PAGESIZE);
+  void *map31 = mmap (nullptr, page31, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(map31 != MAP_FAILED);
+  memcpy (map31, input31.data (), input31.size ());
+  mprotect (map31, page31, PROT_READ);
+  size_t len31 = json_replace_inplace (static_cast<char *> (map31), input31.size ());
+  json_test_compare (31, "in place without replacements is read only", input31,
+                     std::string (static_cast<char *> (map31), len31));
+  munmap (map31, page31);
+
+  // long values and escapes that cross blocks and windows, and a backslash outside of strings
+  std::string input32 = "[";
+  for (size_t i = 0; i < 3 * JSON_REPLACE_INDEX_WINDOW / 100; ++i)
+    input32 += R"({"id": 12, "a_X": ")" + std::string (i % 150, 'v') +
+        std::string (2 * (i % 4), '\\') + R"(\"", "b": [true, "\\", {"c_X": [null, "w"]}]},)";
+  input32 += "0]";
+  for (const std::string &input : {input1, input2, input4, input16, input23, input25, input26,
+                                   input32, std::string (R"({"k": \"x_X": "v"})")})
+  {
+    std::string expected32 = json_replace (input);
+    for (size_t k = 0; k < available_index_kernels (); ++k)
+    {
+      index_kernel = &index_kernels[k];
+      replace_engine = json_engine::structural_index;
+      std::string indexed32 = json_replace (input);
+      std::string inplace32 = input;
+      json_replace_inplace (inplace32);
+      replace_engine = json_engine::scanner;
+      json_test_compare (32, std::string ("structural index ") + index_kernels[k].name,
+                         expected32, indexed32);
+      json_test_compare (32, std::string ("structural index in place ") + index_kernels[k].name,
+                         expected32, inplace32);
+    }
+    index_kernel = &index_kernels[available_index_kernels () - 1];
+  }
+
+  std::string storage33;
+  std::string plain33 = R"({"a": "b_Xy", "c": {"d_": "X"}, "e": ["_X ", 1]})";
+  std::string_view view33 = json_replace_view (plain33, storage33);
+  json_test_compare (33, "view without key is not copied", "true",
+                     view33.data () == plain33.data () ? "true" : "false");
+  json_test_compare (33, "view without key", plain33, std::string (view33));
+  for (const std::string &input33 : {input1, input2, input4, input16, input23, input26})
+  {
+    json_test_compare (33, "view", json_replace (input33),
+                       std::string (json_replace_view (input33, storage33)));
+    json_test_compare (33, "view with runtime patterns", json_replace (input33, matcher16),
+                       std::string (json_replace_view (input33, storage33, matcher16)));
+  }
+  std::string needles33 = std::string (100, 'y') + "_X" + std::string (100, 'y') + "\"pin";
+  for (size_t k = 0; k < available_string_kernels (); ++k)
+  {
+    string_kernel = &string_kernels[k];
+    json_test_compare (33, std::string ("find ") + string_kernels[k].name, "100 202",
+                       std::to_string (string_kernel->find (needles33.data (), needles33.data () +
+                                       needles33.size (), "_X", 2) - needles33.data ()) + " " +
+                       std::to_string (matcher16.find_candidate (needles33.data (),
+                                       needles33.data () + needles33.size ()) - needles33.data ()));
+  }
+  string_kernel = &string_kernels[available_string_kernels () - 1];
+
+  ReplaceContext context34;
+  ReplaceContext runtime_context34 (matcher16, '#');
+  json_test_compare (34, "context", json_replace (input32),
+                     std::string (context34.replace (input32)));
+  size_t capacity34 = context34.capacity ();
+  for (const std::string &input34 : {input1, input2, input4, input16, input23, input25, input26})
+  {
+    std::string_view replaced34 = context34.replace (input34);
+    json_test_compare (34, "context", json_replace (input34), std::string (replaced34));
+    json_test_compare (34, "context reuses its arena", "true",
+                       context34.capacity () == capacity34 ? "true" : "false");
+    json_test_compare (34, "context with runtime patterns", json_replace<'#'> (input34, matcher16),
+                       std::string (runtime_context34.replace (input34)));
+  }
+  WorkStealingPool pool34 (3);
+  json_test_compare (34, "context batch", json_replace_batch (input21, pool34),
+                     std::string (context34.replace_batch (input21, pool34)));
+  json_test_compare (34, "context batch with runtime patterns",
+                     json_replace_batch<'#'> (input21, pool34, matcher16),
+                     std::string (runtime_context34.replace_batch (input21, pool34)));
+
+  // the test vector of the SipHash paper
+  std::string message35;
+  for (char c = 0; c < 15; ++c)
+    message35 += c;
+  hash_replacement hash35 {0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL};
+  char digits35[16];
+  hash35 (message35.data (), message35.data () + message35.size (), digits35);
+  json_test_compare (35, "siphash", "a129ca6149be45e5", std::string (digits35, 16));
+
+  std::string input35 = R"({"a_X": "secret", "b": ["same", {"c_X": ["same", "", 7]}], "pin": "x"})";
+  json_test_compare (35, "pad", R"({"a_X": "######", "b": ["same", {"c_X": ["####", "", 7]}], )"
+                     R"("pin": "#"})", json_replace (input35, matcher16, pad_replacement {'#'}));
+  json_test_compare (35, "literal", R"({"a_X": "<hidden>", "b": ["same", {"c_X": ["<hidden>", "", )"
+                     R"(7]}], "pin": "<hidden>"})",
+                     json_replace (input35, matcher16, literal_replacement ("<hidden>")));
+  auto hex35 = [&hash35] (const std::string &value)
+  {
+    char digits[16];
+    hash35 (value.data (), value.data () + value.size (), digits);
+    return std::string (digits, 16);
+  };
+  json_test_compare (35, "hash", R"({"a_X": ")" + hex35 ("secret") +
+                     R"(", "b": ["same", {"c_X": [")" + hex35 ("same") + R"(", "", 7]}], "pin": ")" +
+                     hex35 ("x") + R"("})",
+                     json_replace (input35, matcher16, hash35));
+  std::string buffer35 = input35;
+  bool threw35 = false;
+  try
+  {
+    json_replace_inplace_with (buffer35.data (), buffer35.size (), matcher16, hash35);
+  }
+  catch (std::length_error &e)
+  {
+    threw35 = true;
+  }
+  json_test_compare (35, "in place can not grow", "true", threw35 ? "true" : "false");
+  for (size_t digits : {size_t (0), size_t (17)})
+  {
+    std::string message;
+    try
+    {
+      hash_replacement hash {1, 2, digits};
+    }
+    catch (std::invalid_argument &e)
+    {
+      message = e.what ();
+    }
+    json_test_compare (35, "hash digits out of range", JSON_REPLACE_HASH_DIGITS_ERROR_MSG, message);
+  }
+  json_test_compare (35, "one hash digit", R"({"a_X": ")" + hex35 ("secret").substr (0, 1) +
+                     R"("})", json_replace (std::string (R"({"a_X": "secret"})"), matcher16,
+                                            hash_replacement {hash35.k0, hash35.k1, 1}));
+  json_test_compare (35, "in place with padding", json_replace (input35, matcher16,
+                     pad_replacement {'-'}), buffer35.substr (0, json_replace_inplace_with (
+                     buffer35.data (), buffer35.size (), matcher16, pad_replacement {'-'})));
+
+  std::string input36 = R"({"a_X": ["x\"y", 1, {"k": "v"}], "b": [true, null, [2, 3]], "c": ""})";
+  for (json_engine engine : {json_engine::scanner, json_engine::structural_index,
+                             json_engine::validating})
+  {
+    replace_engine = engine;
+    json_replace_stats stats36;
+    json_timed_stats timed36;
+    std::string replaced36 = json_replace (input36, stats36);
+    json_replace (input36, matcher16, timed36);
+    replace_engine = json_engine::scanner;
+    json_test_compare (36, "stats", json_replace (input36), replaced36);
+    json_test_compare (36, "stats counts", std::to_string (input36.size ()) + " 4 1 2 8 1",
+                       std::to_string (stats36.bytes_scanned) + " " +
+                       std::to_string (stats36.keys_seen) + " " +
+                       std::to_string (stats36.keys_matched) + " " +
+                       std::to_string (stats36.values_replaced) + " " +
+                       std::to_string (stats36.array_elements) + " " +
+                       std::to_string (stats36.escape_sequences));
+    json_test_compare (36, "timed stats count the same", "4 8 true",
+                       std::to_string (timed36.keys_seen) + " " +
+                       std::to_string (timed36.array_elements) + " " +
+                       (timed36.cycles[static_cast<size_t> (json_phase::key)] > 0 ? "true"
+                                                                                  : "false"));
+    std::ostringstream prometheus36;
+    stats36.write_prometheus (prometheus36);
+    json_test_compare (36, "prometheus", "true",
+                       prometheus36.str ().find ("\njson_replace_keys_seen_total 4\n") !=
+                       std::string::npos ? "true" : "false");
+  }
+
+  std::string buffer37 (1 << 16, '\0');
+  auto validated37 = [&buffer37] (const std::string &input)
+  {
+    ReplaceError error;
+    size_t len = json_replace_validated (input.data (), input.size (), buffer37.data (),
+                                         buffer37.size (), error);
+    if (error)
+      return std::string (error.message ()) + " at " + std::to_string (error.offset);
+    return buffer37.substr (0, len);
+  };
+  for (const std::string &input : {input1, input2, input16, input23, input25, input26,
+                                   std::string (R"({"a_X": "\u00e9\/\b", "b": [-0, 0.5, 1E+2]})"),
+                                   std::string ("{\"a_X\": 1}\n[\"b\"]\n\"c\"\n7\n"),
+                                   std::string ("")})
+  {
+    json_test_compare (37, "validated", json_replace (input), validated37 (input));
+    replace_engine = json_engine::validating;
+    std::string engine37 = json_replace (input);
+    replace_engine = json_engine::scanner;
+    json_test_compare (37, "validating engine", json_replace (input), engine37);
+  }
+  std::pair<std::string, std::string> invalid37[] = {
+    {R"({"a_X": "v")", "unexpected end of input at 11"},
+    {R"({"a_X": "v)", "unexpected end of input at 10"},
+    {R"({"a": 1,})", "unexpected character at 8"},
+    {R"({"a" 1})", "unexpected character at 5"},
+    {R"({"a": [1, 2}})", "closing bracket does not match at 11"},
+    {R"({"a": "x\qy"})", "invalid escape sequence in a string at 8"},
+    {R"({"a": "\u12g4"})", "invalid escape sequence in a string at 11"},
+    {"{\"a\": \"x\ty\"}", "unescaped control character in a string at 8"},
+    {"[\"0123456789abc\x1f" "0123456789\"]", "unescaped control character in a string at 15"},
+    {R"({"a": 01})", "invalid number at 7"},
+    {R"({"a": 1.})", "invalid number at 8"},
+    {R"({"a": -})", "invalid number at 7"},
+    {R"({"a": tru})", "invalid literal at 9"},
+    {R"({"a": nullx})", "invalid literal at 10"},
+    {R"({"a": 'b'})", "unexpected character at 6"},
+    {R"("a": 1 "b": 2)", "unexpected character at 7"},
+    {R"({} "a": 1)", "unexpected character at 6"},
+    {"[1]]", "closing bracket does not match at 3"},
+    {input4, "invalid escape sequence in a string at 68"},
+    {std::string (JSON_REPLACE_MAX_DEPTH + 1, '['),
+     "nested deeper than JSON_REPLACE_MAX_DEPTH at 1024"},
+  };
+  for (const auto &[input, expected] : invalid37)
+    json_test_compare (37, "invalid", expected, validated37 (input));
+  ReplaceError error37;
+  json_replace_validated ("{}", 2, buffer37.data (), 1, error37);
+  json_test_compare (37, "capacity", JSON_REPLACE_OUTPUT_CAPACITY_ERROR_MSG, error37.message ());
+  std::string message37;
+  replace_engine = json_engine::validating;
+  try
+  {
+    json_replace_into_with ("[1, x]", 6, buffer37.data (), buffer37.size (),
+                            suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                            char_replacement<JSON_REPLACE_CHAR> ());
+  }
+  catch (std::invalid_argument &e)
+  {
+    message37 = e.what ();
+  }
+  replace_engine = json_engine::scanner;
+  json_test_compare (37, "validating engine throws",
+                     "json_replace found invalid json at byte 4: unexpected character", message37);
+  message37.clear ();
+  replace_engine = json_engine::validating;
+  try
+  {
+    json_replace (std::string (R"({"a_X": [1}, "b": 2})"));
+  }
+  catch (std::invalid_argument &e)
+  {
+    message37 = e.what ();
+  }
+  replace_engine = json_engine::scanner;
+  json_test_compare (37, "validating engine throws from a new string",
+                     "json_replace found invalid json at byte 10: closing bracket does not match",
+                     message37);
+
+  std::string buffer38 (1 << 18, '\0');
+  auto checked38 = [&buffer38] (const std::string &input)
+  {
+    ReplaceError error;
+    size_t len = json_replace_checked (input.data (), input.size (), buffer38.data (),
+                                       buffer38.size (), error);
+    if (error)
+      return std::string (error.message ()) + " at " + std::to_string (error.offset);
+    return buffer38.substr (0, len);
+  };
+  std::pair<std::string, std::string> cases38[] = {
+    {input2, json_replace (input2)},
+    {input32, json_replace (input32)},
+    {R"({"a_X": "v)", "unexpected end of input at 10"},
+    {R"({"a_X": ["v"])", "unexpected end of input at 13"},
+    {R"({"a": [1}, "b_X": "v"})", "closing bracket does not match at 8"},
+    {R"({"a_X": "v", "b": [1}, "c_X": "w"})", "closing bracket does not match at 20"},
+    {R"({"k": \ [}"_X": "v"})", "closing bracket does not match at 9"},
+    {input32 + "]", "closing bracket does not match at " + std::to_string (input32.size ())},
+    {std::string (JSON_REPLACE_MAX_DEPTH + 1, '['),
+     "nested deeper than JSON_REPLACE_MAX_DEPTH at 1024"},
+  };
+  for (json_engine engine : {json_engine::scanner, json_engine::structural_index})
+  {
+    replace_engine = engine;
+    for (const auto &[input, expected] : cases38)
+      json_test_compare (38, "checked", expected, checked38 (input));
+    replace_engine = json_engine::scanner;
+  }
+  ReplaceError error38;
+  json_replace_checked ("{}", 2, buffer38.data (), 1, error38);
+  json_test_compare (38, "checked capacity", JSON_REPLACE_OUTPUT_CAPACITY_ERROR_MSG,
+                     error38.message ());
+  ReplaceContext context38 (KeyMatcher ({"_X"}, {}), '#');
+  std::string partial38 (context38.replace (R"({"a_X": "v"} [)", error38));
+  json_test_compare (38, "context checked", R"({"a_X": "#"} [ 14)",
+                     partial38 + " " + std::to_string (error38.offset));
+  json_test_compare (38, "context checked", R"({"a_X": "#"})",
+                     std::string (context38.replace (R"({"a_X": "v"})", error38)));
+  // a context keeps its engine, whatever replace_engine is set to after it
+  ReplaceContext validating38 (KeyMatcher ({"_X"}, {}), '#', json_engine::validating);
+  replace_engine = json_engine::structural_index;
+  validating38.replace (R"({"a_X": "v", "b": nul})", error38);
+  json_test_compare (38, "context engine", "bad_literal", error38.code == json_error::bad_literal
+                                                              ? "bad_literal" : "none");
+  replace_engine = json_engine::scanner;
+#if defined(__cpp_lib_expected)
+  std::expected<size_t, ReplaceError> expected38 = json_replace_checked (input2,
+                                                                         buffer38.data (),
+                                                                         buffer38.size ());
+  json_test_compare (38, "expected", json_replace (input2), buffer38.substr (0, *expected38));
+  expected38 = json_replace_checked ("[\"a\", [}", buffer38.data (), buffer38.size (),
+                                     KeyMatcher ({"_X"}, {}));
+  ReplaceError unexpected38;
+  if (!expected38)
+    unexpected38 = expected38.error ();
+  json_test_compare (38, "expected error", "closing bracket does not match at 7",
+                     std::string (unexpected38.message ()) + " at " +
+                     std::to_string (unexpected38.offset));
+  json_test_compare (38, "expected string", json_replace (input16),
+                     json_replace_checked (input16).value ());
+  json_test_compare (38, "expected string error", "unexpected end of input",
+                     json_replace_checked ("{").error ().message ());
+#endif
+
+  KeyPathMatcher selector39 ({"payment.card.number", "user.*.ssn", "**.password",
+                              "items[*].price", "tags[1]", "[2]"});
+  std::string input39 = R"({"payment": {"card": {"number": "4111", "cvv": "1"}, "number": "x"},)"
+      R"( "product": {"number": "p"}, "user": {"a": {"ssn": "1"}, "b": {"ssn": "2",)"
+      R"( "c": {"ssn": "3"}}}, "deep": [{"x": {"password": "pw"}}], "password": ["a", 1],)"
+      R"( "items": [{"price": "9", "name": "n"}, {"price": {"v": "8"}}],)"
+      R"( "tags": ["a", "b", "c"], "card": {"number": "n", "s": "}]\"{"}})";
+  std::string expected39 = R"({"payment": {"card": {"number": "*", "cvv": "1"}, "number": "x"},)"
+      R"( "product": {"number": "p"}, "user": {"a": {"ssn": "*"}, "b": {"ssn": "*",)"
+      R"( "c": {"ssn": "3"}}}, "deep": [{"x": {"password": "*"}}], "password": ["*", 1],)"
+      R"( "items": [{"price": "*", "name": "n"}, {"price": {"v": "*"}}],)"
+      R"( "tags": ["a", "*", "c"], "card": {"number": "n", "s": "}]\"{"}})";
+  std::string records39 = input39 + "\n" + R"(["a", "b", "c", {"password": "d"}])" + "\n";
+  std::string expected_records39 = expected39 + "\n" + R"(["a", "b", "*", {"password": "*"}])"
+      + "\n";
+  for (json_engine engine : {json_engine::scanner, json_engine::structural_index,
+                             json_engine::validating})
+  {
+    replace_engine = engine;
+    std::string replaced39 = json_replace (input39, selector39);
+    std::string records_replaced39 = json_replace (records39, selector39);
+    std::string inplace39 = input39;
+    inplace39.resize (json_replace_inplace_with (inplace39.data (), inplace39.size (),
+                                                 selector39, char_replacement<'*'> ()));
+    replace_engine = json_engine::scanner;
+    json_test_compare (39, "key paths", expected39, replaced39);
+    json_test_compare (39, "key paths of records", expected_records39, records_replaced39);
+    json_test_compare (39, "key paths in place", expected39, inplace39);
+  }
+  json_test_compare (39, "key path masks", R"("a": {"b": ["*", {"c": "*"}]}, "b": "x")",
+                     json_replace (R"("a": {"b": ["y", {"c": "z"}]}, "b": "x")",
+                                   KeyPathMatcher ({"a"})));
+  json_test_compare (39, "key path skips", R"({"s": {"a": "}"}, "t": 5})",
+                     json_replace (R"({"s": {"a": "}"}, "t": 5})", KeyPathMatcher ({"t.u"})));
+  bool threw39 = false;
+  try
+  {
+    json_replace (R"({"s": {"a": [})", KeyPathMatcher ({"t"}));
+  }
+  catch (std::invalid_argument &e)
+  {
+    threw39 = true;
+  }
+  json_test_compare (39, "key path skips to the end", "true", threw39 ? "true" : "false");
+  size_t invalid39 = 0;
+  for (const char *path : {"", "a..b", "a.", "a[x]", "a[1", "[]", "a]b", "a[0]b"})
+  {
+    try
+    {
+      KeyPathMatcher matcher39 ({path});
+    }
+    catch (std::invalid_argument &e)
+    {
+      ++invalid39;
+    }
+  }
+  json_test_compare (39, "invalid key paths", "8", std::to_string (invalid39));
+
+  std::vector<std::string_view> records40 = {input2, R"({"a_X": [})", "", input16};
+  std::vector<size_t> offsets40 (records40.size () + 1);
+  std::vector<ReplaceError> errors40 (records40.size ());
+  OutputBuffer out40;
+  size_t failed40 = json_replace_many (records40, out40, offsets40, errors40);
+  json_test_compare (40, "many failed", "1 at 9", std::to_string (failed40) + " at " +
+                     std::to_string (errors40[1].offset));
+  json_test_compare (40, "many", json_replace (input2) + json_replace (input16),
+                     std::string (out40.view ()));
+  json_test_compare (40, "many offsets", json_replace (input16),
+                     std::string (out40.view ().substr (offsets40[3],
+                                                        offsets40[4] - offsets40[3])));
+  json_test_compare (40, "many empty", "true", offsets40[1] == offsets40[2] &&
+                     offsets40[2] == offsets40[3] && !errors40[2] ? "true" : "false");
+  size_t capacity40 = out40.capacity ();
+  records40 = {R"({"a_Y": "v", "b_X": "w"})", input2};
+  json_replace_many<'#'> (records40, out40, std::span (offsets40).first (3),
+                          KeyMatcher ({"_Y"}, {}));
+  json_test_compare (40, "many matcher", R"({"a_Y": "#", "b_X": "w"})",
+                     std::string (out40.view ().substr (0, offsets40[1])));
+  json_test_compare (40, "many reuses", "true", out40.capacity () == capacity40 ? "true" : "false");
+  bool threw40 = false;
+  try
+  {
+    json_replace_many (records40, out40, offsets40);
+  }
+  catch (std::length_error &e)
+  {
+    threw40 = true;
+  }
+  json_test_compare (40, "many offsets size", "true", threw40 ? "true" : "false");
+
+  std::string input41 = R"({"list": [)";
+  for (int i = 0; i < 300; ++i)
+    input41 += R"({"id": 1, "name_X": "a\"b,[{", "tags": ["x", "y\\"], "card_X": {"n": ["1",)"
+        R"( {"m": "2"}], "k": "v"}}, )";
+  input41 += R"("end"], "secret_X": [)";
+  for (int i = 0; i < 300; ++i)
+    input41 += R"("s,\"]", {"a": ["b"]}, )";
+  input41 += R"("last"], "n": null})";
+  WorkStealingPool pool41 (4);
+  json_split_buffers buffers41;
+  buffers41.min_chunk_size = 64;
+  std::string buffer41 (input41.size (), '\0');
+  auto parallel41 = [&] (std::string_view json, ReplaceError &error)
+  {
+    error = ReplaceError ();
+    return buffer41.substr (0, json_replace_parallel_into_with (json, pool41, &buffer41[0],
+                                                                suffix_matcher<"_X"> (),
+                                                                char_replacement<'*'> (),
+                                                                buffers41, error));
+  };
+  auto error_text41 = [] (const ReplaceError &error)
+  {
+    return std::string (error.message ()) + " at " + std::to_string (error.offset);
+  };
+  for (json_engine engine : {json_engine::scanner, json_engine::structural_index})
+  {
+    replace_engine = engine;
+    ReplaceError error41;
+    std::string parallel_replaced41 = parallel41 (input41, error41);
+    json_test_compare (41, "parallel", json_replace (input41), parallel_replaced41);
+    json_test_compare (41, "parallel cuts", "true", buffers41.batch.chunks.size () > 8 &&
+                       !error41 ? "true" : "false");
+    std::string half41 = input41.substr (0, input41.size () / 2);
+    for (const std::string &invalid41 : {half41 + "]" + input41.substr (half41.size ()),
+                                         input41.substr (0, input41.size () - 10) + "]",
+                                         input41.substr (0, input41.size () - 20)})
+    {
+      ReplaceError sequential41;
+      std::string sequential_replaced41 (invalid41.size (), '\0');
+      sequential_replaced41.resize (json_replace_checked (invalid41.data (), invalid41.size (),
+                                                          &sequential_replaced41[0],
+                                                          invalid41.size (), sequential41));
+      std::string parallel_invalid41 = parallel41 (invalid41, error41);
+      json_test_compare (41, "parallel error", error_text41 (sequential41),
+                         error_text41 (error41));
+      json_test_compare (41, "parallel error output", sequential_replaced41, parallel_invalid41);
+    }
+    replace_engine = json_engine::scanner;
+  }
+  std::string chained41 = R"({"a" "b_X": [)" + input41 + "]}";
+  json_test_compare (41, "parallel string after string", json_replace (chained41),
+                     json_replace_parallel (chained41, pool41));
+  json_test_compare (41, "parallel matcher", json_replace<'#'> (input41, KeyMatcher ({"_X"}, {})),
+                     json_replace_parallel<'#'> (input41, pool41, KeyMatcher ({"_X"}, {})));
+
+  std::string input42;
+  for (int i = 0; i < 2000; ++i)
+    input42 += R"({"id": 1, "name_X": "a\"b,[{", "tags_X": ["x", "y\\"], "k": "v"})" "\n";
+  auto pipeline42 = [] (const std::string &input, bool use_io_uring, bool from_file,
+                        size_t buffer_size)
+  {
+    int out_pipe[2];
+    int in_pipe[2] = {-1, -1};
+    if (pipe (out_pipe) < 0 || (!from_file && pipe (in_pipe) < 0))
+      return std::string ("pipe failed");
+    FILE *file = from_file ? tmpfile () : nullptr;
+    if (file)
+    {
+      fwrite (input.data (), 1, input.size (), file);
+      fflush (file);
+      rewind (file);
+    }
+    std::thread writer ([&input, fd = in_pipe[1]]
+    {
+      for (size_t written = 0; fd >= 0 && written < input.size ();)
+      {
+        ssize_t len = write (fd, input.data () + written, input.size () - written);
+        if (len <= 0)
+          break;
+        written += len;
+      }
+      if (fd >= 0)
+        close (fd);
+    });
+    std::string output;
+    std::thread reader ([&output, fd = out_pipe[0]]
+    {
+      char buffer[4096];
+      ssize_t len;
+      while ((len = read (fd, buffer, sizeof (buffer))) > 0)
+        output.append (buffer, len);
+    });
+    std::string error;
+    try
+    {
+      JsonReplacePipeline pipeline (file ? fileno (file) : in_pipe[0], out_pipe[1],
+                                    KeyMatcher ({"_X"}, {}), '#', 3, buffer_size, use_io_uring);
+      pipeline.run ();
+    }
+    catch (std::exception &e)
+    {
+      error = e.what ();
+    }
+    close (out_pipe[1]);
+    reader.join ();
+    writer.join ();
+    close (out_pipe[0]);
+    if (file)
+      fclose (file);
+    else
+      close (in_pipe[0]);
+    return error.empty () ? output : error;
+  };
+  for (bool use_io_uring : {true, false})
+    for (bool from_file : {false, true})
+      for (size_t buffer_size : {100, 1 << 16})
+        json_test_compare (42, std::string ("pipeline") + (use_io_uring ? " on io_uring" : "") +
+                           (from_file ? " from a file" : " from a pipe"),
+                           json_replace<'#'> (input42, KeyMatcher ({"_X"}, {})),
+                           pipeline42 (input42, use_io_uring, from_file, buffer_size));
+  for (bool use_io_uring : {true, false})
+    json_test_compare (42, "pipeline end", JSON_REPLACE_END_ERROR_MSG,
+                       pipeline42 (R"({"a_X": ["b")", use_io_uring, false, 4));
+  // a socket is read and written through the same descriptor
+  for (bool use_io_uring : {true, false})
+  {
+    int sockets42[2];
+    std::string output42;
+    std::string error42;
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, sockets42) < 0)
+      error42 = "socketpair failed";
+    else
+    {
+      std::thread peer42 ([&input42, &output42, fd = sockets42[1]]
+      {
+        std::thread writer ([&input42, fd]
+        {
+          write_all (fd, input42.data (), input42.size ());
+          shutdown (fd, SHUT_WR);
+        });
+        char buffer[4096];
+        ssize_t len;
+        while ((len = read (fd, buffer, sizeof (buffer))) > 0)
+          output42.append (buffer, len);
+        writer.join ();
+      });
+      try
+      {
+        JsonReplacePipeline pipeline (sockets42[0], sockets42[0], KeyMatcher ({"_X"}, {}), '#',
+                                      3, 100, use_io_uring);
+        pipeline.run ();
+      }
+      catch (std::exception &e)
+      {
+        error42 = e.what ();
+      }
+      shutdown (sockets42[0], SHUT_WR);
+      peer42.join ();
+      close (sockets42[0]);
+      close (sockets42[1]);
+    }
+    json_test_compare (42, std::string ("pipeline through a socket") +
+                           (use_io_uring ? " on io_uring" : ""),
+                       json_replace<'#'> (input42, KeyMatcher ({"_X"}, {})),
+                       error42.empty () ? output42 : error42);
+  }
+
+  std::string expected43 = json_replace<'#'> (input42, KeyMatcher ({"_X"}, {}));
+  auto compress43 = [] (json_codec codec, std::string_view input)
+  {
+    std::string output;
+    JsonCompressSink compress (codec, [&output] (const char *data, size_t len)
+                               { output.append (data, len); }, 0, 100);
+    compress.write (input.data (), input.size ());
+    compress.finish ();
+    return output;
+  };
+  auto decompress43 = [] (std::string_view input, size_t chunk_size, json_codec codec)
+  {
+    std::string output;
+    try
+    {
+      JsonCompressSink compress (codec, [&output] (const char *data, size_t len)
+                                 { output.append (data, len); });
+      JsonReplaceStream stream ([&compress] (const char *data, size_t len)
+                                { compress.write (data, len); }, KeyMatcher ({"_X"}, {}), '#');
+      JsonDecompressStream decompress (stream, 100);
+      for (size_t i = 0; i < input.size (); i += chunk_size)
+        decompress.feed (input.data () + i, std::min (chunk_size, input.size () - i));
+      decompress.finish ();
+      compress.finish ();
+    }
+    catch (std::exception &e)
+    {
+      output = e.what ();
+    }
+    return output;
+  };
+  json_test_compare (43, "decompress plain", expected43,
+                     decompress43 (input42, 1, json_codec::plain));
+  json_test_compare (43, "decompress short plain", json_replace ("[]"),
+                     decompress43 ("[]", 1, json_codec::plain));
+  for (json_codec codec : {json_codec::gzip, json_codec::zstd})
+  {
+    if (!json_codec_available (codec))
+    {
+      json_test_compare (43, "compress without the codec", JSON_REPLACE_CODEC_SUPPORT_ERROR_MSG,
+                         decompress43 (input42, 1, codec));
+      continue;
+    }
+    // two members or frames, as from concatenated files
+    size_t half43 = input42.find ('\n', input42.size () / 2) + 1;
+    std::string compressed43 = compress43 (codec, std::string_view (input42).substr (0, half43)) +
+                               compress43 (codec, std::string_view (input42).substr (half43));
+    for (size_t chunk_size : {1, 4096})
+      json_test_compare (43, "decompress", expected43,
+                         decompress43 (compressed43, chunk_size, json_codec::plain));
+    // replacing again leaves the output as it is
+    std::string recompressed43 = decompress43 (compressed43, 4096, codec);
+    json_test_compare (43, "recompress", "true",
+                       recompressed43.size () < expected43.size () ? "true" : "false");
+    json_test_compare (43, "recompress", expected43,
+                       decompress43 (recompressed43, 4096, json_codec::plain));
+    json_test_compare (43, "decompress truncated", JSON_REPLACE_DECOMPRESS_ERROR_MSG,
+                       decompress43 (compressed43.substr (0, compressed43.size () - 10), 4096,
+                                     json_codec::plain));
+  }
+
+  std::string record44 = R"({"id": 1, "name_X": "a\"b,[{ a longer value", "tags_X": ["x", ""]})";
+  std::string input44;
+  for (int i = 0; i < 2000; ++i)
+    input44 += record44;
+  auto replaced_len44 = [] (const std::string &json, const auto &matches,
+                            const auto &replacement)
+  {
+    ReplaceError error;
+    size_t len = json_replaced_len_with (json.data (), json.size (), matches, replacement,
+                                         error);
+    return error ? std::string (error.message ()) + " at " + std::to_string (error.offset)
+                 : std::to_string (len);
+  };
+  auto written_len44 = [] (const std::string &json, const auto &matches,
+                           const auto &replacement)
+  {
+    ReplaceError error;
+    std::string dest (max_replaced_len (json.size (), replacement), '\0');
+    size_t len = json_replace_checked_with (json.data (), json.size (), &dest[0], dest.size (),
+                                            matches, replacement, error);
+    return error ? std::string (error.message ()) + " at " + std::to_string (error.offset)
+                 : std::to_string (len);
+  };
+  KeyMatcher matcher44 ({"_X"}, {"na"});
+  KeyPathMatcher selector44 ({"tags_X"});
+  for (const std::string &json44 : {input41, input42, input44, std::string (R"("a_X": "")"),
+                                    input44.substr (0, input44.size () / 2 + 5),
+                                    std::string (R"({"a_X": ["b"]]})")})
+  {
+    json_test_compare (44, "replaced length",
+                       written_len44 (json44, suffix_matcher<"_X"> (), char_replacement<'*'> ()),
+                       replaced_len44 (json44, suffix_matcher<"_X"> (), char_replacement<'*'> ()));
+    json_test_compare (44, "replaced length with a path",
+                       written_len44 (json44, selector44, char_replacement<'*'> ()),
+                       replaced_len44 (json44, selector44, char_replacement<'*'> ()));
+    json_test_compare (44, "padded length",
+                       written_len44 (json44, matcher44, pad_replacement {'#'}),
+                       replaced_len44 (json44, matcher44, pad_replacement {'#'}));
+    json_test_compare (44, "literal length",
+                       written_len44 (json44, matcher44, literal_replacement ("masked")),
+                       replaced_len44 (json44, matcher44, literal_replacement ("masked")));
+    json_test_compare (44, "hashed length",
+                       written_len44 (json44, matcher44, hash_replacement {1, 2, 8}),
+                       replaced_len44 (json44, matcher44, hash_replacement {1, 2, 8}));
+  }
+  json_test_compare (44, "json_replaced_len", std::to_string (json_replace (input44).size ()),
+                     std::to_string (json_replaced_len (input44)));
+  json_test_compare (44, "json_replaced_len with a matcher",
+                     std::to_string (json_replace (input44, matcher44).size ()),
+                     std::to_string (json_replaced_len (input44, matcher44)));
+  std::string error44;
+  try
+  {
+    json_replaced_len (input44.substr (0, input44.size () / 2 + 5));
+  }
+  catch (std::invalid_argument &e)
+  {
+    error44 = e.what ();
+  }
+  json_test_compare (44, "json_replaced_len end", JSON_REPLACE_END_ERROR_MSG, error44);
+  // the new strings hold no more than the copy, whether or not they fit the scratch buffer
+  for (const std::string &json44 : {input44, record44 + record44})
+    json_test_compare (44, "exact capacity", "true",
+                       json_replace (json44).capacity () < json44.size () * 3 / 4 ? "true"
+                                                                                    : "false");
+
+  // one index, replaced again with other keys, gives what reading the json again gives
+  KeyMatcher matcher45 ({"_X"}, {"na"});
+  KeyMatcher other45 ({"b", "number"}, {"k"});
+  // a key without a value ends with its object, and so does the value of a_X
+  std::string dangling45 = R"({"a_X": {"k"}, "b": "c"}, "d_X": ["e", {"f"}, "g"])";
+  for (const std::string &json45 : {input1, input4, input5, input16, input23, input24, input25,
+                                    input26, input35, input36, input39, input44, dangling45})
+  {
+    JsonKeyIndex index45 (json45);
+    JsonKeyIndex loaded45 = JsonKeyIndex::load (index45.save ());
+    json_test_compare (45, "remask", json_replace (json45), json_remask (json45, index45,
+                                                                          KeyMatcher ({"_X"})));
+    json_test_compare (45, "remask with other keys", json_replace<'#'> (json45, other45),
+                       json_remask<'#'> (json45, loaded45, other45));
+    json_test_compare (45, "remask with patterns",
+                       json_replace (json45, matcher16, literal_replacement ("<hidden>")),
+                       json_remask_with (json45, index45, matcher16,
+                                         literal_replacement ("<hidden>")));
+    json_test_compare (45, "remask with a suffix",
+                       json_replace_with (json45, suffix_matcher<"_X"> (), pad_replacement {'#'}),
+                       json_remask_with (json45, loaded45, suffix_matcher<"_X"> (),
+                                         pad_replacement {'#'}));
+    json_test_compare (45, "remask hashed", json_replace (json45, matcher45, hash35),
+                       json_remask_with (json45, index45, matcher45, hash35));
+  }
+  auto index_error45 = [] (const auto &run)
+  {
+    try
+    {
+      run ();
+    }
+    catch (std::invalid_argument &e)
+    {
+      return std::string (e.what ());
+    }
+    return std::string ("no error");
+  };
+  JsonKeyIndex index45 (input35);
+  std::string saved45 = index45.save ();
+  json_test_compare (45, "index of a cut json", JSON_REPLACE_END_ERROR_MSG, index_error45 ([&] ()
+  {
+    JsonKeyIndex (input35.substr (0, input35.size () - 3));
+  }));
+  json_test_compare (45, "index of another json", JSON_REPLACE_KEY_INDEX_DOCUMENT_ERROR_MSG,
+                     index_error45 ([&] () { json_remask (input35 + " ", index45, matcher45); }));
+  std::string shifted45 = " " + input35.substr (0, input35.size () - 1);
+  json_test_compare (45, "index of a changed json", JSON_REPLACE_KEY_INDEX_DOCUMENT_ERROR_MSG,
+                     index_error45 ([&] () { json_remask (shifted45, index45, matcher45); }));
+  for (size_t cut45 : {size_t (0), size_t (20), saved45.size () - 1})
+    json_test_compare (45, "cut index", JSON_REPLACE_KEY_INDEX_FORMAT_ERROR_MSG,
+                       index_error45 ([&] () { JsonKeyIndex::load (saved45.substr (0, cut45)); }));
+  // the end of the first entry, moved past the end of the json
+  std::string corrupt45 = saved45;
+  corrupt45[8 + 16 + 8] = static_cast<char> (input35.size () + 1);
+  json_test_compare (45, "corrupt index", JSON_REPLACE_KEY_INDEX_FORMAT_ERROR_MSG,
+                     index_error45 ([&] () { JsonKeyIndex::load (corrupt45); }));
+
+  char path45[] = "/tmp/json_replace_testXXXXXX";
+  int fd45 = mkstemp (path45);
+  json_test_compare (45, "temporary file", "true", fd45 >= 0 ? "true" : "false");
+  write_all (fd45, input16.data (), input16.size ());
+  close (fd45);
+  std::string index_path45 = std::string (path45) + ".index";
+  std::string out_path45 = std::string (path45) + ".out";
+  // the first run saves the index, and the second one replaces other keys from it
+  for (const char *suffix45 : {"_X", "number"})
+  {
+    const char *argv45[] = {"json_replace", "-s", suffix45, "--key-index", index_path45.c_str (),
+                            path45, out_path45.c_str ()};
+    cli_options options45;
+    bool parsed45 = parse_cli_options (sizeof (argv45) / sizeof (argv45[0]),
+                                       const_cast<char **> (argv45), options45);
+    json_test_compare (45, "parsed options", "true", parsed45 ? "true" : "false");
+    if (parsed45)
+      run_cli (options45);
+    std::ifstream out45 (out_path45);
+    json_test_compare (45, std::string ("file with a key index, ") + suffix45,
+                       json_replace (input16, KeyMatcher ({suffix45})),
+                       std::string ((std::istreambuf_iterator<char> (out45)),
+                                    std::istreambuf_iterator<char> ()));
+  }
+  std::ifstream index_file45 (index_path45, std::ios::binary);
+  json_test_compare (45, "saved key index", JsonKeyIndex (input16).save (),
+                     std::string ((std::istreambuf_iterator<char> (index_file45)),
+                                  std::istreambuf_iterator<char> ()));
+  unlink (path45);
+  unlink (index_path45.c_str ());
+  unlink (out_path45.c_str ());
+
+  // records of a few layouts, matched from the cache after the first record of each
+  std::vector<std::string> records46;
+  for (int i = 0; i < 30; ++i)
+    records46.push_back (i % 3 == 0 ? input24 : i % 3 == 1 ? input35 : input16);
+  size_t calls46 = 0;
+  auto counted46 = [&calls46, &matcher16] (const char *key, const char *key_end)
+  {
+    ++calls46;
+    return matcher16 (key, key_end);
+  };
+  ShapeCache cache46 (counted46);
+  ShapeCache small46 (matcher16, 3);
+  std::string cached46;
+  std::string expected46;
+  std::string small_cached46;
+  for (const std::string &record46 : records46)
+  {
+    expected46 += json_replace (record46, matcher16) + "\n";
+    cached46 += json_replace_with (record46, cache46, char_replacement<'*'> ()) + "\n";
+    small_cached46 += json_replace_with (record46, small46, char_replacement<'*'> ()) + "\n";
+  }
+  json_test_compare (46, "shape cache", expected46, cached46);
+  json_test_compare (46, "full shape cache", expected46, small_cached46);
+  json_test_compare (46, "shape cache calls", std::to_string (cache46.size ()),
+                     std::to_string (calls46));
+  // every key after the first 3 records but the one after "a_X", which starts two layouts,
+  // and the first key of the fourth record, which nothing followed before
+  json_test_compare (46, "shape cache hits", std::to_string (9 * (6 + 4 + 9 - 2) - 1),
+                     std::to_string (cache46.hits ()));
+  json_test_compare (46, "full shape cache size", "3", std::to_string (small46.size ()));
+  std::string storage46;
+  json_test_compare (46, "shape cache candidates", "true",
+                     json_replace_view_with (input2, storage46, ShapeCache (KeyMatcher ({"_Y"})),
+                                             char_replacement<'*'> ()).data () == input2.data ()
+                         ? "true" : "false");
+
+#if defined(JSON_REPLACE_COROUTINES)
+  // the pieces add up to the copy, and all but the last one are at least as long as asked for
+  for (size_t piece_size47 : {size_t (0), size_t (1), size_t (7), size_t (4096), size_t (1 << 20)})
+  {
+    std::string joined47;
+    size_t last47 = piece_size47;
+    bool long_enough47 = true;
+    for (std::string_view piece47 : json_replace_pieces (input44, matcher16, piece_size47, '#'))
+    {
+      long_enough47 = long_enough47 && last47 >= piece_size47 && !piece47.empty ();
+      last47 = piece47.size ();
+      joined47 += piece47;
+    }
+    json_test_compare (47, "pieces of " + std::to_string (piece_size47),
+                       json_replace<'#'> (input44, matcher16), joined47);
+    json_test_compare (47, "long enough pieces", "true", long_enough47 ? "true" : "false");
+  }
+  size_t pieces47 = 0;
+  for (std::string_view piece47 : json_replace_pieces (input44, 4096))
+  {
+    (void) piece47;
+    if (++pieces47 == 3)
+      break;
+  }
+  json_test_compare (47, "stopped pieces", "3", std::to_string (pieces47));
+  std::string cut47;
+  std::string error47;
+  std::string cut_input47 = input44.substr (0, input44.size () / 2 + 5);
+  try
+  {
+    for (std::string_view piece47 : json_replace_pieces (cut_input47, 4096))
+      cut47 += piece47;
+  }
+  catch (std::invalid_argument &e)
+  {
+    error47 = e.what ();
+  }
+  json_test_compare (47, "cut pieces", JSON_REPLACE_END_ERROR_MSG, error47);
+  // every whole record before the cut was yielded, but for the last piece
+  std::string whole47 = json_replace (input44.substr (0, input44.size () / 2 / record44.size () *
+                                                         record44.size ()));
+  json_test_compare (47, "pieces before the cut", "true",
+                     cut47.size () + 4096 >= whole47.size () &&
+                         json_replace (input44).compare (0, cut47.size (), cut47) == 0
+                         ? "true" : "false");
+  pieces47 = 0;
+  for (std::string_view piece47 : json_replace_pieces (""))
+    pieces47 += piece47.size () + 1;
+  json_test_compare (47, "no pieces", "0", std::to_string (pieces47));
+#endif
+
+  // the C interface
+  std::string input48 = R"({"card_X" : "1234", "id" : 7, "pin" : {"code" : "00"}})";
+  std::string dest48 (jr_max_replaced_len (input48.size ()), '\0');
+  size_t len48 = 0;
+  size_t offset48 = 0;
+  int status48 = jr_replace_into (input48.data (), input48.size (), dest48.data (),
+                                  dest48.size (), &len48, &offset48);
+  json_test_compare (48, "jr_replace_into", json_replace (input48),
+                     std::string (dest48.data (), len48));
+  json_test_compare (48, "jr_replace_into status", jr_status_message (JR_OK),
+                     jr_status_message (status48));
+  status48 = jr_replace_into (input48.data (), input48.size () - 1, dest48.data (),
+                              dest48.size (), &len48, &offset48);
+  json_test_compare (48, "cut jr_replace_into", "unexpected_end " +
+                         std::to_string (input48.size () - 1),
+                     std::string (status48 == JR_UNEXPECTED_END ? "unexpected_end " : "") +
+                         std::to_string (offset48));
+  status48 = jr_replace_into (input48.data (), input48.size (), dest48.data (),
+                              dest48.size () - 1, &len48, nullptr);
+  json_test_compare (48, "short jr_replace_into", std::to_string (JR_OUTPUT_CAPACITY),
+                     std::to_string (status48));
+
+  const char *suffixes48[] = {"_X"};
+  const char *prefixes48[] = {"pi"};
+  json_test_compare (48, "quote context", "true",
+                     jr_context_new (suffixes48, 1, prefixes48, 1, '"') ? "false" : "true");
+  jr_context *context48 = jr_context_new (suffixes48, 1, prefixes48, 1, '#');
+  const char *out48 = nullptr;
+  status48 = jr_context_replace (context48, input48.data (), input48.size (), &out48, &len48,
+                                 nullptr);
+  json_test_compare (48, "jr_context_replace",
+                     json_replace<'#'> (input48, KeyMatcher ({"_X"}, {"pi"})) + " 0",
+                     std::string (out48, len48) + " " + std::to_string (status48));
+  status48 = jr_context_replace_into (context48, input48.data (), input48.size (),
+                                      dest48.data (), dest48.size (), &len48, nullptr);
+  json_test_compare (48, "jr_context_replace_into", std::string (out48, len48),
+                     std::string (dest48.data (), len48));
+
+  std::string data48 = input48 + "{\"a_X\" : " + input48 + "[\"b\"]";
+  size_t offsets48[] = {0, input48.size (), data48.size () - 5, data48.size ()};
+  size_t out_offsets48[4];
+  size_t failed48 = 0;
+  status48 = jr_context_replace_many (context48, data48.data (), offsets48, 3, &out48,
+                                      out_offsets48, &failed48);
+  std::string many48;
+  for (size_t i = 0; i < 3; ++i)
+    many48 += std::string (out48 + out_offsets48[i], out_offsets48[i + 1] - out_offsets48[i]) +
+              '|';
+  json_test_compare (48, "jr_context_replace_many",
+                     std::string (jr_status_message (JR_OK)) + " 1 " + json_replace<'#'> (
+                         input48, KeyMatcher ({"_X"}, {"pi"})) + "||[\"b\"]|",
+                     std::string (jr_status_message (status48)) + " " +
+                         std::to_string (failed48) + " " + many48);
+  offsets48[1] = data48.size ();
+  status48 = jr_context_replace_many (context48, data48.data (), offsets48, 3, &out48,
+                                      out_offsets48, nullptr);
+  json_test_compare (48, "unordered offsets", std::to_string (JR_INVALID_ARGUMENT),
+                     std::to_string (status48));
+  json_test_compare (48, "bad engine", std::to_string (JR_INVALID_ARGUMENT),
+                     std::to_string (jr_context_set_engine (context48, 3)));
+  jr_context_set_engine (context48, JR_ENGINE_VALIDATING);
+  std::string literal48 = R"({"a_X": "v", "b": nul})";
+  status48 = jr_context_replace (context48, literal48.data (), literal48.size (), &out48,
+                                 &len48, nullptr);
+  json_test_compare (48, "validating context", std::to_string (JR_BAD_LITERAL),
+                     std::to_string (status48));
+  jr_context_free (context48);
+
+  jr_context *default48 = jr_context_new (nullptr, 0, nullptr, 0, JSON_REPLACE_CHAR);
+  status48 = jr_context_replace (default48, input48.data (), input48.size (), &out48, &len48,
+                                 nullptr);
+  json_test_compare (48, "default context", json_replace (input48),
+                     std::string (out48, len48));
+  jr_context_free (default48);
+
+  if (json_test_failures != 0)
+  {
+    std::cout << "Failed " << json_test_failures << " tests!" << std::endl;
+    return false;
+  }
+  std::cout << "Passed all tests!" << std::endl;
+  return true;
+}
+
+/**
+ * The inputs of tests 1 to 8, which cover the edge cases of the scanner. They are benchmarked,
+ * and written out by --write-corpus to seed the fuzz target.
+ */
+const std::pair<const char *, const char *> test_corpus[] = {
+    {"various_inputs", R"("key" : "value" , "1":"2", "array0" : [], "arr1": ["hello"], "arr2":["1" , "2,"], "arr3:" : ["\"]"])"},
+    {"various_replacements", R"("key" : "value", "k2_X": "value2", "k3_X": ["abc"], "k4_X": ["a", "b","c"])"},
+    {"escaped_quotes", R"("key" : "va\"l[ue]" ,
+"k\"1[e]:,y":["[h,i]", "12:{}\"", ""]   ,   "{\] b0_X" : "v\a\"l[ue]", "key_X": ["[h,i]", "12:{}\"", ""])"},
+    {"hebrew", R"("key" : "אב", "key2" : "[עברית]", "key3_X" : "עברית", "key4_X":["א"])"},
+    {"curly_bracketed", R"({"key" : "val", "key_X" : "val"})"},
+    {"japanese", R"("key1": " 形式 ", "key2":[" 形式 "], "key3_X": " 形式 ", "key4_X" : [" 形式 "])"},
+    {"short_keys", R"("k":"val", "_X": "val2", "": "")"},
+};
+
+/**
+ * Writes every input of test_corpus into its own file in dir, which has to exist, as the seed
+ * corpus of the fuzz target.
+ */
+void write_test_corpus (const std::string &dir) noexcept (false)
+{
+  for (const std::pair<const char *, const char *> &corpus : test_corpus)
+  {
+    std::ofstream out (dir + "/" + corpus.first + ".json", std::ios::binary);
+    out << corpus.second;
+    if (!out)
+      throw std::runtime_error ("could not write " + dir + "/" + corpus.first + ".json");
+  }
+}
+
+#if defined(JSON_REPLACE_FUZZ)
+
+/**
+ * Stops the fuzzer at an input that an engine replaces differently from the reference.
+ */
+void fuzz_check (bool same, const std::string &engine)
+{
+  if (same)
+    return;
+  std::cerr << "json_replace fuzz: " << engine << " differs from the scalar scanner" << std::endl;
+  abort ();
+}
+
+/**
+ * @return whether the first string outside of any bracket is not followed by a colon, which
+ *         the validating engine reads as a value, where the other engines read a key.
+ */
+bool starts_with_top_level_value (const char *src, const char *end)
+{
+  size_t depth = 0;
+  while (src != end)
+  {
+    char c = *src++;
+    if (c == '{' || c == '[')
+      ++depth;
+    else if ((c == '}' || c == ']') && depth != 0)
+      --depth;
+    else if (c == '"')
+    {
+      src = skip_json_string_body (src, end);
+      if (src == end)
+        return false;
+      if (depth != 0)
+      {
+        ++src;
+        continue;
+      }
+      for (++src; src != end && is_json_whitespace (*src);)
+        ++src;
+      return src == end || *src != ':';
+    }
+  }
+  return false;
+}
+
+/**
+ * The libFuzzer target, built with JSON_REPLACE_FUZZ defined, in place of main.
+ * Replaces data with every engine, string kernel and index kernel, and through every entry
+ * point that can tell the same output and error, and aborts where one of them differs from
+ * the scanner with the scalar string kernel. The validating engine, which is stricter, is only
+ * compared where it accepts the input, and the stream only where the input is valid.
+ * Ex. clang++ -std=c++20 -O1 -g -fsanitize=fuzzer,address,undefined -DJSON_REPLACE_FUZZ
+ *             json_replace.cpp json_replace_c.cpp -o json_replace_fuzz
+ *     json_replace --write-corpus corpus && json_replace_fuzz corpus
+ */
+extern "C" int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+  static const KeyMatcher matcher ({JSON_REPLACE_TARGET_SUFFIX}, {});
+  static WorkStealingPool pool (4);
+  static json_split_buffers split;
+  split.min_chunk_size = 1;
+  std::string_view json (reinterpret_cast<const char *> (data), size);
+  suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> matches;
+  char_replacement<JSON_REPLACE_CHAR> replacement;
+  const json_string_kernel *best_string_kernel = string_kernel;
+  const json_index_kernel *best_index_kernel = index_kernel;
+
+  auto replace = [&] (json_engine engine, ReplaceError &error)
+  {
+    replace_engine = engine;
+    std::string out (size, '\0');
+    out.resize (json_replace_checked_with (json.data (), size, &out[0], size, matches,
+                                           replacement, error));
+    replace_engine = json_engine::scanner;
+    return out;
+  };
+  string_kernel = &string_kernels[0];
+  ReplaceError expected_error;
+  std::string expected = replace (json_engine::scanner, expected_error);
+  // the engines stop at the same byte, but can have written a different part of the copy
+  auto same = [&] (const std::string &out, const ReplaceError &error)
+  {
+    return error.code == expected_error.code && error.offset == expected_error.offset &&
+        (error || out == expected);
+  };
+
+  ReplaceError error;
+  for (size_t k = 0; k < available_string_kernels (); ++k)
+  {
+    string_kernel = &string_kernels[k];
+    fuzz_check (same (replace (json_engine::scanner, error), error),
+                std::string ("the ") + string_kernel->name + " string kernel");
+  }
+  string_kernel = best_string_kernel;
+  for (size_t k = 0; k < available_index_kernels (); ++k)
+  {
+    index_kernel = &index_kernels[k];
+    fuzz_check (same (replace (json_engine::structural_index, error), error),
+                std::string ("the structural index engine with the ") + index_kernel->name +
+                    " index kernel");
+  }
+  index_kernel = best_index_kernel;
+
+  std::string inplace (json);
+  inplace.resize (json_replace_checked_with (inplace.data (), size, &inplace[0], size, matches,
+                                             replacement, error));
+  fuzz_check (same (inplace, error), "replacing in place");
+
+  std::string matched (size, '\0');
+  matched.resize (json_replace_checked_with (json.data (), size, &matched[0], size, matcher,
+                                             replacement, error));
+  fuzz_check (same (matched, error), "KeyMatcher");
+
+  // kept between inputs, so that it is also run full
+  static ShapeCache<KeyMatcher> shapes (matcher, 64);
+  std::string shaped (size, '\0');
+  shaped.resize (json_replace_checked_with (json.data (), size, &shaped[0], size, shapes,
+                                            replacement, error));
+  fuzz_check (same (shaped, error), "ShapeCache");
+
+  size_t sized = json_replaced_len_with (json.data (), size, matches, replacement, error);
+  fuzz_check (same (expected, error) && (error || sized == expected.size ()),
+              "json_replaced_len");
+
+  bool indexed = false;
+  std::string remasked;
+  try
+  {
+    JsonKeyIndex key_index (json);
+    indexed = true;
+    remasked = json_remask_with (json, JsonKeyIndex::load (key_index.save ()), matches,
+                                 replacement);
+  }
+  catch (std::invalid_argument &)
+  {
+  }
+  fuzz_check (expected_error ? !indexed : remasked == expected, "JsonKeyIndex");
+
+  for (json_engine engine : {json_engine::scanner, json_engine::structural_index})
+  {
+    replace_engine = engine;
+    error = ReplaceError ();
+    std::string parallel (size, '\0');
+    parallel.resize (json_replace_parallel_into_with (json, pool, &parallel[0], matches,
+                                                      replacement, split, error));
+    replace_engine = json_engine::scanner;
+    fuzz_check (same (parallel, error), "json_replace_parallel");
+  }
+
+  OutputBuffer many;
+  size_t offsets[2];
+  ReplaceError many_error;
+  json_replace_many_with (std::span<const std::string_view> (&json, 1), many, offsets, matches,
+                          replacement, std::span<ReplaceError> (&many_error, 1));
+  fuzz_check (same (std::string (many.view ()), many_error), "json_replace_many");
+
+  std::string validated = replace (json_engine::validating, error);
+  if (!error && !starts_with_top_level_value (json.data (), json.data () + size))
+    fuzz_check (!expected_error && validated == expected, "the validating engine");
+
+  if (!expected_error)
+  {
+    std::string streamed;
+    JsonReplaceStream stream ([&streamed] (const char *chunk, size_t len)
+                              { streamed.append (chunk, len); }, matcher);
+    // chunks of a few bytes split keys, values and escapes between feeds
+    size_t chunk_size = size % 7 + 1;
+    for (size_t i = 0; i < size; i += chunk_size)
+      stream.feed (json.data () + i, std::min (chunk_size, size - i));
+    stream.finish ();
+    fuzz_check (streamed == expected, "JsonReplaceStream");
+#if defined(JSON_REPLACE_COROUTINES)
+    std::string pieces;
+    for (std::string_view piece : json_replace_pieces (json, matcher, chunk_size))
+      pieces += piece;
+    fuzz_check (pieces == expected, "json_replace_pieces");
+#endif
+  }
+  return 0;
+}
+
+#endif
+
+#if defined(JSON_REPLACE_BENCHMARK)
+
+/**
+ * Generates newline delimited records of about record_size bytes each, the same for every run.
+ * @param total_size size of all records together, at least one record is generated
+ * @param record_size size of each record
+ * @param density fraction of the keys whose values are replaced
+ * @param value_len length of the string values
+ */
+std::string generate_benchmark_records (size_t total_size, size_t record_size, double density,
+                                        size_t value_len)
+{
+  uint64_t seed = 0x9e3779b97f4a7c15;
+  auto next_random = [&seed] ()
+  {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+  };
+  std::string records;
+  do
+  {
+    size_t record_begin = records.size ();
+    records += '{';
+    for (size_t field = 0; records.size () - record_begin < record_size; ++field)
+    {
+      if (field > 0)
+        records += ", ";
+      records += "\"field" + std::to_string (field);
+      if (static_cast<double> (next_random () % 1000) < density * 1000)
+        records += JSON_REPLACE_TARGET_SUFFIX;
+      records += "\": ";
+      std::string value;
+      for (size_t i = 0; i < value_len; ++i)
+        value += static_cast<char> ('a' + next_random () % 26);
+      // every so often an escaped quote, so the escape path is measured too
+      if (value_len > 4 && next_random () % 4 == 0)
+        value.replace (value_len / 2, 2, "\\\"");
+      if (field % 5 == 4)
+        records += "[\"" + value + "\", \"" + value + "\"]";
+      else
+        records += "\"" + value + "\"";
+    }
+    records += "}\n";
+  } while (records.size () < total_size);
+  return records;
+}
+
+size_t count_records (const std::string &input)
+{
+  return std::max<size_t> (1, std::count (input.begin (), input.end (), '\n'));
+}
+
+/**
+ * Runs replace on input every iteration, and reports bytes and records per second.
+ */
+template <typename Replace>
+void run_benchmark (benchmark::State &state, const std::string &input, Replace replace)
+{
+  for (auto _ : state)
+    benchmark::DoNotOptimize (replace (input));
+  state.SetBytesProcessed (static_cast<int64_t> (state.iterations () * input.size ()));
+  state.counters["records"] = benchmark::Counter (
+      static_cast<double> (state.iterations () * count_records (input)),
+      benchmark::Counter::kIsRate);
+}
+
+/**
+ * Registers every engine over input, under names starting with name.
+ */
+void register_engine_benchmarks (const std::string &name, const std::string &input)
+{
+  static std::vector<char> buffer;
+  static const KeyMatcher matcher ({"_X", "_ssn", "_card", "_password", "_token", "_secret",
+                                    "_email", "_phone", "_address", "_iban"},
+                                   {"secret_", "private_"});
+
+  benchmark::RegisterBenchmark ((name + "/json_replace(const char *)").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    run_benchmark (state, input, [] (const std::string &str)
+    {
+      return json_replace (str.c_str ());
+    });
+  });
+  benchmark::RegisterBenchmark ((name + "/json_replace(const std::string &)").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    run_benchmark (state, input, [] (const std::string &str) { return json_replace (str); });
+  });
+  benchmark::RegisterBenchmark ((name + "/json_replace(KeyMatcher)").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    run_benchmark (state, input, [] (const std::string &str)
+    {
+      return json_replace (str, matcher);
+    });
+  });
+  benchmark::RegisterBenchmark ((name + "/json_replace(KeyPathMatcher)").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    static const KeyPathMatcher selector ({"field1_X", "field7_X", "field4.*", "**.password"});
+    run_benchmark (state, input, [] (const std::string &str)
+    {
+      return json_replace (str, selector);
+    });
+  });
+  benchmark::RegisterBenchmark ((name + "/ReplaceContext").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    ReplaceContext context;
+    run_benchmark (state, input, [&context] (const std::string &str)
+    {
+      return context.replace (str).size ();
+    });
+  });
+  benchmark::RegisterBenchmark ((name + "/json_replace_view").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    run_benchmark (state, input, [] (const std::string &str)
+    {
+      static std::string storage;
+      return json_replace_view (str, storage).size ();
+    });
+  });
+  for (size_t k = 0; k < available_string_kernels (); ++k)
+  {
+    std::string kernel_name = name + "/json_replace_into/" + string_kernels[k].name;
+    benchmark::RegisterBenchmark (kernel_name.c_str (), [input, k] (benchmark::State &state)
+    {
+      const json_string_kernel *default_kernel = string_kernel;
+      string_kernel = &string_kernels[k];
+      buffer.resize (std::max (buffer.size (), input.size ()));
+      run_benchmark (state, input, [] (const std::string &str)
+      {
+        return json_replace_into (str, buffer.data (), buffer.size ());
+      });
+      string_kernel = default_kernel;
+    });
+  }
+  for (size_t k = 0; k < available_index_kernels (); ++k)
+  {
+    std::string kernel_name = name + "/structural_index/" + index_kernels[k].name;
+    benchmark::RegisterBenchmark (kernel_name.c_str (), [input, k] (benchmark::State &state)
+    {
+      const json_index_kernel *default_kernel = index_kernel;
+      index_kernel = &index_kernels[k];
+      replace_engine = json_engine::structural_index;
+      buffer.resize (std::max (buffer.size (), input.size ()));
+      run_benchmark (state, input, [] (const std::string &str)
+      {
+        return json_replace_into (str, buffer.data (), buffer.size ());
+      });
+      replace_engine = json_engine::scanner;
+      index_kernel = default_kernel;
+    });
+  }
+  benchmark::RegisterBenchmark ((name + "/json_replace_checked").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    buffer.resize (std::max (buffer.size (), input.size ()));
+    run_benchmark (state, input, [] (const std::string &str)
+    {
+      ReplaceError error;
+      return json_replace_checked (str.data (), str.size (), buffer.data (), buffer.size (),
+                                   error);
+    });
+  });
+  benchmark::RegisterBenchmark ((name + "/json_replace_validated").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    buffer.resize (std::max (buffer.size (), input.size ()));
+    run_benchmark (state, input, [] (const std::string &str)
+    {
+      ReplaceError error;
+      return json_replace_validated (str.data (), str.size (), buffer.data (), buffer.size (),
+                                     error);
+    });
+  });
+  // includes copying the input back in before every run
+  benchmark::RegisterBenchmark ((name + "/json_replace_inplace").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    buffer.resize (std::max (buffer.size (), input.size ()));
+    run_benchmark (state, input, [] (const std::string &str)
+    {
+      memcpy (buffer.data (), str.data (), str.size ());
+      return json_replace_inplace (buffer.data (), str.size ());
+    });
+  });
+  benchmark::RegisterBenchmark ((name + "/JsonReplaceStream").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    run_benchmark (state, input, [] (const std::string &str)
+    {
+      size_t out_len = 0;
+      JsonReplaceStream stream ([&out_len] (const char *, size_t len) { out_len += len; });
+      for (size_t i = 0; i < str.size (); i += 1 << 16)
+        stream.feed (std::string_view (str).substr (i, 1 << 16));
+      stream.finish ();
+      return out_len;
+    });
+  });
+#if defined(JSON_REPLACE_COROUTINES)
+  benchmark::RegisterBenchmark ((name + "/json_replace_pieces").c_str (),
+                                [input] (benchmark::State &state)
+  {
+    run_benchmark (state, input, [] (const std::string &str)
+    {
+      size_t out_len = 0;
+      for (std::string_view piece : json_replace_pieces (str))
+        out_len += piece.size ();
+      return out_len;
+    });
+  });
+#endif
+}
+
+/**
+ * Registers all benchmarks: every engine over the test corpus and over generated records of
+ * 100B, 4KB and 1MB with no, some and all values replaced, with short and long values, and the
+ * batch engine over many records.
+ */
+void register_benchmarks ()
+{
+  for (const std::pair<const char *, const char *> &corpus : test_corpus)
+    register_engine_benchmarks (std::string ("corpus/") + corpus.first, corpus.second);
+
+  // the members of tests 5 and 7 repeated, where most bytes are multibyte UTF-8 characters
+  for (const char *language : {"hebrew", "japanese"})
+  {
+    std::string members = std::find_if (std::begin (test_corpus), std::end (test_corpus),
+                                        [language] (const auto &corpus)
+                                        { return strcmp (corpus.first, language) == 0; })->second;
+    std::string utf8 = members;
+    while (utf8.size () < (1 << 20))
+      utf8 += ",\n" + members;
+    register_engine_benchmarks (std::string ("utf8/") + language, utf8);
+  }
+
+  for (size_t record_size : {100, 4096, 1 << 20})
+  {
+    for (double density : {0.0, 0.1, 1.0})
+    {
+      for (size_t value_len : {8, 256})
+      {
+        if (value_len > record_size / 2)
+          continue;
+        std::string name = "records/size:" + std::to_string (record_size) + "/density:" +
+                           std::to_string (static_cast<int> (density * 100)) + "%/value:" +
+                           std::to_string (value_len);
+        register_engine_benchmarks (name, generate_benchmark_records (record_size, record_size,
+                                                                      density, value_len));
+      }
+    }
+  }
+
+  // a record that ends in the middle of its last value, through the throwing and checked api
+  std::string malformed = generate_benchmark_records (100, 100, 0.1, 8);
+  malformed.resize (malformed.size () - 4);
+  benchmark::RegisterBenchmark ("malformed/json_replace(const char *)",
+                                [malformed] (benchmark::State &state)
+  {
+    run_benchmark (state, malformed, [] (const std::string &str)
+    {
+      try
+      {
+        return json_replace (str.c_str ()).size ();
+      }
+      catch (std::invalid_argument &e)
+      {
+        return size_t (0);
+      }
+    });
+  });
+  benchmark::RegisterBenchmark ("malformed/json_replace_checked",
+                                [malformed] (benchmark::State &state)
+  {
+    static std::vector<char> buffer (malformed.size ());
+    run_benchmark (state, malformed, [] (const std::string &str)
+    {
+      ReplaceError error;
+      return json_replace_checked (str.data (), str.size (), buffer.data (), buffer.size (),
+                                   error);
+    });
+  });
+
+  // a batch of small records, record by record and into one buffer
+  std::string small_records = generate_benchmark_records (500 * 100, 100, 0.1, 8);
+  benchmark::RegisterBenchmark ("many/json_replace(const char *)",
+                                [small_records] (benchmark::State &state)
+  {
+    std::vector<std::string> records;
+    for (size_t start = 0, end; start < small_records.size (); start = end + 1)
+    {
+      end = small_records.find ('\n', start);
+      records.emplace_back (small_records.substr (start, end - start));
+    }
+    run_benchmark (state, small_records, [&records] (const std::string &)
+    {
+      size_t len = 0;
+      for (const std::string &record : records)
+      {
+        try
+        {
+          len += json_replace (record.c_str ()).size ();
+        }
+        catch (std::invalid_argument &e)
+        {
+        }
+      }
+      return len;
+    });
+  });
+  benchmark::RegisterBenchmark ("many/json_replace_many",
+                                [small_records] (benchmark::State &state)
+  {
+    std::vector<std::string_view> records;
+    for (size_t start = 0, end; start < small_records.size (); start = end + 1)
+    {
+      end = small_records.find ('\n', start);
+      records.emplace_back (std::string_view (small_records).substr (start, end - start));
+    }
+    std::vector<size_t> offsets (records.size () + 1);
+    OutputBuffer out;
+    run_benchmark (state, small_records, [&] (const std::string &)
+    {
+      json_replace_many (records, out, offsets);
+      return out.size ();
+    });
+  });
+
+  // heavily masked records, into new strings and sized without being written
+  std::string masked_records = generate_benchmark_records (1 << 20, 1000, 0.9, 64);
+  benchmark::RegisterBenchmark ("exact/json_replace", [masked_records] (benchmark::State &state)
+  {
+    run_benchmark (state, masked_records, [] (const std::string &input)
+    {
+      return json_replace (input).capacity ();
+    });
+  });
+  benchmark::RegisterBenchmark ("exact/json_replaced_len",
+                                [masked_records] (benchmark::State &state)
+  {
+    run_benchmark (state, masked_records, [] (const std::string &input)
+    {
+      return json_replaced_len (input);
+    });
+  });
+
+  // the same records masked again with other keys, by reading them again and from their index
+  std::string config_records = generate_benchmark_records (1 << 20, 1000, 0.1, 64);
+  static const KeyMatcher remask_matcher ({"7", JSON_REPLACE_TARGET_SUFFIX}, {});
+  benchmark::RegisterBenchmark ("remask/json_replace", [config_records] (benchmark::State &state)
+  {
+    run_benchmark (state, config_records, [] (const std::string &input)
+    {
+      return json_replace (input, remask_matcher).size ();
+    });
+  });
+  benchmark::RegisterBenchmark ("remask/json_remask", [config_records] (benchmark::State &state)
+  {
+    JsonKeyIndex index (config_records);
+    run_benchmark (state, config_records, [&index] (const std::string &input)
+    {
+      return json_remask (input, index, remask_matcher).size ();
+    });
+  });
+  benchmark::RegisterBenchmark ("remask/JsonKeyIndex", [config_records] (benchmark::State &state)
+  {
+    run_benchmark (state, config_records, [] (const std::string &input)
+    {
+      return JsonKeyIndex (input).entries ().size ();
+    });
+  });
+
+  // a matcher that costs far more than reading a key, on its own and behind a ShapeCache
+  struct regex_matcher
+  {
+    std::regex pattern;
+
+    bool operator() (const char *key, const char *key_end) const
+    {
+      return std::regex_match (key + 1, key_end - 1, pattern);
+    }
+  };
+  std::string shaped_records = generate_benchmark_records (1 << 20, 1000, 0.1, 16);
+  regex_matcher by_regex {std::regex ("field[0-9]*_X|.*(ssn|card)")};
+  benchmark::RegisterBenchmark ("shape/json_replace(regex)",
+                                [shaped_records, by_regex] (benchmark::State &state)
+  {
+    run_benchmark (state, shaped_records, [&by_regex] (const std::string &input)
+    {
+      return json_replace_with (input, by_regex, char_replacement<JSON_REPLACE_CHAR> ()).size ();
+    });
+  });
+  benchmark::RegisterBenchmark ("shape/json_replace(ShapeCache<regex>)",
+                                [shaped_records, by_regex] (benchmark::State &state)
+  {
+    ShapeCache cache (by_regex);
+    run_benchmark (state, shaped_records, [&cache] (const std::string &input)
+    {
+      return json_replace_with (input, cache, char_replacement<JSON_REPLACE_CHAR> ()).size ();
+    });
+  });
+  benchmark::RegisterBenchmark ("shape/json_replace(ShapeCache<KeyMatcher>)",
+                                [shaped_records] (benchmark::State &state)
+  {
+    ShapeCache cache (KeyMatcher ({"_X", "ssn", "card"}));
+    run_benchmark (state, shaped_records, [&cache] (const std::string &input)
+    {
+      return json_replace_with (input, cache, char_replacement<JSON_REPLACE_CHAR> ()).size ();
+    });
+  });
+  benchmark::RegisterBenchmark ("shape/json_replace(KeyMatcher)",
+                                [shaped_records] (benchmark::State &state)
+  {
+    KeyMatcher matcher ({"_X", "ssn", "card"});
+    run_benchmark (state, shaped_records, [&matcher] (const std::string &input)
+    {
+      return json_replace_with (input, matcher, char_replacement<JSON_REPLACE_CHAR> ()).size ();
+    });
+  });
+
+  // records fed through a pipe into /dev/null, by the pipeline and by blocking calls
+  std::string piped = generate_benchmark_records (16 << 20, 4096, 0.1, 32);
+  auto pipe_through = [] (const std::string &input, const std::function<void (int, int)> &run)
+  {
+    int in_pipe[2];
+    int null_fd = open ("/dev/null", O_WRONLY);
+    if (pipe (in_pipe) < 0 || null_fd < 0)
+      throw_system_error ("pipe");
+    std::thread writer ([&input, fd = in_pipe[1]]
+    {
+      write_all (fd, input.data (), input.size ());
+      close (fd);
+    });
+    run (in_pipe[0], null_fd);
+    writer.join ();
+    close (in_pipe[0]);
+    close (null_fd);
+    return input.size ();
+  };
+  for (bool use_io_uring : {true, false})
+  {
+    benchmark::RegisterBenchmark (use_io_uring ? "pipe/JsonReplacePipeline(io_uring)"
+                                               : "pipe/JsonReplacePipeline(epoll)",
+                                  [piped, pipe_through, use_io_uring] (benchmark::State &state)
+    {
+      run_benchmark (state, piped, [&] (const std::string &str)
+      {
+        return pipe_through (str, [use_io_uring] (int in_fd, int out_fd)
+        {
+          JsonReplacePipeline pipeline (in_fd, out_fd,
+                                        KeyMatcher ({JSON_REPLACE_TARGET_SUFFIX}, {}),
+                                        JSON_REPLACE_CHAR, 4, 1 << 20, use_io_uring);
+          pipeline.run ();
+        });
+      });
+    })->UseRealTime ();
+  }
+  benchmark::RegisterBenchmark ("pipe/read_write", [piped, pipe_through] (benchmark::State &state)
+  {
+    run_benchmark (state, piped, [&] (const std::string &str)
+    {
+      return pipe_through (str, [] (int in_fd, int out_fd)
+      {
+        std::vector<char> buffer (1 << 20);
+        JsonReplaceStream stream ([out_fd] (const char *data, size_t len)
+                                  { write_all (out_fd, data, len); },
+                                  KeyMatcher ({JSON_REPLACE_TARGET_SUFFIX}, {}));
+        ssize_t len;
+        while ((len = read (in_fd, buffer.data (), buffer.size ())) > 0)
+          stream.feed (buffer.data (), len);
+        stream.finish ();
+      });
+    });
+  })->UseRealTime ();
+
+  std::string ndjson = generate_benchmark_records (64 << 20, 4096, 0.1, 32);
+  // the same records, as the elements of a single array
+  std::string document = "[" + ndjson;
+  std::replace (document.begin (), document.end (), '\n', ',');
+  document.back () = ']';
+  benchmark::RegisterBenchmark ("document/json_replace", [document] (benchmark::State &state)
+  {
+    run_benchmark (state, document, [] (const std::string &str)
+    {
+      return json_replace (str);
+    });
+  })->UseRealTime ();
+  std::vector<size_t> thread_counts = {1};
+  if (std::thread::hardware_concurrency () > 1)
+    thread_counts.push_back (std::thread::hardware_concurrency ());
+  for (size_t threads : thread_counts)
+  {
+    benchmark::RegisterBenchmark (("batch/threads:" + std::to_string (threads)).c_str (),
+                                  [ndjson, threads] (benchmark::State &state)
+    {
+      WorkStealingPool pool (threads);
+      run_benchmark (state, ndjson, [&pool] (const std::string &str)
+      {
+        return json_replace_batch (str, pool);
+      });
+    })->UseRealTime ();
+    benchmark::RegisterBenchmark (("document/threads:" + std::to_string (threads)).c_str (),
+                                  [document, threads] (benchmark::State &state)
+    {
+      WorkStealingPool pool (threads);
+      run_benchmark (state, document, [&pool] (const std::string &str)
+      {
+        return json_replace_parallel (str, pool);
+      });
+    })->UseRealTime ();
+  }
+}
+
+/**
+ * Prints the benchmarks the same way as the console reporter of google benchmark, and keeps
+ * the best throughput that every benchmark reached, out of its repetitions or their median.
+ */
+class BaselineReporter : public benchmark::ConsoleReporter
+{
+public:
+  void ReportRuns (const std::vector<Run> &reports) override
+  {
+    ConsoleReporter::ReportRuns (reports);
+    for (const Run &run : reports)
+    {
+      auto rate = run.counters.find ("bytes_per_second");
+      bool median = run.run_type == Run::RT_Aggregate && run.aggregate_name == "median";
+      if ((run.run_type != Run::RT_Iteration && !median) || run.error_occurred ||
+          rate == run.counters.end ())
+        continue;
+      double &best = best_[run.run_name.str ()];
+      best = std::max (best, rate->second.value);
+    }
+  }
+
+  /**
+   * Bytes per second of every benchmark that ran, by name.
+   */
+  const std::map<std::string, double> &best () const
+  {
+    return best_;
+  }
+
+private:
+  std::map<std::string, double> best_;
+};
+
+/**
+ * Compares the throughput of the benchmarks that ran with a baseline written before by
+ * --write-baseline, a line of bytes per second and a tab before the name of every benchmark.
+ * @param tolerance fraction of its baseline that a benchmark has to reach
+ * @return whether none of them fell below it
+ */
+bool check_baseline (const std::map<std::string, double> &best, const std::string &file,
+                     double tolerance) noexcept (false)
+{
+  std::ifstream in (file);
+  if (!in)
+    throw std::runtime_error ("could not read the baseline " + file);
+  bool passed = true;
+  double baseline;
+  std::string name;
+  while (in >> baseline && in.get () == '\t' && std::getline (in, name))
+  {
+    auto found = best.find (name);
+    if (found == best.end () || found->second >= baseline * tolerance)
+      continue;
+    std::cerr << "json_replace: " << name << " fell to " << found->second / 1e6
+              << " MB/s, below its baseline of " << baseline / 1e6 << " MB/s" << std::endl;
+    passed = false;
+  }
+  return passed;
+}
+
+/**
+ * Runs the benchmarks. Besides the options of google benchmark, --baseline=file fails when a
+ * benchmark is slower than --baseline-tolerance (0.8 by default) of its throughput in file,
+ * and --write-baseline=file stores the throughput of every benchmark that ran into file.
+ */
+int run_benchmarks (int argc, char **argv)
+{
+  std::string baseline;
+  std::string write_baseline;
+  double tolerance = 0.8;
+  int kept = 1;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string_view arg = argv[i];
+    if (arg.starts_with ("--baseline="))
+      baseline = arg.substr (strlen ("--baseline="));
+    else if (arg.starts_with ("--write-baseline="))
+      write_baseline = arg.substr (strlen ("--write-baseline="));
+    else if (arg.starts_with ("--baseline-tolerance="))
+      tolerance = std::stod (std::string (arg.substr (strlen ("--baseline-tolerance="))));
+    else
+      argv[kept++] = argv[i];
+  }
+  argc = kept;
+
+  register_benchmarks ();
+  benchmark::Initialize (&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments (argc, argv))
+    return EXIT_FAILURE;
+  BaselineReporter reporter;
+  benchmark::RunSpecifiedBenchmarks (&reporter);
+  benchmark::Shutdown ();
+  if (!write_baseline.empty ())
+  {
+    std::ofstream out (write_baseline);
+    for (const auto &[name, rate] : reporter.best ())
+      out << std::fixed << rate << '\t' << name << '\n';
+    if (!out)
+    {
+      std::cerr << "json_replace: could not write the baseline " << write_baseline << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (!baseline.empty () && !check_baseline (reporter.best (), baseline, tolerance))
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+#endif
+
+#if !defined(JSON_REPLACE_FUZZ)
+/**
+ * With --test, runs the tests, and fails if any of them does.
+ * --write-corpus dir writes the seed corpus of the fuzz target, which is built with
+ * JSON_REPLACE_FUZZ defined, without this main, as told by LLVMFuzzerTestOneInput.
+ * When built with JSON_REPLACE_BENCHMARK defined and linked with google benchmark,
+ * --benchmark [benchmark options] runs the benchmarks, as told by run_benchmarks.
+ * Building with JSON_REPLACE_ZLIB defined and linking with -lz reads and writes gzip, and with
+ * JSON_REPLACE_ZSTD defined and linking with -lzstd reads and writes zstd.
+ * Otherwise runs the json_replace command line tool, as described by print_usage.
+ */
+int main (int argc, char **argv)
+{
+  if (argc == 2 && strcmp (argv[1], "--test") == 0)
+  {
+    return json_replace_tests () ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (argc == 3 && strcmp (argv[1], "--write-corpus") == 0)
+  {
+    try
+    {
+      write_test_corpus (argv[2]);
+    }
+    catch (std::exception &e)
+    {
+      std::cerr << "json_replace: " << e.what () << std::endl;
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+#if defined(JSON_REPLACE_BENCHMARK)
+  if (argc >= 2 && strcmp (argv[1], "--benchmark") == 0)
+  {
+    argv[1] = argv[0];
+    return run_benchmarks (argc - 1, argv + 1);
+  }
+#endif
+  if (argc == 2 && (strcmp (argv[1], "-h") == 0 || strcmp (argv[1], "--help") == 0))
+  {
+    print_usage (std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  cli_options options;
+  if (!parse_cli_options (argc, argv, options))
+  {
+    print_usage (std::cerr);
+    return EXIT_FAILURE;
+  }
+  try
+  {
+    run_cli (options);
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "json_replace: " << e.what () << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,159 @@
+/**
+ * This file declares the C interface of json_replace, built into the json_replace_c static and
+ * shared libraries, so that it can be called from C, and from any language that calls C, such
+ * as Go through cgo or Python through ctypes.
+ *
+ * The interface only takes and returns pointers, lengths and status codes. Whole batches of
+ * records are passed as one buffer and the offsets between them, so that no record has to be
+ * copied into a string of its own on either side. Nothing that is declared here ever changes
+ * its signature or meaning; new functions are only added.
+ *
+ * A jr_context holds the keys to replace, the engine it runs and the buffers that its output
+ * is written into, which are kept and reused from one call to the next. A context can be used
+ * by one thread at a time, and is meant to be kept for the life of a thread, one per thread.
+ *
+ * Ex. jr_context *context = jr_context_new (suffixes, 2, NULL, 0, '*');
+ *     const char *out;
+ *     size_t out_len;
+ *     if (jr_context_replace (context, record, record_len, &out, &out_len, NULL) == JR_OK)
+ *       send (out, out_len);
+ *     jr_context_free (context);
+ */
+
+#ifndef JSON_REPLACE_H
+#define JSON_REPLACE_H
+
+#include <stddef.h>
+
+#if defined(JR_BUILDING_LIBRARY) && (defined(__GNUC__) || defined(__clang__))
+#define JR_API __attribute__((visibility ("default")))
+#else
+#define JR_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Returned by every function that can fail. JR_OK through JR_OUTPUT_CAPACITY tell where an
+ * input stops being read as json, the same as json_error does.
+ */
+enum jr_status
+{
+  JR_OK = 0,
+  JR_UNEXPECTED_END = 1, /* the input ended inside of a value, or where a value was expected */
+  JR_UNEXPECTED_CHARACTER = 2, /* a byte that can not be where it is */
+  JR_BAD_ESCAPE = 3, /* a backslash not followed by one of "\/bfnrt, or u and four hex digits */
+  JR_CONTROL_CHARACTER = 4, /* a raw byte below 0x20 inside of a string */
+  JR_BAD_NUMBER = 5,
+  JR_BAD_LITERAL = 6, /* a word that is not true, false or null */
+  JR_BAD_BRACKET = 7, /* a closing bracket that does not close the innermost array or object */
+  JR_TOO_DEEP = 8, /* objects and arrays nested deeper than JSON_REPLACE_MAX_DEPTH */
+  JR_OUTPUT_CAPACITY = 9, /* dest is shorter than jr_max_replaced_len of the input */
+  JR_INVALID_ARGUMENT = 10, /* a null pointer, or offsets that do not follow each other */
+  JR_OUT_OF_MEMORY = 11,
+};
+
+/**
+ * The engines that a context can run with, the same as json_engine.
+ */
+enum jr_engine
+{
+  JR_ENGINE_SCANNER = 0,
+  JR_ENGINE_STRUCTURAL_INDEX = 1,
+  JR_ENGINE_VALIDATING = 2,
+};
+
+typedef struct jr_context jr_context;
+
+/**
+ * @param status any value returned by this interface
+ * @return Description of status, which is never freed.
+ */
+JR_API const char *jr_status_message (int status);
+
+/**
+ * @param len length of an input
+ * @return Size of a dest buffer that the copy of any input of len bytes fits into.
+ */
+JR_API size_t jr_max_replaced_len (size_t len);
+
+/**
+ * Reads through the json and writes a copy of it into dest, where all keys that end with _X
+ * have their corresponding values replaced with '*', as json_replace_checked does.
+ * @param src string to read from, which does not need to be null terminated.
+ * @param len length of src.
+ * @param dest buffer to write the copy into, which can be src itself.
+ * @param cap size of dest. Has to be at least jr_max_replaced_len (len).
+ * @param out_len set to the length of the copy, which is only complete with JR_OK.
+ * @param error_offset NULL, or set to the offset of the first byte that could not be read.
+ * @return JR_OK, or why reading stopped.
+ */
+JR_API int jr_replace_into (const char *src, size_t len, char *dest, size_t cap,
+                            size_t *out_len, size_t *error_offset);
+
+/**
+ * @param suffixes keys that end with any of these null terminated strings are replaced.
+ * @param suffix_count number of suffixes.
+ * @param prefixes keys that start with any of these null terminated strings are replaced.
+ * @param prefix_count number of prefixes. Without any suffixes or prefixes, keys that end with
+ *                     _X are replaced.
+ * @param replace character replaced values are replaced with, which can not be a quote or a
+ *                backslash.
+ * @return New context, to be freed with jr_context_free, or NULL if replace is a quote or a
+ *         backslash, or memory ran out.
+ */
+JR_API jr_context *jr_context_new (const char *const *suffixes, size_t suffix_count,
+                                   const char *const *prefixes, size_t prefix_count,
+                                   char replace);
+
+/**
+ * Frees a context from jr_context_new, along with its output. Does nothing with NULL.
+ */
+JR_API void jr_context_free (jr_context *context);
+
+/**
+ * Chooses the engine that every later call on context runs, which is JR_ENGINE_SCANNER for a
+ * new context. Only changes context, so other threads can go on replacing with theirs.
+ * @param engine one of jr_engine
+ * @return JR_OK, or JR_INVALID_ARGUMENT for an engine that is not one.
+ */
+JR_API int jr_context_set_engine (jr_context *context, int engine);
+
+/**
+ * Same as jr_replace_into, with the keys, the replace character and the engine of context.
+ */
+JR_API int jr_context_replace_into (jr_context *context, const char *src, size_t len,
+                                    char *dest, size_t cap, size_t *out_len,
+                                    size_t *error_offset);
+
+/**
+ * Same as jr_context_replace_into, into a buffer of the context that only grows.
+ * @param out set to the copy, which stays valid until the next call on this context.
+ */
+JR_API int jr_context_replace (jr_context *context, const char *src, size_t len,
+                               const char **out, size_t *out_len, size_t *error_offset);
+
+/**
+ * Replaces values in a whole batch of records, one after the other, into one buffer of the
+ * context, as json_replace_many does. A record that is not read as json is left out.
+ * @param data all records, one after the other.
+ * @param offsets has count + 1 entries. Record i is read from [offsets[i], offsets[i + 1]) in
+ *                data.
+ * @param count number of records.
+ * @param out set to the copies, which stay valid until the next call on this context.
+ * @param out_offsets has count + 1 entries. Record i is written to
+ *                    [out_offsets[i], out_offsets[i + 1]) in out, which is empty if it failed.
+ * @param failed NULL, or set to the number of records that failed.
+ * @return JR_OK, even if records failed, or why the batch could not be replaced.
+ */
+JR_API int jr_context_replace_many (jr_context *context, const char *data,
+                                    const size_t *offsets, size_t count, const char **out,
+                                    size_t *out_offsets, size_t *failed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,6361 @@
+/**
+ * This file contains the function json_replace, which gets a string or
+ * C-string and returns a new string where each key that ends with JSON_REPLACE_TARGET_SUFFIX
+ * will have its corresponding value replaced with JSON_REPLACE_CHAR.
+ * json_replacer<Suffix, Replace> does the same for a suffix and replace character chosen at
+ * compile time. Values can also be padded to their length, hashed with a key, or replaced
+ * with a fixed text, with pad_replacement, hash_replacement and literal_replacement.
+ *
+ * Keys are matched at any depth. A string value of a matching key is replaced, and so is every
+ * string value nested in an array or object value of a matching key, while the keys of nested
+ * objects, numbers, booleans and null are copied unchanged. KeyPathMatcher matches whole paths
+ * of keys and array indices instead, such as payment.card.number. The input can be any number
+ * of json values, or the members of an object without its curly brackets. Using this function
+ * with invalid json causes undefined behavior, such as:
+ *     throwing std::invalid_argument,
+ *     returning a partial json,
+ *     not replacing values.
+ * json_replace_checked returns such failure through a ReplaceError instead of throwing it.
+ * json_replace_validated instead reads the input as strict json, and reports the byte offset
+ * where, and the reason why, it stops being valid without throwing.
+ * The input is never read past its end, and does not need to be null terminated.
+ * replace_engine chooses between scanning the json one byte at a time, building a simdjson
+ * style index of its structural characters first, and validating it.
+ * json_replace_batch splits newline delimited json between threads, and json_replace_parallel
+ * splits a single large json between them.
+ * JsonDecompressStream and JsonCompressSink read and write gzip and zstd around
+ * JsonReplaceStream, when built with JSON_REPLACE_ZLIB or JSON_REPLACE_ZSTD defined.
+ * JsonKeyIndex keeps where the keys and string values of a json are, so that json_remask can
+ * replace it again with other keys without reading it as json.
+ * ShapeCache remembers what a costly matcher said about the keys of records that repeat a few
+ * layouts.
+ * json_replace_pieces is a coroutine that yields the output of a JsonReplaceStream in pieces.
+ *
+ * Everything here is inline, so that including this header is all it takes to use it, and
+ * so that the scanner can be inlined into its callers. It is all declared in namespace jr,
+ * apart from the macros, which all start with JSON_REPLACE_. What is in jr::detail is only
+ * used by the rest of the header, and can change from one version to the next.
+ * json_replace.h declares a C interface built on it into the json_replace_c library, and
+ * json_replace.cpp holds the command line tool and the tests.
+ *
+ *
+ * Ex. 1) "key_X" : "value" --> "key_X" : "*"
+ *     2) "key_X" : ["val1", "val2"] --> "key_X" : ["*", "*"]
+ *     3) "key_X" : {"a" : "val", "b" : [1, "val"]} --> "key_X" : {"a" : "*", "b" : [1, "*"]}
+ *     4) "key" : {"id" : 1, "card_X" : "val"} --> "key" : {"id" : 1, "card_X" : "*"}
+ */
+
+#ifndef JSON_REPLACE_HPP
+#define JSON_REPLACE_HPP
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <climits>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <bit>
+#include <array>
+#include <memory>
+#include <new>
+#include <optional>
+#include <map>
+#include <unordered_map>
+#include <span>
+#include <chrono>
+#if __has_include(<expected>)
+#include <expected>
+#endif
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define JSON_REPLACE_COROUTINES 1
+#endif
+
+#include <system_error>
+#include <deque>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>) && __has_include(<sys/syscall.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup)
+#define JSON_REPLACE_IO_URING 1
+#endif
+#endif
+
+#if __has_include(<sys/epoll.h>)
+#include <sys/epoll.h>
+#define JSON_REPLACE_EPOLL 1
+#endif
+
+#if defined(JSON_REPLACE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(JSON_REPLACE_ZSTD)
+#include <zstd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JSON_REPLACE_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define JSON_REPLACE_NEON 1
+#endif
+
+#define JSON_REPLACE_TARGET_SUFFIX "_X"
+#define JSON_REPLACE_CHAR '*'
+#define JSON_REPLACE_READ_ERROR_MSG "json_replace could not read its input as json."
+#define JSON_REPLACE_OUTPUT_CAPACITY_ERROR_MSG "json_replace_into needs an output buffer at "\
+"least as long as its input."
+#define JSON_REPLACE_END_ERROR_MSG "json_replace reached the end of its input in the middle of "\
+"a json value."
+#define JSON_REPLACE_NESTING_ERROR_MSG "json_replace found a closing bracket that does not "\
+"match, or objects and arrays nested deeper than JSON_REPLACE_MAX_DEPTH."
+#define JSON_REPLACE_INPLACE_GROWTH_ERROR_MSG "json_replace_inplace can not use a replacement "\
+"that makes values longer."
+#define JSON_REPLACE_MANY_OFFSETS_ERROR_MSG "json_replace_many needs one more offset than "\
+"records, and an error for every record if any."
+#define JSON_REPLACE_DECOMPRESS_ERROR_MSG "json_replace could not decompress its input."
+#define JSON_REPLACE_COMPRESS_ERROR_MSG "json_replace could not compress its output."
+#define JSON_REPLACE_CODEC_SUPPORT_ERROR_MSG "json_replace was built without this compression, "\
+"which needs JSON_REPLACE_ZLIB for gzip and JSON_REPLACE_ZSTD for zstd."
+#define JSON_REPLACE_LITERAL_REPLACEMENT_ERROR_MSG "a replacement literal can not hold a quote "\
+"or a backslash."
+#define JSON_REPLACE_HASH_DIGITS_ERROR_MSG "a hash replacement writes between 1 and 16 hex "\
+"digits."
+#define JSON_REPLACE_KEY_PATH_ERROR_MSG "a key path needs keys separated by '.', and indices or "\
+"* inside of [ ]."
+#define JSON_REPLACE_KEY_INDEX_FORMAT_ERROR_MSG "a saved JsonKeyIndex is cut short, or is not "\
+"one."
+#define JSON_REPLACE_KEY_INDEX_DOCUMENT_ERROR_MSG "json_remask needs the json that its "\
+"JsonKeyIndex was built from."
+#define JSON_REPLACE_MAX_DEPTH 1024
+#define JSON_REPLACE_INDEX_WINDOW (1 << 14)
+#define JSON_REPLACE_SCRATCH_SIZE (1 << 16)
+#define JSON_REPLACE_SHAPE_CACHE_KEYS (1 << 12)
+#define JSON_REPLACE_PIECE_SIZE (1 << 16)
+
+namespace jr
+{
+
+/**
+ * A set of functions that look for the next character that ends a run of plain string
+ * content, which is '"' or '\\'.
+ * scan returns a pointer to that character, or end if there is none.
+ * copy does the same, and also copies everything before it into dest, which can be src or
+ * anywhere before it.
+ * find is not bound to strings, and looks for the first whole occurrence of a needle that is
+ * at least one character long, returning end if there is none.
+ */
+struct json_string_kernel
+{
+  const char *name;
+  const char *(*scan) (const char *src, const char *end);
+  const char *(*copy) (const char *src, const char *end, char *dest);
+  const char *(*find) (const char *src, const char *end, const char *needle, size_t len);
+};
+
+namespace detail
+{
+
+/**
+ * Classes of the bytes that the scalar code reads one at a time, as bits of json_char_classes,
+ * so that a byte is looked up once instead of being compared with every character it could be.
+ * Bytes of multibyte UTF-8 characters are in no class, and take the same path as letters.
+ */
+enum json_char_class : uint8_t
+{
+  char_whitespace = 1,
+  char_open = 2, // '{' or '['
+  char_close = 4, // '}' or ']'
+  char_separator = 8, // ',' or ':'
+  char_hex_digit = 16,
+};
+
+inline constexpr std::array<uint8_t, 256> json_char_classes = [] ()
+{
+  std::array<uint8_t, 256> classes {};
+  classes[' '] = classes['\t'] = classes['\n'] = classes['\r'] = char_whitespace;
+  classes['{'] = classes['['] = char_open;
+  classes['}'] = classes[']'] = char_close;
+  classes[','] = classes[':'] = char_separator;
+  for (const char *digit = "0123456789abcdefABCDEF"; *digit; ++digit)
+    classes[static_cast<uint8_t> (*digit)] = char_hex_digit;
+  return classes;
+} ();
+
+inline uint8_t json_char_class_of (char c)
+{
+  return json_char_classes[static_cast<uint8_t> (c)];
+}
+
+inline bool is_string_stop (char c)
+{
+  // two compares keep up better than a load from json_char_classes in this hot loop
+  return c == '"' || c == '\\';
+}
+
+inline const char *scan_string_scalar (const char *src, const char *end)
+{
+  while (src != end && !is_string_stop (*src))
+    ++src;
+  return src;
+}
+
+inline const char *copy_string_scalar (const char *src, const char *end, char *dest)
+{
+  while (src != end && !is_string_stop (*src))
+    *(dest++) = *(src++);
+  return src;
+}
+
+inline const char *find_scalar (const char *src, const char *end, const char *needle,
+                                size_t len)
+{
+  const void *found = memmem (src, end - src, needle, len);
+  return found != nullptr ? static_cast<const char *> (found) : end;
+}
+
+/**
+ * Checks the candidates of a vectorized find, which are bits of positions where the first and
+ * last characters of the needle are both in place.
+ * @return first position where the whole needle is, or nullptr if there is none
+ */
+template <typename Mask>
+inline const char *check_candidates (const char *src, Mask candidates, unsigned step,
+                                     const char *needle, size_t len)
+{
+  for (; candidates != 0; candidates &= candidates - 1)
+  {
+    const char *at = src + std::countr_zero (candidates) / step;
+    if (len <= 2 || memcmp (at + 1, needle + 1, len - 2) == 0)
+      return at;
+  }
+  return nullptr;
+}
+
+#if defined(JSON_REPLACE_X86)
+
+inline unsigned stop_mask_sse2 (__m128i block)
+{
+  __m128i stops = _mm_or_si128 (_mm_cmpeq_epi8 (block, _mm_set1_epi8 ('"')),
+                                _mm_cmpeq_epi8 (block, _mm_set1_epi8 ('\\')));
+  return static_cast<unsigned> (_mm_movemask_epi8 (stops));
+}
+
+inline const char *scan_string_sse2 (const char *src, const char *end)
+{
+  while (end - src >= 16)
+  {
+    unsigned mask = stop_mask_sse2 (_mm_loadu_si128 (reinterpret_cast<const __m128i *> (src)));
+    if (mask != 0)
+      return src + __builtin_ctz (mask);
+    src += 16;
+  }
+  return scan_string_scalar (src, end);
+}
+
+inline const char *copy_string_sse2 (const char *src, const char *end, char *dest)
+{
+  while (end - src >= 16)
+  {
+    __m128i block = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (src));
+    unsigned mask = stop_mask_sse2 (block);
+    if (mask != 0)
+    {
+      size_t len = __builtin_ctz (mask);
+      memmove (dest, src, len);
+      return src + len;
+    }
+    // the whole block is string content, so dest has room for all of it
+    _mm_storeu_si128 (reinterpret_cast<__m128i *> (dest), block);
+    src += 16;
+    dest += 16;
+  }
+  return copy_string_scalar (src, end, dest);
+}
+
+inline const char *find_sse2 (const char *src, const char *end, const char *needle, size_t len)
+{
+  __m128i first = _mm_set1_epi8 (needle[0]);
+  __m128i last = _mm_set1_epi8 (needle[len - 1]);
+  while (static_cast<size_t> (end - src) >= len - 1 + 16)
+  {
+    __m128i starts = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (src));
+    __m128i ends = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (src + len - 1));
+    unsigned candidates = static_cast<unsigned> (_mm_movemask_epi8 (
+        _mm_and_si128 (_mm_cmpeq_epi8 (starts, first), _mm_cmpeq_epi8 (ends, last))));
+    if (const char *found = check_candidates (src, candidates, 1, needle, len))
+      return found;
+    src += 16;
+  }
+  return find_scalar (src, end, needle, len);
+}
+
+__attribute__((target ("avx2"))) inline unsigned stop_mask_avx2 (__m256i block)
+{
+  __m256i stops = _mm256_or_si256 (_mm256_cmpeq_epi8 (block, _mm256_set1_epi8 ('"')),
+                                   _mm256_cmpeq_epi8 (block, _mm256_set1_epi8 ('\\')));
+  return static_cast<unsigned> (_mm256_movemask_epi8 (stops));
+}
+
+__attribute__((target ("avx2")))
+inline const char *scan_string_avx2 (const char *src, const char *end)
+{
+  while (end - src >= 32)
+  {
+    unsigned mask = stop_mask_avx2 (_mm256_loadu_si256 (reinterpret_cast<const __m256i *> (src)));
+    if (mask != 0)
+      return src + __builtin_ctz (mask);
+    src += 32;
+  }
+  return scan_string_sse2 (src, end);
+}
+
+__attribute__((target ("avx2")))
+inline const char *copy_string_avx2 (const char *src, const char *end, char *dest)
+{
+  while (end - src >= 32)
+  {
+    __m256i block = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (src));
+    unsigned mask = stop_mask_avx2 (block);
+    if (mask != 0)
+    {
+      size_t len = __builtin_ctz (mask);
+      memmove (dest, src, len);
+      return src + len;
+    }
+    // the whole block is string content, so dest has room for all of it
+    _mm256_storeu_si256 (reinterpret_cast<__m256i *> (dest), block);
+    src += 32;
+    dest += 32;
+  }
+  return copy_string_sse2 (src, end, dest);
+}
+
+__attribute__((target ("avx2")))
+inline const char *find_avx2 (const char *src, const char *end, const char *needle, size_t len)
+{
+  __m256i first = _mm256_set1_epi8 (needle[0]);
+  __m256i last = _mm256_set1_epi8 (needle[len - 1]);
+  while (static_cast<size_t> (end - src) >= len - 1 + 32)
+  {
+    __m256i starts = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (src));
+    __m256i ends = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (src + len - 1));
+    uint32_t candidates = static_cast<uint32_t> (_mm256_movemask_epi8 (
+        _mm256_and_si256 (_mm256_cmpeq_epi8 (starts, first), _mm256_cmpeq_epi8 (ends, last))));
+    if (const char *found = check_candidates (src, candidates, 1, needle, len))
+      return found;
+    src += 32;
+  }
+  return find_sse2 (src, end, needle, len);
+}
+
+#elif defined(JSON_REPLACE_NEON)
+
+/**
+ * Returns a 64 bit mask with 4 bits set for every byte of the block that stops a string run.
+ */
+inline uint64_t stop_mask_neon (uint8x16_t block)
+{
+  uint8x16_t stops = vorrq_u8 (vceqq_u8 (block, vdupq_n_u8 ('"')),
+                               vceqq_u8 (block, vdupq_n_u8 ('\\')));
+  uint8x8_t nibbles = vshrn_n_u16 (vreinterpretq_u16_u8 (stops), 4);
+  return vget_lane_u64 (vreinterpret_u64_u8 (nibbles), 0);
+}
+
+inline const char *scan_string_neon (const char *src, const char *end)
+{
+  while (end - src >= 16)
+  {
+    uint64_t mask = stop_mask_neon (vld1q_u8 (reinterpret_cast<const uint8_t *> (src)));
+    if (mask != 0)
+      return src + (__builtin_ctzll (mask) >> 2);
+    src += 16;
+  }
+  return scan_string_scalar (src, end);
+}
+
+inline const char *copy_string_neon (const char *src, const char *end, char *dest)
+{
+  while (end - src >= 16)
+  {
+    uint8x16_t block = vld1q_u8 (reinterpret_cast<const uint8_t *> (src));
+    uint64_t mask = stop_mask_neon (block);
+    if (mask != 0)
+    {
+      size_t len = __builtin_ctzll (mask) >> 2;
+      memmove (dest, src, len);
+      return src + len;
+    }
+    // the whole block is string content, so dest has room for all of it
+    vst1q_u8 (reinterpret_cast<uint8_t *> (dest), block);
+    src += 16;
+    dest += 16;
+  }
+  return copy_string_scalar (src, end, dest);
+}
+
+inline const char *find_neon (const char *src, const char *end, const char *needle, size_t len)
+{
+  uint8x16_t first = vdupq_n_u8 (static_cast<uint8_t> (needle[0]));
+  uint8x16_t last = vdupq_n_u8 (static_cast<uint8_t> (needle[len - 1]));
+  while (static_cast<size_t> (end - src) >= len - 1 + 16)
+  {
+    uint8x16_t starts = vld1q_u8 (reinterpret_cast<const uint8_t *> (src));
+    uint8x16_t ends = vld1q_u8 (reinterpret_cast<const uint8_t *> (src + len - 1));
+    uint8x16_t both = vandq_u8 (vceqq_u8 (starts, first), vceqq_u8 (ends, last));
+    uint8x8_t nibbles = vshrn_n_u16 (vreinterpretq_u16_u8 (both), 4);
+    // every candidate has 4 bits set, so only the lowest of each is kept
+    uint64_t candidates = vget_lane_u64 (vreinterpret_u64_u8 (nibbles), 0) &
+        0x1111111111111111ULL;
+    if (const char *found = check_candidates (src, candidates, 4, needle, len))
+      return found;
+    src += 16;
+  }
+  return find_scalar (src, end, needle, len);
+}
+
+#endif
+
+} // namespace detail
+
+/**
+ * All kernels that can run on this machine, ordered from slowest to fastest.
+ */
+inline const json_string_kernel string_kernels[] = {
+    {"scalar", detail::scan_string_scalar, detail::copy_string_scalar, detail::find_scalar},
+#if defined(JSON_REPLACE_X86)
+    {"sse2", detail::scan_string_sse2, detail::copy_string_sse2, detail::find_sse2},
+    {"avx2", detail::scan_string_avx2, detail::copy_string_avx2, detail::find_avx2},
+#elif defined(JSON_REPLACE_NEON)
+    {"neon", detail::scan_string_neon, detail::copy_string_neon, detail::find_neon},
+#endif
+};
+
+inline size_t available_string_kernels ()
+{
+  size_t count = sizeof (string_kernels) / sizeof (string_kernels[0]);
+#if defined(JSON_REPLACE_X86)
+  if (!__builtin_cpu_supports ("avx2"))
+    --count;
+#endif
+  return count;
+}
+
+/**
+ * The kernel used by read_json_string and read_and_replace_json_string.
+ * Defaults to the fastest kernel the cpu supports.
+ */
+inline const json_string_kernel *string_kernel =
+    &string_kernels[available_string_kernels () - 1];
+
+/**
+ * The characters of a 64 byte block that the structural index cares about, one bit per byte,
+ * with the first byte of the block in the lowest bit.
+ */
+struct json_block
+{
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t structural; // one of '{', '}', '[', ']', ',' and ':'
+  uint64_t whitespace;
+};
+
+/**
+ * A set of functions that build the structural index of a json, one 64 byte block at a time.
+ * classify finds the characters of a block, and prefix_xor sets every bit that has an odd
+ * number of set bits at or below it, which turns the quotes of a block into the bytes that are
+ * inside of strings.
+ */
+struct json_index_kernel
+{
+  const char *name;
+  void (*classify) (const char *src, json_block *block);
+  uint64_t (*prefix_xor) (uint64_t bits);
+};
+namespace detail
+{
+
+
+inline void classify_block_scalar (const char *src, json_block *block)
+{
+  *block = {};
+  for (size_t i = 0; i < 64; ++i)
+  {
+    uint64_t bit = uint64_t (1) << i;
+    switch (src[i])
+    {
+      case '"':
+        block->quote |= bit;
+        break;
+      case '\\':
+        block->backslash |= bit;
+        break;
+      case '{':
+      case '}':
+      case '[':
+      case ']':
+      case ',':
+      case ':':
+        block->structural |= bit;
+        break;
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        block->whitespace |= bit;
+        break;
+    }
+  }
+}
+
+inline uint64_t prefix_xor_scalar (uint64_t bits)
+{
+  for (unsigned shift = 1; shift < 64; shift <<= 1)
+    bits ^= bits << shift;
+  return bits;
+}
+
+#if defined(JSON_REPLACE_X86)
+
+inline void classify_block_sse2 (const char *src, json_block *block)
+{
+  *block = {};
+  for (size_t i = 0; i < 64; i += 16)
+  {
+    __m128i chars = _mm_loadu_si128 (reinterpret_cast<const __m128i *> (src + i));
+    // '[' and ']' are 0x20 below '{' and '}'
+    __m128i folded = _mm_or_si128 (chars, _mm_set1_epi8 (0x20));
+    __m128i structural = _mm_or_si128 (
+        _mm_or_si128 (_mm_cmpeq_epi8 (folded, _mm_set1_epi8 ('{')),
+                      _mm_cmpeq_epi8 (folded, _mm_set1_epi8 ('}'))),
+        _mm_or_si128 (_mm_cmpeq_epi8 (chars, _mm_set1_epi8 (',')),
+                      _mm_cmpeq_epi8 (chars, _mm_set1_epi8 (':'))));
+    __m128i whitespace = _mm_or_si128 (
+        _mm_or_si128 (_mm_cmpeq_epi8 (chars, _mm_set1_epi8 (' ')),
+                      _mm_cmpeq_epi8 (chars, _mm_set1_epi8 ('\t'))),
+        _mm_or_si128 (_mm_cmpeq_epi8 (chars, _mm_set1_epi8 ('\n')),
+                      _mm_cmpeq_epi8 (chars, _mm_set1_epi8 ('\r'))));
+    auto bits = [i] (__m128i mask)
+    {
+      return static_cast<uint64_t> (static_cast<unsigned> (_mm_movemask_epi8 (mask))) << i;
+    };
+    block->quote |= bits (_mm_cmpeq_epi8 (chars, _mm_set1_epi8 ('"')));
+    block->backslash |= bits (_mm_cmpeq_epi8 (chars, _mm_set1_epi8 ('\\')));
+    block->structural |= bits (structural);
+    block->whitespace |= bits (whitespace);
+  }
+}
+
+__attribute__((target ("avx2")))
+inline void classify_block_avx2 (const char *src, json_block *block)
+{
+  *block = {};
+  for (size_t i = 0; i < 64; i += 32)
+  {
+    __m256i chars = _mm256_loadu_si256 (reinterpret_cast<const __m256i *> (src + i));
+    // '[' and ']' are 0x20 below '{' and '}'
+    __m256i folded = _mm256_or_si256 (chars, _mm256_set1_epi8 (0x20));
+    __m256i structural = _mm256_or_si256 (
+        _mm256_or_si256 (_mm256_cmpeq_epi8 (folded, _mm256_set1_epi8 ('{')),
+                         _mm256_cmpeq_epi8 (folded, _mm256_set1_epi8 ('}'))),
+        _mm256_or_si256 (_mm256_cmpeq_epi8 (chars, _mm256_set1_epi8 (',')),
+                         _mm256_cmpeq_epi8 (chars, _mm256_set1_epi8 (':'))));
+    __m256i whitespace = _mm256_or_si256 (
+        _mm256_or_si256 (_mm256_cmpeq_epi8 (chars, _mm256_set1_epi8 (' ')),
+                         _mm256_cmpeq_epi8 (chars, _mm256_set1_epi8 ('\t'))),
+        _mm256_or_si256 (_mm256_cmpeq_epi8 (chars, _mm256_set1_epi8 ('\n')),
+                         _mm256_cmpeq_epi8 (chars, _mm256_set1_epi8 ('\r'))));
+    auto bits = [i] (__m256i mask) __attribute__((target ("avx2")))
+    {
+      return static_cast<uint64_t> (static_cast<uint32_t> (_mm256_movemask_epi8 (mask))) << i;
+    };
+    block->quote |= bits (_mm256_cmpeq_epi8 (chars, _mm256_set1_epi8 ('"')));
+    block->backslash |= bits (_mm256_cmpeq_epi8 (chars, _mm256_set1_epi8 ('\\')));
+    block->structural |= bits (structural);
+    block->whitespace |= bits (whitespace);
+  }
+}
+
+__attribute__((target ("pclmul")))
+inline uint64_t prefix_xor_pclmul (uint64_t bits)
+{
+  __m128i product = _mm_clmulepi64_si128 (_mm_set_epi64x (0, static_cast<int64_t> (bits)),
+                                          _mm_set1_epi8 (static_cast<char> (0xff)), 0);
+  return static_cast<uint64_t> (_mm_cvtsi128_si64 (product));
+}
+
+#elif defined(JSON_REPLACE_NEON)
+
+/**
+ * Packs four vectors of 0x00 or 0xff bytes into a 64 bit mask, one bit per byte.
+ */
+inline uint64_t bits_neon (uint8x16_t m0, uint8x16_t m1, uint8x16_t m2, uint8x16_t m3)
+{
+  static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint8x16_t weight = vld1q_u8 (weights);
+  uint8x16_t sum01 = vpaddq_u8 (vandq_u8 (m0, weight), vandq_u8 (m1, weight));
+  uint8x16_t sum23 = vpaddq_u8 (vandq_u8 (m2, weight), vandq_u8 (m3, weight));
+  uint8x16_t sum = vpaddq_u8 (sum01, sum23);
+  sum = vpaddq_u8 (sum, sum);
+  return vgetq_lane_u64 (vreinterpretq_u64_u8 (sum), 0);
+}
+
+inline void classify_block_neon (const char *src, json_block *block)
+{
+  uint8x16_t quote[4], backslash[4], structural[4], whitespace[4];
+  for (size_t i = 0; i < 4; ++i)
+  {
+    uint8x16_t chars = vld1q_u8 (reinterpret_cast<const uint8_t *> (src + 16 * i));
+    // '[' and ']' are 0x20 below '{' and '}'
+    uint8x16_t folded = vorrq_u8 (chars, vdupq_n_u8 (0x20));
+    quote[i] = vceqq_u8 (chars, vdupq_n_u8 ('"'));
+    backslash[i] = vceqq_u8 (chars, vdupq_n_u8 ('\\'));
+    structural[i] = vorrq_u8 (vorrq_u8 (vceqq_u8 (folded, vdupq_n_u8 ('{')),
+                                        vceqq_u8 (folded, vdupq_n_u8 ('}'))),
+                              vorrq_u8 (vceqq_u8 (chars, vdupq_n_u8 (',')),
+                                        vceqq_u8 (chars, vdupq_n_u8 (':'))));
+    whitespace[i] = vorrq_u8 (vorrq_u8 (vceqq_u8 (chars, vdupq_n_u8 (' ')),
+                                        vceqq_u8 (chars, vdupq_n_u8 ('\t'))),
+                              vorrq_u8 (vceqq_u8 (chars, vdupq_n_u8 ('\n')),
+                                        vceqq_u8 (chars, vdupq_n_u8 ('\r'))));
+  }
+  block->quote = bits_neon (quote[0], quote[1], quote[2], quote[3]);
+  block->backslash = bits_neon (backslash[0], backslash[1], backslash[2], backslash[3]);
+  block->structural = bits_neon (structural[0], structural[1], structural[2], structural[3]);
+  block->whitespace = bits_neon (whitespace[0], whitespace[1], whitespace[2], whitespace[3]);
+}
+
+#endif
+
+} // namespace detail
+
+/**
+ * All index kernels that can run on this machine, ordered from slowest to fastest.
+ * The carry-less multiply of pclmul is only used along with avx2, so that one check of the cpu
+ * covers both.
+ */
+inline const json_index_kernel index_kernels[] = {
+    {"scalar", detail::classify_block_scalar, detail::prefix_xor_scalar},
+#if defined(JSON_REPLACE_X86)
+    {"sse2", detail::classify_block_sse2, detail::prefix_xor_scalar},
+    {"avx2", detail::classify_block_avx2, detail::prefix_xor_pclmul},
+#elif defined(JSON_REPLACE_NEON)
+    {"neon", detail::classify_block_neon, detail::prefix_xor_scalar},
+#endif
+};
+
+inline size_t available_index_kernels ()
+{
+  size_t count = sizeof (index_kernels) / sizeof (index_kernels[0]);
+#if defined(JSON_REPLACE_X86)
+  if (!__builtin_cpu_supports ("avx2") || !__builtin_cpu_supports ("pclmul"))
+    --count;
+#endif
+  return count;
+}
+
+/**
+ * The kernel used by stage 1 of the structural index engine.
+ * Defaults to the fastest kernel the cpu supports.
+ */
+inline const json_index_kernel *index_kernel = &index_kernels[available_index_kernels () - 1];
+
+namespace detail
+{
+
+/**
+ * What stage 1 of the structural index carries from one block into the next.
+ */
+struct json_index_carry
+{
+  uint64_t odd_backslash = 0; // the last block ended with an odd number of backslashes
+  uint64_t in_string = 0; // all set if the last block ended inside of a string
+  uint64_t scalar = 0; // the last block ended with a byte of a number, boolean or null
+};
+
+/**
+ * Finds the bytes that are escaped by a backslash: those that follow a run of an odd number
+ * of backslashes, counting runs that started in earlier blocks.
+ * @param backslash backslashes of the block
+ * @param odd_backslash 1 if the previous block ended with an odd run, and updated to this block
+ * @return bits of the escaped bytes
+ */
+inline uint64_t find_escaped (uint64_t backslash, uint64_t &odd_backslash)
+{
+  const uint64_t even_bits = 0x5555555555555555ULL;
+  const uint64_t odd_bits = ~even_bits;
+  uint64_t start_edges = backslash & ~(backslash << 1);
+  // a run that continues from the last block flips which runs start on an even bit
+  uint64_t even_start_mask = even_bits ^ odd_backslash;
+  uint64_t even_starts = start_edges & even_start_mask;
+  uint64_t odd_starts = start_edges & ~even_start_mask;
+  uint64_t even_carries = backslash + even_starts;
+  uint64_t odd_carries;
+  bool ends_odd = __builtin_add_overflow (backslash, odd_starts, &odd_carries);
+  odd_carries |= odd_backslash;
+  odd_backslash = ends_odd ? 1 : 0;
+  uint64_t even_start_odd_end = even_carries & ~backslash & odd_bits;
+  uint64_t odd_start_even_end = odd_carries & ~backslash & even_bits;
+  return even_start_odd_end | odd_start_even_end;
+}
+
+/**
+ * Stage 1 of the structural index engine. Finds, in one 64 byte block, every unescaped quote,
+ * every structural character outside of strings, and the first byte of every run of a number,
+ * boolean or null. These are all the bytes that move json_grammar.
+ * @param src start of the block, which has 64 readable bytes
+ * @param carry what the previous block left over, which is updated to this block
+ * @param stray set to the bits of backslashes outside of strings, which escape nothing and
+ *              are read by the byte scanner instead
+ * @return bits of the indexed bytes
+ */
+inline uint64_t index_block (const char *src, json_index_carry &carry, uint64_t &stray)
+{
+  json_block block;
+  index_kernel->classify (src, &block);
+  uint64_t escaped = find_escaped (block.backslash, carry.odd_backslash);
+  uint64_t quote = block.quote & ~escaped;
+  uint64_t in_string = index_kernel->prefix_xor (quote) ^ carry.in_string;
+  carry.in_string = static_cast<uint64_t> (static_cast<int64_t> (in_string) >> 63);
+  stray = block.backslash & ~in_string;
+  uint64_t scalar = ~(block.structural | block.whitespace | block.quote | in_string);
+  uint64_t scalar_start = scalar & ~((scalar << 1) | carry.scalar);
+  carry.scalar = scalar >> 63;
+  return (block.structural & ~in_string) | quote | scalar_start;
+}
+
+} // namespace detail
+
+/**
+ * Replaces the body of a value with the single character Replace, chosen at compile time.
+ * All replacements are called with the body of the value between its quotes and where to
+ * write the new body, and return the end of what they wrote. max_growth is the most bytes
+ * longer than the body they write, for any body of at least one byte, and replaced_len is how
+ * many bytes they write for a body, without writing them.
+ */
+template <char Replace>
+struct char_replacement
+{
+  static_assert (Replace != '"' && Replace != '\\', "replacing with a quote or a backslash "
+                                                     "would break the json");
+
+  static constexpr size_t max_growth ()
+  {
+    return 0;
+  }
+
+  static constexpr size_t replaced_len (const char *, const char *)
+  {
+    return 1;
+  }
+
+  char *operator() (const char *, const char *, char *dest) const
+  {
+    *dest = Replace;
+    return dest + 1;
+  }
+};
+
+/**
+ * Replaces the body of a value with a single character chosen at runtime, which can not be
+ * a quote or a backslash.
+ */
+struct runtime_char_replacement
+{
+  char replace;
+
+  static constexpr size_t max_growth ()
+  {
+    return 0;
+  }
+
+  static constexpr size_t replaced_len (const char *, const char *)
+  {
+    return 1;
+  }
+
+  char *operator() (const char *, const char *, char *dest) const
+  {
+    *dest = replace;
+    return dest + 1;
+  }
+};
+
+/**
+ * Replaces the body of a value with as many copies of a character chosen at runtime as the
+ * body is long, which keeps the length of the json.
+ */
+struct pad_replacement
+{
+  char replace;
+
+  static constexpr size_t max_growth ()
+  {
+    return 0;
+  }
+
+  static constexpr size_t replaced_len (const char *body, const char *body_end)
+  {
+    return body_end - body;
+  }
+
+  char *operator() (const char *body, const char *body_end, char *dest) const
+  {
+    memset (dest, replace, body_end - body);
+    return dest + (body_end - body);
+  }
+};
+
+/**
+ * Replaces the body of a value with a fixed piece of text chosen at runtime, which is written
+ * as is, so it has to be valid inside of a json string.
+ */
+struct literal_replacement
+{
+  std::string literal;
+
+  explicit literal_replacement (std::string text) noexcept (false) : literal (std::move (text))
+  {
+    if (literal.find_first_of ("\"\\") != std::string::npos)
+      throw std::invalid_argument (JSON_REPLACE_LITERAL_REPLACEMENT_ERROR_MSG);
+  }
+
+  size_t max_growth () const
+  {
+    return literal.empty () ? 0 : literal.size () - 1;
+  }
+
+  size_t replaced_len (const char *, const char *) const
+  {
+    return literal.size ();
+  }
+
+  char *operator() (const char *, const char *, char *dest) const
+  {
+    memcpy (dest, literal.data (), literal.size ());
+    return dest + literal.size ();
+  }
+};
+
+namespace detail
+{
+
+/**
+ * SipHash-2-4 of data, under the 128 bit key k0, k1.
+ */
+inline uint64_t siphash24 (const char *data, size_t len, uint64_t k0, uint64_t k1)
+{
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  auto round = [&] ()
+  {
+    v0 += v1;
+    v1 = std::rotl (v1, 13) ^ v0;
+    v0 = std::rotl (v0, 32);
+    v2 += v3;
+    v3 = std::rotl (v3, 16) ^ v2;
+    v0 += v3;
+    v3 = std::rotl (v3, 21) ^ v0;
+    v2 += v1;
+    v1 = std::rotl (v1, 17) ^ v2;
+    v2 = std::rotl (v2, 32);
+  };
+  auto compress = [&] (uint64_t m)
+  {
+    v3 ^= m;
+    round ();
+    round ();
+    v0 ^= m;
+  };
+
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *> (data);
+  size_t whole = len & ~size_t (7);
+  for (size_t i = 0; i < whole; i += 8)
+  {
+    uint64_t m = 0;
+    for (size_t j = 0; j < 8; ++j)
+      m |= static_cast<uint64_t> (bytes[i + j]) << (8 * j);
+    compress (m);
+  }
+  uint64_t last = static_cast<uint64_t> (len) << 56;
+  for (size_t j = 0; whole + j < len; ++j)
+    last |= static_cast<uint64_t> (bytes[whole + j]) << (8 * j);
+  compress (last);
+
+  v2 ^= 0xff;
+  for (int i = 0; i < 4; ++i)
+    round ();
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+} // namespace detail
+
+/**
+ * Replaces the body of a value with the hex digits of its keyed SipHash-2-4, so that equal
+ * values get equal tokens, which can not be turned back into the value without the key. The
+ * raw text of the body is hashed, escapes included, as it is read.
+ */
+struct hash_replacement
+{
+  uint64_t k0;
+  uint64_t k1;
+  size_t digits; // between 1 and 16, taken from the top of the hash
+
+  hash_replacement (uint64_t key0, uint64_t key1, size_t hex_digits = 16) noexcept (false)
+      : k0 (key0), k1 (key1), digits (hex_digits)
+  {
+    if (digits < 1 || digits > 16)
+      throw std::invalid_argument (JSON_REPLACE_HASH_DIGITS_ERROR_MSG);
+  }
+
+  size_t max_growth () const
+  {
+    return digits - 1;
+  }
+
+  size_t replaced_len (const char *, const char *) const
+  {
+    return digits;
+  }
+
+  char *operator() (const char *body, const char *body_end, char *dest) const
+  {
+    static const char hex[] = "0123456789abcdef";
+    uint64_t hash = detail::siphash24 (body, body_end - body, k0, k1);
+    for (size_t i = 0; i < digits; ++i)
+      dest[i] = hex[(hash >> (60 - 4 * i)) & 0xf];
+    return dest + digits;
+  }
+};
+
+/**
+ * @return the longest that a json of len bytes can get after replacing with replacement. Every
+ *         replaced value takes at least 3 bytes with its quotes, and grows by at most
+ *         replacement.max_growth ().
+ */
+template <typename Replacement>
+size_t max_replaced_len (size_t len, const Replacement &replacement) noexcept (false)
+{
+  size_t growth = replacement.max_growth ();
+  if (growth != 0 && len / 3 > (SIZE_MAX - len) / growth)
+    throw std::length_error (JSON_REPLACE_OUTPUT_CAPACITY_ERROR_MSG);
+  return len + len / 3 * growth;
+}
+
+/**
+ * @return whether cap is at least max_replaced_len (len, replacement), without throwing.
+ */
+template <typename Replacement>
+bool fits_replaced_len (size_t len, size_t cap, const Replacement &replacement) noexcept
+{
+  size_t growth = replacement.max_growth ();
+  return (growth == 0 || len / 3 <= (SIZE_MAX - len) / growth) && cap >= len + len / 3 * growth;
+}
+
+/**
+ * Why an engine stopped, as set in ReplaceError. The scanner and the structural index engine
+ * only report unexpected_end, bad_bracket and too_deep, while the validating engine reports
+ * all of them.
+ */
+enum class json_error : uint8_t
+{
+  none,
+  unexpected_end, // the input ended inside of a value, or where a value was expected
+  unexpected_character, // a byte that can not be where it is
+  bad_escape, // a backslash not followed by one of "\/bfnrt, or u and four hex digits
+  control_character, // a raw byte below 0x20 inside of a string
+  bad_number,
+  bad_literal, // a word that is not true, false or null
+  bad_bracket, // a closing bracket that does not close the innermost array or object
+  too_deep, // objects and arrays nested deeper than JSON_REPLACE_MAX_DEPTH
+  output_capacity, // dest is shorter than max_replaced_len of the input
+};
+
+/**
+ * Where and why an engine stopped. A code of json_error::none means the whole input was read.
+ */
+struct ReplaceError
+{
+  json_error code = json_error::none;
+  size_t offset = 0; // of the first byte that could not be read, or the length of the input
+
+  explicit operator bool () const
+  {
+    return code != json_error::none;
+  }
+
+  const char *message () const
+  {
+    switch (code)
+    {
+      case json_error::none:
+        return "no error";
+      case json_error::unexpected_end:
+        return "unexpected end of input";
+      case json_error::unexpected_character:
+        return "unexpected character";
+      case json_error::bad_escape:
+        return "invalid escape sequence in a string";
+      case json_error::control_character:
+        return "unescaped control character in a string";
+      case json_error::bad_number:
+        return "invalid number";
+      case json_error::bad_literal:
+        return "invalid literal";
+      case json_error::bad_bracket:
+        return "closing bracket does not match";
+      case json_error::too_deep:
+        return "nested deeper than JSON_REPLACE_MAX_DEPTH";
+      case json_error::output_capacity:
+        return JSON_REPLACE_OUTPUT_CAPACITY_ERROR_MSG;
+    }
+    return "unknown error";
+  }
+};
+
+namespace detail
+{
+
+/**
+ * Throws the exception that the throwing API reports error with.
+ */
+[[noreturn]] inline void throw_replace_error (const ReplaceError &error) noexcept (false)
+{
+  switch (error.code)
+  {
+    case json_error::unexpected_end:
+      throw std::invalid_argument (JSON_REPLACE_END_ERROR_MSG);
+    case json_error::output_capacity:
+      throw std::length_error (JSON_REPLACE_OUTPUT_CAPACITY_ERROR_MSG);
+    default:
+      throw std::invalid_argument (std::string ("json_replace found invalid json at byte ") +
+                                   std::to_string (error.offset) + ": " + error.message ());
+  }
+}
+
+/**
+ * Reads the body of a string, allowing for internal escaped quotes.
+ * @param src first character after the opening quote
+ * @param end end of original string
+ * @return pointer to the closing quote, or end if the string does not end
+ */
+inline const char *skip_json_string_body (const char *src, const char *end) noexcept
+{
+  while (true)
+  {
+    src = string_kernel->scan (src, end);
+    if (src == end || *src == '"')
+      return src;
+    if (++src == end)
+      return end;
+    ++src;
+  }
+}
+
+/**
+ * Reads a quoted string from the string, and writes the replace value into the new string.
+ * If there is nothing between the quotes, no replacing will be done
+ * @param p_src pointer to original string
+ * @param end end of original string
+ * @param p_dest pointer to new string
+ * @param replacement writes the replace value in place of the body of the string
+ * @return json_error::unexpected_end if the string does not end, or json_error::none
+ */
+template <typename Replacement>
+json_error read_and_replace_json_string (const char **p_src, const char *end, char **p_dest,
+                                         const Replacement &replacement)
+{
+  *((*p_dest)++) = *((*p_src)++);
+  if (*p_src == end)
+    return json_error::unexpected_end;
+  // will not replace an empty string
+  if (**p_src == '"')
+  {
+    *((*p_dest)++) = *((*p_src)++);
+    return json_error::none;
+  }
+  const char *body = *p_src;
+  *p_src = skip_json_string_body (*p_src, end);
+  if (*p_src == end)
+    return json_error::unexpected_end;
+
+  *p_dest = replacement (body, *p_src, *p_dest);
+  *((*p_dest)++) = *((*p_src)++);
+  return json_error::none;
+}
+
+/**
+ * Reads a json string from a string, starting and ending with quotes, into a new string.
+ * @param p_src pointer to original string
+ * @param end end of original string
+ * @param p_dest pointer to new string
+ * @return json_error::unexpected_end if the string does not end, or json_error::none
+ */
+inline json_error read_json_string (const char **p_src, const char *end, char **p_dest) noexcept
+{
+  *((*p_dest)++) = *((*p_src)++);
+  // read body of string. allows for reading internal escaped quotes.
+  while (true)
+  {
+    const char *stop = string_kernel->copy (*p_src, end, *p_dest);
+    *p_dest += stop - *p_src;
+    *p_src = stop;
+    if (*p_src == end)
+      return json_error::unexpected_end;
+    if (**p_src == '"')
+      break;
+    *((*p_dest)++) = *((*p_src)++);
+    if (*p_src == end)
+      return json_error::unexpected_end;
+    *((*p_dest)++) = *((*p_src)++);
+  }
+
+  *((*p_dest)++) = *((*p_src)++);
+  return json_error::none;
+}
+
+/**
+ * Skips an object or an array without reading it as json, by counting its brackets outside
+ * of strings with stage 1 of the structural index engine, 64 bytes at a time. Mismatched
+ * brackets inside of it are not found.
+ * @param src its opening bracket
+ * @param end end of original string
+ * @return one past its closing bracket, or nullptr if it does not close before end
+ */
+inline const char *skip_json_container (const char *src, const char *end) noexcept
+{
+  json_index_carry carry;
+  size_t depth = 0;
+  for (const char *block = src; block < end; block += 64)
+  {
+    // the last block is padded with whitespace, so nothing past end is read
+    const char *bytes = block;
+    char padded[64];
+    if (end - block < 64)
+    {
+      memset (padded, ' ', sizeof (padded));
+      memcpy (padded, block, end - block);
+      bytes = padded;
+    }
+    uint64_t stray;
+    for (uint64_t bits = index_block (bytes, carry, stray); bits != 0; bits &= bits - 1)
+    {
+      char c = bytes[std::countr_zero (bits)];
+      if (c == '{' || c == '[')
+        ++depth;
+      else if ((c == '}' || c == ']') && --depth == 0)
+        return block + std::countr_zero (bits) + 1;
+    }
+  }
+  return nullptr;
+}
+
+} // namespace detail
+
+/**
+ * A deterministic automaton over the keys and array indices along a path into the json, as
+ * compiled by KeyPathMatcher. Keys and indices that no path names share the last two columns
+ * of the transition table.
+ */
+struct json_path_automaton
+{
+  static constexpr uint32_t dead = 0; // no value below can be replaced
+  static constexpr uint32_t start = 1; // the top level
+
+  struct key_hash
+  {
+    using is_transparent = void;
+
+    size_t operator() (std::string_view key) const
+    {
+      return std::hash<std::string_view> () (key);
+    }
+  };
+
+  // column of every named key
+  std::unordered_map<std::string, uint32_t, key_hash, std::equal_to<>> keys;
+  // bit min (length, 63) is set for the lengths of named keys, so most keys are never hashed
+  uint64_t key_lengths = 0;
+  std::vector<uint32_t> indices; // named indices, in the order of their columns after the keys
+  size_t columns = 0;
+  std::vector<uint32_t> next; // columns transitions for every state
+  std::vector<bool> accepting; // the value is replaced
+
+  /**
+   * @param key raw text of a key, without its quotes
+   * @return the state of the value of key, inside of an object in state
+   */
+  uint32_t key (uint32_t state, std::string_view key) const
+  {
+    if (state == dead)
+      return dead;
+    size_t column = columns - 2;
+    if (key_lengths >> std::min<size_t> (key.size (), 63) & 1)
+    {
+      auto it = keys.find (key);
+      if (it != keys.end ())
+        column = it->second;
+    }
+    return next[state * columns + column];
+  }
+
+  /**
+   * @return the state of the element at index, inside of an array in state
+   */
+  uint32_t element (uint32_t state, uint32_t index) const
+  {
+    if (state == dead)
+      return dead;
+    auto it = std::find (indices.begin (), indices.end (), index);
+    size_t column = it != indices.end () ? keys.size () + (it - indices.begin ()) : columns - 1;
+    return next[state * columns + column];
+  }
+};
+
+/**
+ * Keeps track of where in the json a scanner is, as far as replacing is concerned: which
+ * objects and arrays it is inside of, whether the next string is a key, and whether the next
+ * value is replaced. Scanners report every string to it, and every byte outside of strings
+ * through read_byte.
+ * The nesting is kept in a fixed array, so scanning never allocates.
+ */
+struct json_grammar
+{
+  enum level : uint8_t
+  {
+    object = 1,
+    masked = 2, // every string value inside is replaced
+  };
+
+  size_t depth = 0;
+  uint8_t levels[JSON_REPLACE_MAX_DEPTH];
+  // outside of all brackets, members of an object are read as if they were inside one
+  bool expect_key = true;
+  bool replace_next = false;
+
+  // set for a KeyPathMatcher, which then chooses the replaced values by their path
+  const json_path_automaton *automaton = nullptr;
+  uint32_t paths[JSON_REPLACE_MAX_DEPTH]; // state of automaton at every level
+  uint32_t elements[JSON_REPLACE_MAX_DEPTH]; // index of the current element at every array level
+  uint32_t value_path = json_path_automaton::start; // state after the last key or index
+
+  bool in_object () const
+  {
+    return depth == 0 || levels[depth - 1] & object;
+  }
+
+  bool in_array () const
+  {
+    return depth > 0 && !(levels[depth - 1] & object);
+  }
+
+  /**
+   * @return whether the next string is a key
+   */
+  bool at_key () const
+  {
+    return expect_key && in_object ();
+  }
+
+  /**
+   * @return whether the next value, or every string value inside of it, is replaced
+   */
+  bool replaces_value () const
+  {
+    return replace_next || (depth > 0 && levels[depth - 1] & masked);
+  }
+
+  /**
+   * @return the state of automaton for the next value
+   */
+  uint32_t next_path () const
+  {
+    return !expect_key || in_array () ? value_path : json_path_automaton::start;
+  }
+
+  /**
+   * Moves automaton along key, which read_key has to be told about next.
+   * @param key first character of the key, which is its opening quote
+   * @param key_end one past the closing quote of the key
+   * @return whether the value of key is replaced
+   */
+  bool match_path (const char *key, const char *key_end)
+  {
+    value_path = automaton->key (depth == 0 ? json_path_automaton::start : paths[depth - 1],
+                                 std::string_view (key + 1, key_end - key - 2));
+    return automaton->accepting[value_path];
+  }
+
+  /**
+   * @return whether the object or array about to be opened holds no replaced value, as far
+   *         as automaton can tell
+   */
+  bool skips_container () const
+  {
+    return automaton != nullptr && !replaces_value ()
+        && next_path () == json_path_automaton::dead;
+  }
+
+  /**
+   * @param matched whether the values of the key are replaced
+   */
+  void read_key (bool matched)
+  {
+    expect_key = false;
+    replace_next = matched;
+  }
+
+  void read_value ()
+  {
+    expect_key = true;
+    replace_next = false;
+  }
+
+  /**
+   * Reports the first byte of a number, boolean or null. Since these can not contain any
+   * string, the value is complete as far as replacing is concerned.
+   */
+  void read_scalar ()
+  {
+    if (!expect_key)
+      read_value ();
+  }
+
+  /**
+   * @return json_error::too_deep past JSON_REPLACE_MAX_DEPTH, or json_error::none
+   */
+  json_error open (char bracket)
+  {
+    if (depth == JSON_REPLACE_MAX_DEPTH)
+      return json_error::too_deep;
+    if (automaton != nullptr)
+    {
+      paths[depth] = next_path ();
+      elements[depth] = 0;
+    }
+    levels[depth++] = (bracket == '{' ? object : 0) | (replaces_value () ? masked : 0);
+    read_value ();
+    if (automaton != nullptr && bracket == '[')
+      read_element ();
+    return json_error::none;
+  }
+
+  /**
+   * Moves automaton to the current element of the innermost array.
+   */
+  void read_element ()
+  {
+    value_path = automaton->element (paths[depth - 1], elements[depth - 1]);
+    replace_next = automaton->accepting[value_path];
+  }
+
+  /**
+   * @return json_error::bad_bracket if bracket does not close the innermost level, or
+   *         json_error::none
+   */
+  json_error close (char bracket)
+  {
+    if (depth == 0 || ((levels[depth - 1] & object) != 0) != (bracket == '}'))
+      return json_error::bad_bracket;
+    --depth;
+    read_value ();
+    return json_error::none;
+  }
+
+  /**
+   * Reports a byte that is not inside of any string, and is not a quote.
+   * @return the error of open or close, or json_error::none
+   */
+  json_error read_byte (char c)
+  {
+    // the scanner reads filler here, where a switch keeps up better than json_char_classes
+    switch (c)
+    {
+      case '{':
+      case '[':
+        return open (c);
+      case '}':
+      case ']':
+        return close (c);
+      case ',':
+        read_comma ();
+        break;
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+      case ':':
+        break;
+      default:
+        read_scalar ();
+    }
+    return json_error::none;
+  }
+
+  /**
+   * Same as read_byte, but classifies c with json_char_classes, which is faster where bytes
+   * are read one at a time between strings, as in JsonReplaceStream.
+   */
+  json_error read_classified_byte (char c)
+  {
+    uint8_t kind = detail::json_char_class_of (c);
+    if (kind & detail::char_whitespace)
+      return json_error::none;
+    if (!(kind & (detail::char_open | detail::char_close | detail::char_separator)))
+    {
+      read_scalar ();
+      return json_error::none;
+    }
+    if (kind & detail::char_open)
+      return open (c);
+    if (kind & detail::char_close)
+      return close (c);
+    if (c == ',')
+      read_comma ();
+    return json_error::none;
+  }
+
+  /**
+   * Reports a comma between values.
+   */
+  void read_comma ()
+  {
+    read_value ();
+    if (automaton != nullptr && in_array ())
+    {
+      ++elements[depth - 1];
+      read_element ();
+    }
+  }
+
+  /**
+   * @return whether the json can end here
+   */
+  bool complete () const
+  {
+    return depth == 0 && expect_key;
+  }
+};
+
+/**
+ * A string literal that can be used as a template argument, such as json_replacer<"_X", '*'>.
+ */
+template <size_t N>
+struct FixedString
+{
+  char chars[N] {};
+
+  constexpr FixedString (const char (&str)[N])
+  {
+    for (size_t i = 0; i < N; ++i)
+      chars[i] = str[i];
+  }
+
+  /**
+   * Length of the string, without its terminating character.
+   */
+  static constexpr size_t length = N - 1;
+};
+
+/**
+ * Checks whether a key, as read by read_json_string, ends with Suffix.
+ * Keys are only compared by their raw text, escapes included.
+ * Short suffixes are compared with a single load of the end of the key.
+ * @tparam Suffix suffix to look for
+ */
+template <FixedString Suffix>
+struct suffix_matcher
+{
+  // the suffix is followed by the closing quote of the key
+  static constexpr size_t tail_len = Suffix.length + 1;
+  static constexpr size_t width = tail_len <= 2 ? tail_len : tail_len <= 4 ? 4 : 8;
+  using word = std::conditional_t<width == 1, uint8_t, std::conditional_t<width == 2, uint16_t,
+      std::conditional_t<width == 4, uint32_t, uint64_t>>>;
+
+  /**
+   * Returns the last width bytes of a key that ends with the tail, loaded as a single word.
+   * @param mask whether to return 0xff instead of each byte of the tail
+   */
+  static constexpr word tail_word (bool mask)
+  {
+    word value = 0;
+    for (size_t i = width - tail_len; i < width; ++i)
+    {
+      size_t tail_index = i + tail_len - width;
+      uint8_t byte = mask ? 0xff
+                     : tail_index < Suffix.length ? static_cast<uint8_t> (Suffix.chars[tail_index])
+                     : '"';
+      size_t shift = std::endian::native == std::endian::little ? i : width - 1 - i;
+      value |= static_cast<word> (byte) << (8 * shift);
+    }
+    return value;
+  }
+
+  static constexpr word tail_mask = tail_word (true);
+  static constexpr word tail_value = tail_word (false);
+
+  static constexpr std::array<char, tail_len> tail = []
+  {
+    std::array<char, tail_len> chars {};
+    for (size_t i = 0; i < Suffix.length; ++i)
+      chars[i] = Suffix.chars[i];
+    chars[Suffix.length] = '"';
+    return chars;
+  } ();
+
+  /**
+   * Looks for the first place in src where a key that ends with Suffix could end, without
+   * reading src as json.
+   * @return the start of the suffix, or end if no key in src can match
+   */
+  static const char *find_candidate (const char *src, const char *end)
+  {
+    return string_kernel->find (src, end, tail.data (), tail.size ());
+  }
+
+  /**
+   * @param key first character of the key, which is its opening quote
+   * @param key_end one past the closing quote of the key
+   * @return whether the key ends with Suffix
+   */
+  bool operator() (const char *key, const char *key_end) const
+  {
+    size_t key_len = key_end - key;
+    if constexpr (tail_len <= 8)
+    {
+      if (key_len >= width)
+      {
+        word last;
+        memcpy (&last, key_end - width, width);
+        return (last & tail_mask) == tail_value;
+      }
+    }
+    return key_len >= tail_len && memcmp (key_end - tail_len, Suffix.chars, Suffix.length) == 0;
+  }
+};
+
+/**
+ * Checks whether a key, as read by read_json_string, starts or ends with any of a list of
+ * patterns chosen at runtime. Keys are only compared by their raw text, escapes included.
+ * The patterns are built once into a trie of their reversed suffixes and a trie of their
+ * prefixes, so a key is checked in time linear in its length, whatever the number of patterns.
+ */
+class KeyMatcher
+{
+public:
+  /**
+   * @param suffixes keys that end with any of these match
+   * @param prefixes keys that start with any of these match
+   */
+  explicit KeyMatcher (const std::vector<std::string> &suffixes,
+                       const std::vector<std::string> &prefixes = {})
+  {
+    for (const std::vector<std::string> *patterns : {&suffixes, &prefixes})
+    {
+      for (const std::string &pattern : *patterns)
+      {
+        for (char c : pattern)
+        {
+          uint8_t &byte_class = byte_classes_[static_cast<uint8_t> (c)];
+          if (byte_class == 0)
+            byte_class = ++class_count_;
+        }
+      }
+    }
+    for (const std::string &suffix : suffixes)
+    {
+      suffix_trie_.insert (suffix.rbegin (), suffix.rend (), byte_classes_, class_count_);
+      needles_.push_back (suffix + '"');
+    }
+    for (const std::string &prefix : prefixes)
+    {
+      prefix_trie_.insert (prefix.begin (), prefix.end (), byte_classes_, class_count_);
+      needles_.push_back ('"' + prefix);
+    }
+  }
+
+  /**
+   * Looks for the first place in src where a key that starts or ends with any of the patterns
+   * could be, without reading src as json. Each pattern is looked for only up to the best
+   * place found so far.
+   * @return the start of the pattern with its quote, or end if no key in src can match
+   */
+  const char *find_candidate (const char *src, const char *end) const
+  {
+    const char *best = end;
+    for (const std::string &needle : needles_)
+    {
+      const char *stop = std::min (end, best + (needle.size () - 1));
+      best = std::min (best, string_kernel->find (src, stop, needle.data (), needle.size ()));
+    }
+    return best;
+  }
+
+  /**
+   * @param key raw text of a key, without its quotes
+   * @return whether the key starts or ends with any of the patterns
+   */
+  bool matches (std::string_view key) const
+  {
+    const uint8_t *begin = reinterpret_cast<const uint8_t *> (key.data ());
+    const uint8_t *end = begin + key.size ();
+    return suffix_trie_.walk (std::reverse_iterator<const uint8_t *> (end),
+                              std::reverse_iterator<const uint8_t *> (begin), byte_classes_,
+                              class_count_)
+           || prefix_trie_.walk (begin, end, byte_classes_, class_count_);
+  }
+
+  /**
+   * @param key first character of the key, which is its opening quote
+   * @param key_end one past the closing quote of the key
+   * @return whether the key starts or ends with any of the patterns
+   */
+  bool operator() (const char *key, const char *key_end) const
+  {
+    return matches (std::string_view (key + 1, key_end - key - 2));
+  }
+
+private:
+  /**
+   * A trie stored as a dense table of (class_count + 1) transitions per node, where node 0 is
+   * the root and a transition to 0 means there is no child.
+   */
+  struct trie
+  {
+    std::vector<uint32_t> next;
+    std::vector<bool> accepting;
+
+    template <typename It>
+    void insert (It begin, It end, const uint8_t *byte_classes, size_t class_count)
+    {
+      size_t stride = class_count + 1;
+      if (accepting.empty ())
+      {
+        next.assign (stride, 0);
+        accepting.push_back (false);
+      }
+      uint32_t node = 0;
+      for (It it = begin; it != end; ++it)
+      {
+        uint32_t &child = next[node * stride + byte_classes[static_cast<uint8_t> (*it)]];
+        if (child == 0)
+        {
+          child = static_cast<uint32_t> (accepting.size ());
+          next.resize (next.size () + stride, 0);
+          accepting.push_back (false);
+        }
+        node = next[node * stride + byte_classes[static_cast<uint8_t> (*it)]];
+      }
+      accepting[node] = true;
+    }
+
+    template <typename It>
+    bool walk (It begin, It end, const uint8_t *byte_classes, size_t class_count) const
+    {
+      if (accepting.empty ())
+        return false;
+      size_t stride = class_count + 1;
+      uint32_t node = 0;
+      for (It it = begin; !accepting[node]; ++it)
+      {
+        if (it == end)
+          return false;
+        // bytes that are in no pattern have class 0, which never has a child
+        node = next[node * stride + byte_classes[*it]];
+        if (node == 0)
+          return false;
+      }
+      return true;
+    }
+  };
+
+  uint8_t byte_classes_[256] = {};
+  size_t class_count_ = 0;
+  trie suffix_trie_;
+  trie prefix_trie_;
+  // every pattern along with the quote next to it in a matching key
+  std::vector<std::string> needles_;
+};
+
+/**
+ * Chooses the replaced values by the path of keys and array indices that leads to them, such
+ * as payment.card.number, which does not match product.number. A path is made of keys
+ * separated by '.', where * is any one key or element, ** is any number of them, and [n] or
+ * [*] is an element of an array. Keys are compared by their raw text, and can not hold '.'
+ * or '['. The top level of the json, and every value at the top level, is where paths start.
+ * All paths are compiled once into one json_path_automaton, which the engines move along
+ * every key and element, and which lets the scanner skip objects and arrays where nothing
+ * can match.
+ */
+class KeyPathMatcher
+{
+public:
+  /**
+   * @param paths the paths whose values are replaced, along with every string inside of them
+   */
+  explicit KeyPathMatcher (const std::vector<std::string> &paths) noexcept (false)
+  {
+    if (paths.empty ())
+      throw std::invalid_argument (JSON_REPLACE_KEY_PATH_ERROR_MSG);
+    // every position in every path, where the position past the last segment accepts
+    std::vector<const segment *> positions;
+    std::vector<std::vector<segment>> parsed;
+    for (const std::string &path : paths)
+      parsed.push_back (parse (path));
+    std::vector<uint32_t> starts;
+    for (const std::vector<segment> &segments : parsed)
+    {
+      starts.push_back (static_cast<uint32_t> (positions.size ()));
+      for (const segment &seg : segments)
+      {
+        positions.push_back (&seg);
+        if (seg.kind == segment::type::key)
+          automaton_.keys.emplace (seg.key, 0);
+        else if (seg.kind == segment::type::index &&
+                 std::find (automaton_.indices.begin (), automaton_.indices.end (), seg.index)
+                 == automaton_.indices.end ())
+          automaton_.indices.push_back (seg.index);
+      }
+      positions.push_back (nullptr);
+    }
+    uint32_t column = 0;
+    for (auto &[key, key_column] : automaton_.keys)
+    {
+      key_column = column++;
+      automaton_.key_lengths |= uint64_t (1) << std::min<size_t> (key.size (), 63);
+    }
+    size_t index_begin = automaton_.keys.size ();
+    automaton_.columns = index_begin + automaton_.indices.size () + 2;
+
+    // a ** can match nothing, so whatever follows it is reached as well
+    auto closure = [&positions] (std::vector<uint32_t> set)
+    {
+      for (size_t i = 0; i < set.size (); ++i)
+        if (positions[set[i]] != nullptr && positions[set[i]]->kind == segment::type::any_depth)
+          set.push_back (set[i] + 1);
+      std::sort (set.begin (), set.end ());
+      set.erase (std::unique (set.begin (), set.end ()), set.end ());
+      return set;
+    };
+    auto moves = [&] (const segment &seg, size_t column)
+    {
+      bool is_index = column == automaton_.columns - 1 ||
+          (column >= index_begin && column < automaton_.columns - 2);
+      switch (seg.kind)
+      {
+        case segment::type::key:
+          return column == automaton_.keys.find (seg.key)->second;
+        case segment::type::index:
+          return column == index_begin + (std::find (automaton_.indices.begin (),
+                                                     automaton_.indices.end (), seg.index) -
+                                          automaton_.indices.begin ());
+        case segment::type::any_index:
+          return is_index;
+        default:
+          return true;
+      }
+    };
+
+    // subset construction, where the empty set is the dead state
+    std::map<std::vector<uint32_t>, uint32_t> ids = {{{}, json_path_automaton::dead}};
+    std::vector<std::vector<uint32_t>> sets = {{}, closure (starts)};
+    ids.emplace (sets[json_path_automaton::start], json_path_automaton::start);
+    for (size_t state = 0; state < sets.size (); ++state)
+    {
+      std::vector<uint32_t> set = sets[state];
+      automaton_.accepting.push_back (std::any_of (set.begin (), set.end (), [&] (uint32_t pos)
+      {
+        return positions[pos] == nullptr;
+      }));
+      for (size_t column = 0; column < automaton_.columns; ++column)
+      {
+        std::vector<uint32_t> next;
+        for (uint32_t pos : set)
+        {
+          if (positions[pos] == nullptr || !moves (*positions[pos], column))
+            continue;
+          next.push_back (positions[pos]->kind == segment::type::any_depth ? pos : pos + 1);
+        }
+        next = closure (std::move (next));
+        auto [it, inserted] = ids.emplace (next, static_cast<uint32_t> (sets.size ()));
+        if (inserted)
+          sets.push_back (next);
+        automaton_.next.push_back (it->second);
+      }
+    }
+  }
+
+  const json_path_automaton &automaton () const
+  {
+    return automaton_;
+  }
+
+private:
+  struct segment
+  {
+    enum class type : uint8_t
+    {
+      key,
+      any, // *
+      any_depth, // **
+      index, // [n]
+      any_index, // [*]
+    } kind;
+    std::string key;
+    uint32_t index = 0;
+  };
+
+  static std::vector<segment> parse (const std::string &path) noexcept (false)
+  {
+    std::vector<segment> segments;
+    size_t i = 0;
+    do
+    {
+      if (i < path.size () && path[i] == '[')
+      {
+        size_t close = path.find (']', i);
+        if (close == std::string::npos || close == i + 1)
+          throw std::invalid_argument (JSON_REPLACE_KEY_PATH_ERROR_MSG);
+        std::string inside = path.substr (i + 1, close - i - 1);
+        if (inside == "*")
+          segments.push_back ({segment::type::any_index, "", 0});
+        else if (inside.find_first_not_of ("0123456789") == std::string::npos &&
+                 inside.size () <= 9)
+          segments.push_back ({segment::type::index, "",
+                               static_cast<uint32_t> (std::stoul (inside))});
+        else
+          throw std::invalid_argument (JSON_REPLACE_KEY_PATH_ERROR_MSG);
+        i = close + 1;
+        // a key right after the ']' would need a '.' before it
+        if (i < path.size () && path[i] != '.' && path[i] != '[')
+          throw std::invalid_argument (JSON_REPLACE_KEY_PATH_ERROR_MSG);
+      }
+      else
+      {
+        size_t stop = std::min (path.find ('.', i), path.find ('[', i));
+        stop = std::min (stop, path.size ());
+        std::string key = path.substr (i, stop - i);
+        if (key.empty () || key.find (']') != std::string::npos)
+          throw std::invalid_argument (JSON_REPLACE_KEY_PATH_ERROR_MSG);
+        segments.push_back ({key == "**" ? segment::type::any_depth
+                             : key == "*" ? segment::type::any : segment::type::key, key, 0});
+        i = stop;
+      }
+      // a '.' has to be followed by another segment, and a '[' starts one
+      if (i < path.size () && path[i] == '.' && ++i == path.size ())
+        throw std::invalid_argument (JSON_REPLACE_KEY_PATH_ERROR_MSG);
+    } while (i < path.size ());
+    return segments;
+  }
+
+  json_path_automaton automaton_;
+};
+
+/**
+ * Remembers what matches said about every key, so that records that repeat the same few
+ * layouts of keys are matched by comparing each key with the one that followed the previous
+ * key last time, instead of by calling matches again. A key that is not the one expected is
+ * looked up by its hash, and only a key that was never seen is given to matches, until
+ * max_keys keys are remembered, after which new keys are always given to matches. A key that
+ * can not be remembered for lack of memory is given to matches the same way, so the cache
+ * only throws if matches does, and can be given to json_replace_checked_with.
+ * This only pays for a matches that costs more than a comparison and a hash lookup, such as
+ * one built on std::regex: KeyMatcher and suffix_matcher decide most keys within a byte or
+ * two of their ends, so a cache in front of them gains little, and loses where layouts vary.
+ * Since it changes as it is called, one cache can not be used by more than one thread at a
+ * time, so it can not be used with json_replace_batch or json_replace_parallel.
+ * Ex. ShapeCache cache (KeyMatcher ({"_X"}));
+ *     for (std::string_view record : records)
+ *       out.push_back (json_replace_with (record, cache, char_replacement<'*'> ()));
+ * @tparam Matcher called with the start and end of every key, including its quotes.
+ */
+template <typename Matcher>
+class ShapeCache
+{
+public:
+  /**
+   * @param matches decides about every key the first time it is seen
+   * @param max_keys most keys that are remembered
+   */
+  explicit ShapeCache (Matcher matches, size_t max_keys = JSON_REPLACE_SHAPE_CACHE_KEYS)
+      : matches_ (std::move (matches)), max_keys_ (max_keys)
+  {
+    // slot 0 stands for no key, and is followed by the first key of the first record
+    slots_.push_back ({0, 0, 0, false});
+  }
+
+  /**
+   * @param key first character of the key, which is its opening quote
+   * @param key_end one past the closing quote of the key
+   * @return what matches said about the key
+   */
+  bool operator() (const char *key, const char *key_end) const
+  {
+    size_t len = key_end - key;
+    uint32_t previous = last_;
+    const slot &expected = slots_[slots_[previous].next];
+    if (expected.len == len && memcmp (keys_.data () + expected.offset, key, len) == 0)
+    {
+      ++hits_;
+      last_ = slots_[previous].next;
+      return expected.matched;
+    }
+    // find can grow slots_, so nothing is kept pointing into it
+    uint32_t found = find (key, len);
+    slots_[previous].next = found;
+    last_ = found;
+    return found != 0 ? slots_[found].matched : matches_ (key, key_end);
+  }
+
+  /**
+   * Forwards to matches, so that the cache can skip input the same way, such as in
+   * json_replace_view_with.
+   */
+  const char *find_candidate (const char *src, const char *end) const
+      requires requires (const Matcher &matches) { matches.find_candidate (src, end); }
+  {
+    return matches_.find_candidate (src, end);
+  }
+
+  /**
+   * @return how many keys were found where the previous key said they would be
+   */
+  uint64_t hits () const
+  {
+    return hits_;
+  }
+
+  /**
+   * @return how many different keys are remembered
+   */
+  size_t size () const
+  {
+    return slots_.size () - 1;
+  }
+
+private:
+  struct slot
+  {
+    uint32_t offset; // of the key with its quotes in keys_
+    uint32_t len;
+    uint32_t next; // the key that followed this one the last time, or 0
+    bool matched;
+  };
+
+  /**
+   * @return the slot of a key, which is added if there is room, or 0 if there is not, or if
+   *         adding it runs out of memory, so that the checked API still never throws
+   */
+  uint32_t find (const char *key, size_t len) const
+  {
+    std::string_view text (key, len);
+    auto it = index_.find (text);
+    if (it != index_.end ())
+      return it->second;
+    if (size () >= max_keys_ || keys_.size () + len > UINT32_MAX)
+      return 0;
+    uint32_t id = static_cast<uint32_t> (slots_.size ());
+    uint32_t offset = static_cast<uint32_t> (keys_.size ());
+    bool matched = matches_ (key, key + len);
+    bool indexed = false;
+    try
+    {
+      keys_.append (key, len);
+      it = index_.emplace (text, id).first;
+      indexed = true;
+      slots_.push_back ({offset, static_cast<uint32_t> (len), 0, matched});
+    }
+    catch (std::bad_alloc &)
+    {
+      // each step either happened or did not, so undoing the ones that did restores the cache
+      if (indexed)
+        index_.erase (it);
+      keys_.resize (offset);
+      return 0;
+    }
+    return id;
+  }
+
+  Matcher matches_;
+  size_t max_keys_;
+  mutable std::vector<slot> slots_;
+  mutable std::string keys_;
+  mutable std::unordered_map<std::string, uint32_t, json_path_automaton::key_hash,
+                             std::equal_to<>> index_;
+  mutable uint32_t last_ = 0;
+  mutable uint64_t hits_ = 0;
+};
+
+namespace detail
+{
+
+/**
+ * Lets grammar follow the paths of matches, if it is a KeyPathMatcher.
+ */
+template <typename Matcher>
+void select_paths (json_grammar &grammar, const Matcher &matches)
+{
+  if constexpr (std::is_same_v<Matcher, KeyPathMatcher>)
+    grammar.automaton = &matches.automaton ();
+}
+
+/**
+ * Checks a key with matches, or moves grammar along it for a KeyPathMatcher.
+ * @param key first character of the key, which is its opening quote
+ * @param key_end one past the closing quote of the key
+ * @return whether the value of the key is replaced, which read_key is told about next
+ */
+template <typename Matcher>
+bool match_key (json_grammar &grammar, const Matcher &matches, const char *key,
+                const char *key_end)
+{
+  if constexpr (std::is_same_v<Matcher, KeyPathMatcher>)
+    return grammar.match_path (key, key_end);
+  else
+    return matches (key, key_end);
+}
+
+} // namespace detail
+
+/**
+ * The parts of the json that time is spent in, as timed by basic_json_replace_stats.
+ * index is stage 1 of the structural index engine, and filler is everything outside of
+ * strings.
+ */
+enum class json_phase : uint8_t
+{
+  filler,
+  key,
+  value,
+  index,
+};
+
+inline constexpr size_t json_phase_count = 4;
+inline const char *const json_phase_names[json_phase_count] = {"filler", "key", "value",
+                                                               "index"};
+
+namespace detail
+{
+
+/**
+ * @return a count of cpu cycles, or of nanoseconds where the cpu has no cycle counter
+ */
+inline uint64_t read_cycles ()
+{
+#if defined(JSON_REPLACE_X86)
+  return __rdtsc ();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds> (
+      std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+#endif
+}
+
+} // namespace detail
+
+/**
+ * The stats the replace functions use when none are asked for. Every call is empty, so the
+ * counting compiles away entirely.
+ * All stats are told about every byte outside of strings, every key and every string value
+ * that is read, and are finished with the number of bytes scanned.
+ */
+struct no_stats
+{
+  void phase (json_phase) {}
+  void byte (const json_grammar &, char) {}
+  void key (const char *, const char *, bool) {}
+  void value (const json_grammar &, const char *, const char *, bool) {}
+  void finish (size_t) {}
+};
+
+/**
+ * Counts what replacing a json came across, from one call or summed over many.
+ * @tparam Timed whether to also count the cycles spent in every json_phase, which reads the
+ *               cycle counter each time the phase changes
+ */
+template <bool Timed>
+struct basic_json_replace_stats
+{
+  uint64_t bytes_scanned = 0;
+  uint64_t keys_seen = 0;
+  uint64_t keys_matched = 0;
+  uint64_t values_replaced = 0;
+  uint64_t array_elements = 0;
+  uint64_t escape_sequences = 0;
+  uint64_t cycles[json_phase_count] = {};
+
+  void phase (json_phase next)
+  {
+    if constexpr (Timed)
+    {
+      if (next == current_ && started_ != 0)
+        return;
+      uint64_t now = detail::read_cycles ();
+      if (started_ != 0)
+        cycles[static_cast<size_t> (current_)] += now - started_;
+      current_ = next;
+      started_ = now;
+    }
+  }
+
+  void byte (const json_grammar &grammar, char c)
+  {
+    bool scalar = !(detail::json_char_class_of (c) & (detail::char_open | detail::char_close |
+                                                      detail::char_separator |
+                                                      detail::char_whitespace));
+    // brackets and the first byte of a number, boolean or null start an element
+    if ((c == '{' || c == '[' || (scalar && !in_scalar_)) && grammar.in_array ())
+      ++array_elements;
+    in_scalar_ = scalar;
+  }
+
+  void key (const char *begin, const char *end, bool matched)
+  {
+    ++keys_seen;
+    keys_matched += matched;
+    count_escapes (begin, end);
+    in_scalar_ = false;
+  }
+
+  void value (const json_grammar &grammar, const char *begin, const char *end, bool replaced)
+  {
+    array_elements += grammar.in_array ();
+    values_replaced += replaced;
+    count_escapes (begin, end);
+    in_scalar_ = false;
+  }
+
+  void finish (size_t scanned)
+  {
+    bytes_scanned += scanned;
+    if constexpr (Timed)
+    {
+      if (started_ != 0)
+        cycles[static_cast<size_t> (current_)] += detail::read_cycles () - started_;
+      started_ = 0;
+    }
+    in_scalar_ = false;
+  }
+
+  /**
+   * Writes the counters in the Prometheus text format, as json_replace_<counter>_total, with
+   * the cycles labelled by phase.
+   */
+  void write_prometheus (std::ostream &out) const
+  {
+    const std::pair<const char *, uint64_t> counters[] = {
+        {"bytes_scanned", bytes_scanned},       {"keys_seen", keys_seen},
+        {"keys_matched", keys_matched},         {"values_replaced", values_replaced},
+        {"array_elements", array_elements},     {"escape_sequences", escape_sequences},
+    };
+    for (const auto &counter : counters)
+    {
+      out << "# TYPE json_replace_" << counter.first << "_total counter\n"
+          << "json_replace_" << counter.first << "_total " << counter.second << "\n";
+    }
+    if constexpr (Timed)
+    {
+      out << "# TYPE json_replace_cycles_total counter\n";
+      for (size_t phase = 0; phase < json_phase_count; ++phase)
+        out << "json_replace_cycles_total{phase=\"" << json_phase_names[phase] << "\"} "
+            << cycles[phase] << "\n";
+    }
+  }
+
+private:
+  /**
+   * Counts the escape sequences of a string, from its opening quote to one past its closing
+   * quote.
+   */
+  void count_escapes (const char *begin, const char *end)
+  {
+    const char *stop = end - 1;
+    for (const char *c = begin + 1; c < stop; ++c)
+    {
+      c = static_cast<const char *> (memchr (c, '\\', stop - c));
+      if (c == nullptr)
+        return;
+      ++escape_sequences;
+      ++c;
+    }
+  }
+
+  bool in_scalar_ = false;
+  json_phase current_ = json_phase::filler;
+  uint64_t started_ = 0;
+};
+
+using json_replace_stats = basic_json_replace_stats<false>;
+using json_timed_stats = basic_json_replace_stats<true>;
+
+namespace detail
+{
+
+/**
+ * Reads through the json without writing anything, until the opening quote of the first
+ * string value that is replaced.
+ * @param src string to read from.
+ * @param end end of src.
+ * @param grammar where in the json src is, which is updated up to the returned position.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param stats told about everything that is read, such as no_stats or json_replace_stats
+ * @param error set if reading stopped at a byte that could not be read
+ * @return Where reading stopped, which is end if no value is replaced.
+ */
+template <typename Matcher, typename Stats>
+const char *skip_to_first_replacement (const char *src, const char *end, json_grammar &grammar,
+                                       const Matcher &matches, Stats &stats, json_error &error)
+{
+  while (src != end)
+  {
+    if (*src != '"')
+    {
+      if constexpr (std::is_same_v<Matcher, KeyPathMatcher>)
+      {
+        if ((*src == '{' || *src == '[') && grammar.skips_container ())
+        {
+          const char *close = skip_json_container (src, end);
+          if (close == nullptr)
+          {
+            error = json_error::unexpected_end;
+            return end;
+          }
+          grammar.read_value ();
+          src = close;
+          continue;
+        }
+      }
+      stats.phase (json_phase::filler);
+      stats.byte (grammar, *src);
+      if ((error = grammar.read_byte (*src)) != json_error::none)
+        return src;
+      ++src;
+      continue;
+    }
+    bool key = grammar.at_key ();
+    if (!key && grammar.replaces_value ())
+      return src;
+    stats.phase (key ? json_phase::key : json_phase::value);
+    const char *string_begin = src;
+    src = skip_json_string_body (src + 1, end);
+    if (src == end)
+    {
+      error = json_error::unexpected_end;
+      return end;
+    }
+    ++src;
+    if (key)
+    {
+      bool matched = match_key (grammar, matches, string_begin, src);
+      stats.key (string_begin, src, matched);
+      grammar.read_key (matched);
+    }
+    else
+    {
+      stats.value (grammar, string_begin, src, false);
+      grammar.read_value ();
+    }
+  }
+  return src;
+}
+
+/**
+ * Reads through the json and creates a copy of it where all keys accepted by matches have
+ * their corresponding values replaced by replacement, starting from where grammar says src is.
+ * Never reads at or past end. The copy is not null terminated, and is never longer than src.
+ * dest can be src itself, or anywhere before it.
+ * @param src string to read from.
+ * @param end end of src.
+ * @param dest buffer to write the copy into.
+ * @param grammar where in the json src is.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param stats told about everything that is read, such as no_stats or json_replace_stats
+ * @param error set to where, from src, and why reading stopped, if it did not reach end
+ * @return Length of the copy, which is only complete without an error.
+ */
+template <typename Matcher, typename Replacement, typename Stats>
+size_t json_replace_from (const char *src, const char *end, char *dest, json_grammar &grammar,
+                          const Matcher &matches, const Replacement &replacement, Stats &stats,
+                          ReplaceError &error)
+{
+  const char *begin = src;
+  char *dest_begin = dest;
+  json_error code = json_error::none;
+  while (src != end)
+  {
+    const char *string_begin = src;
+    if (*src != '"')
+    {
+      if constexpr (std::is_same_v<Matcher, KeyPathMatcher>)
+      {
+        if ((*src == '{' || *src == '[') && grammar.skips_container ())
+        {
+          const char *close = skip_json_container (src, end);
+          if (close == nullptr)
+          {
+            code = json_error::unexpected_end;
+            src = end;
+            break;
+          }
+          if (dest != src)
+            memmove (dest, src, close - src);
+          dest += close - src;
+          src = close;
+          grammar.read_value ();
+          continue;
+        }
+      }
+      stats.phase (json_phase::filler);
+      stats.byte (grammar, *src);
+      if ((code = grammar.read_byte (*src)) != json_error::none)
+        break;
+      *(dest++) = *(src++);
+    }
+    else if (grammar.at_key ())
+    {
+      stats.phase (json_phase::key);
+      char *key = dest;
+      if ((code = read_json_string (&src, end, &dest)) != json_error::none)
+        break;
+      bool matched = match_key (grammar, matches, key, const_cast<const char *> (dest));
+      stats.key (string_begin, src, matched);
+      grammar.read_key (matched);
+    }
+    else
+    {
+      stats.phase (json_phase::value);
+      bool replaced = grammar.replaces_value ();
+      code = replaced ? read_and_replace_json_string (&src, end, &dest, replacement)
+                      : read_json_string (&src, end, &dest);
+      if (code != json_error::none)
+        break;
+      // an empty string is not replaced
+      stats.value (grammar, string_begin, src, replaced && src - string_begin > 2);
+      grammar.read_value ();
+    }
+  }
+  if (code == json_error::none && !grammar.complete ())
+    code = json_error::unexpected_end;
+  if (code != json_error::none)
+    error = {code, static_cast<size_t> (src - begin)};
+  return dest - dest_begin;
+}
+
+/**
+ * Stage 2 of the structural index engine. Does the same as json_replace_from, but builds the
+ * index of a window of src with index_block first, then only jumps between the indexed bytes,
+ * copying the spans between replaced values with a single memmove each. Nothing is written
+ * until the first replaced value when dest is src.
+ * Falls back to json_replace_from at the first backslash outside of a string.
+ * @param src string to read from.
+ * @param end end of src.
+ * @param dest buffer to write the copy into, which can be src itself, or anywhere before it.
+ * @param grammar where in the json src is, which can not be inside of a string.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param stats told about everything that is read, such as no_stats or json_replace_stats
+ * @param error set to where, from src, and why reading stopped, if it did not reach end
+ * @return Length of the copy, which is only complete without an error.
+ */
+template <typename Matcher, typename Replacement, typename Stats>
+size_t json_replace_indexed_from (const char *src, const char *end, char *dest,
+                                  json_grammar &grammar, const Matcher &matches,
+                                  const Replacement &replacement, Stats &stats,
+                                  ReplaceError &error)
+{
+  thread_local std::vector<uint32_t> index (JSON_REPLACE_INDEX_WINDOW);
+  char *dest_begin = dest;
+  // everything before copied has been written to dest
+  const char *copied = src;
+  const char *open_quote = nullptr;
+  json_index_carry carry;
+  auto copy_to = [&] (const char *stop)
+  {
+    if (dest != copied)
+      memmove (dest, copied, stop - copied);
+    dest += stop - copied;
+    copied = stop;
+  };
+
+  for (const char *window = src; window != end;)
+  {
+    stats.phase (json_phase::index);
+    size_t window_len = std::min<size_t> (end - window, JSON_REPLACE_INDEX_WINDOW);
+    const char *stray_at = nullptr;
+    size_t count = 0;
+    for (size_t i = 0; i < window_len && stray_at == nullptr; i += 64)
+    {
+      // the last block is padded with whitespace, so nothing past end is read
+      const char *block = window + i;
+      char padded[64];
+      if (window_len - i < 64)
+      {
+        memset (padded, ' ', sizeof (padded));
+        memcpy (padded, block, window_len - i);
+        block = padded;
+      }
+      uint64_t stray;
+      uint64_t bits = index_block (block, carry, stray);
+      if (stray != 0)
+      {
+        stray_at = window + i + std::countr_zero (stray);
+        bits &= (uint64_t (1) << std::countr_zero (stray)) - 1;
+      }
+      for (; bits != 0; bits &= bits - 1)
+        index[count++] = static_cast<uint32_t> (i + std::countr_zero (bits));
+    }
+
+    for (size_t k = 0; k < count; ++k)
+    {
+      const char *p = window + index[k];
+      if (open_quote == nullptr)
+      {
+        if (*p == '"')
+          open_quote = p;
+        else
+        {
+          stats.phase (json_phase::filler);
+          stats.byte (grammar, *p);
+          if (json_error code = grammar.read_byte (*p); code != json_error::none)
+          {
+            copy_to (p);
+            error = {code, static_cast<size_t> (p - src)};
+            return dest - dest_begin;
+          }
+        }
+        continue;
+      }
+      // p is the closing quote of the string at open_quote
+      if (grammar.at_key ())
+      {
+        stats.phase (json_phase::key);
+        bool matched = match_key (grammar, matches, open_quote, p + 1);
+        stats.key (open_quote, p + 1, matched);
+        grammar.read_key (matched);
+      }
+      else
+      {
+        stats.phase (json_phase::value);
+        // will not replace an empty string
+        bool replaced = grammar.replaces_value () && p != open_quote + 1;
+        if (replaced)
+        {
+          copy_to (open_quote + 1);
+          dest = replacement (open_quote + 1, p, dest);
+          copied = p;
+        }
+        stats.value (grammar, open_quote, p + 1, replaced);
+        grammar.read_value ();
+      }
+      open_quote = nullptr;
+    }
+
+    if (stray_at != nullptr)
+    {
+      copy_to (stray_at);
+      size_t len = (dest - dest_begin) +
+          json_replace_from (stray_at, end, dest, grammar, matches, replacement, stats, error);
+      if (error)
+        error.offset += stray_at - src;
+      return len;
+    }
+    window += window_len;
+  }
+
+  copy_to (end);
+  if (open_quote != nullptr || !grammar.complete ())
+    error = {json_error::unexpected_end, static_cast<size_t> (end - src)};
+  return dest - dest_begin;
+}
+
+inline bool is_json_whitespace (char c)
+{
+  return json_char_class_of (c) & char_whitespace;
+}
+
+inline bool is_hex_digit (char c)
+{
+  return json_char_class_of (c) & char_hex_digit;
+}
+
+/**
+ * @return whether any byte in [src, end) is below 0x20, checked 8 bytes at a time.
+ */
+inline bool has_control_character (const char *src, const char *end)
+{
+  constexpr uint64_t ones = 0x0101010101010101;
+  uint64_t found = 0;
+  for (; end - src >= 8; src += 8)
+  {
+    uint64_t word;
+    memcpy (&word, src, 8);
+    // sets the high bit of every byte below 0x20, and maybe of bytes after one of those
+    found |= (word - 0x20 * ones) & ~word;
+  }
+  bool control = (found & 0x80 * ones) != 0;
+  for (; src != end; ++src)
+    control |= static_cast<uint8_t> (*src) < 0x20;
+  return control;
+}
+
+/**
+ * Checks the body of a string, with bounds checks on every read.
+ * @param p_src pointer to the first character after the opening quote, which is moved to the
+ *              closing quote, or to the first byte that is not valid
+ * @param end end of original string
+ * @return json_error::none, or why the body is not valid
+ */
+inline json_error validate_json_string_body (const char **p_src, const char *end)
+{
+  while (true)
+  {
+    const char *run = *p_src;
+    *p_src = string_kernel->scan (*p_src, end);
+    if (has_control_character (run, *p_src))
+    {
+      while (static_cast<uint8_t> (*run) >= 0x20)
+        ++run;
+      *p_src = run;
+      return json_error::control_character;
+    }
+    if (*p_src == end)
+      return json_error::unexpected_end;
+    if (**p_src == '"')
+      return json_error::none;
+    const char *escape = (*p_src)++;
+    if (*p_src == end)
+      return json_error::unexpected_end;
+    switch (**p_src)
+    {
+      case '"':
+      case '\\':
+      case '/':
+      case 'b':
+      case 'f':
+      case 'n':
+      case 'r':
+      case 't':
+        ++(*p_src);
+        break;
+      case 'u':
+        for (int i = 0; i < 4; ++i)
+        {
+          if (++(*p_src) == end)
+            return json_error::unexpected_end;
+          if (!is_hex_digit (**p_src))
+            return json_error::bad_escape;
+        }
+        ++(*p_src);
+        break;
+      default:
+        *p_src = escape;
+        return json_error::bad_escape;
+    }
+  }
+}
+
+/**
+ * Checks a number, and that it is followed by whitespace, a comma, a closing bracket or end.
+ * @param p_src pointer to its first character, which is moved past it, or to the first byte
+ *              that is not valid
+ * @param end end of original string
+ * @return json_error::none, or why the number is not valid
+ */
+inline json_error validate_json_number (const char **p_src, const char *end)
+{
+  const char *&src = *p_src;
+  auto digits = [&src, end] ()
+  {
+    const char *start = src;
+    while (src != end && *src >= '0' && *src <= '9')
+      ++src;
+    return src != start;
+  };
+  if (*src == '-')
+    ++src;
+  if (src != end && *src == '0')
+    ++src;
+  else if (!digits ())
+    return src == end ? json_error::unexpected_end : json_error::bad_number;
+  if (src != end && *src == '.')
+  {
+    ++src;
+    if (!digits ())
+      return src == end ? json_error::unexpected_end : json_error::bad_number;
+  }
+  if (src != end && (*src | 0x20) == 'e')
+  {
+    ++src;
+    if (src != end && (*src == '+' || *src == '-'))
+      ++src;
+    if (!digits ())
+      return src == end ? json_error::unexpected_end : json_error::bad_number;
+  }
+  if (src != end && !is_json_whitespace (*src) && *src != ',' && *src != ']' && *src != '}')
+    return json_error::bad_number;
+  return json_error::none;
+}
+
+/**
+ * Checks a literal the same way validate_json_number checks a number.
+ */
+inline json_error validate_json_literal (const char **p_src, const char *end)
+{
+  const char *&src = *p_src;
+  std::string_view literal = *src == 't' ? "true" : *src == 'f' ? "false" : "null";
+  for (char expected : literal)
+  {
+    if (src == end)
+      return json_error::unexpected_end;
+    if (*src != expected)
+      return json_error::bad_literal;
+    ++src;
+  }
+  if (src != end && !is_json_whitespace (*src) && *src != ',' && *src != ']' && *src != '}')
+    return json_error::bad_literal;
+  return json_error::none;
+}
+
+/**
+ * The validating engine. Does the same as json_replace_from, but reads the input as strict
+ * json, and stops at the first byte that is not valid instead of throwing. Like the other
+ * engines, it reads any number of json values, which makes newline delimited json valid, or
+ * the members of an object without its curly brackets, which is the case when the first
+ * value is a string followed by a colon. A string value at the top level is only a key when
+ * followed by a colon.
+ * Everything outside of replaced values is copied lazily, with a single memmove per span.
+ * @param src string to read from.
+ * @param end end of src.
+ * @param dest buffer to write the copy into, which can be src itself, or anywhere before it.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param stats told about everything that is read, such as no_stats or json_replace_stats
+ * @param error set to where and why reading stopped, or left as json_error::none
+ * @return Length of the copy, which is only complete without an error.
+ */
+template <typename Matcher, typename Replacement, typename Stats>
+size_t json_replace_validated_from (const char *src, const char *end, char *dest,
+                                    const Matcher &matches, const Replacement &replacement,
+                                    Stats &stats, ReplaceError &error) noexcept
+{
+  enum class expect : uint8_t
+  {
+    top, // a value at the top level, or the end
+    top_after_string, // a colon after a top level string that makes it a key, or anything else
+    value,
+    value_or_close,
+    key,
+    key_or_close,
+    colon,
+    after_value, // a comma, a closing bracket, or the end between members at the top level
+  };
+
+  json_grammar grammar;
+  select_paths (grammar, matches);
+  expect state = expect::top;
+  // the top level holds the members of an object without its curly brackets
+  bool members = false;
+  bool any_value = false;
+  const char *pending_key = nullptr;
+  const char *pending_key_end = nullptr;
+  bool pending_matched = false;
+
+  const char *begin = src;
+  char *dest_begin = dest;
+  // everything before copied has been written to dest
+  const char *copied = src;
+  auto copy_to = [&] (const char *stop)
+  {
+    if (dest != copied)
+      memmove (dest, copied, stop - copied);
+    dest += stop - copied;
+    copied = stop;
+  };
+  auto fail = [&] (json_error code, const char *at)
+  {
+    error = {code, static_cast<size_t> (at - begin)};
+    stats.finish (at - begin);
+    return static_cast<size_t> (dest - dest_begin);
+  };
+  auto after_value = [&] ()
+  {
+    any_value = true;
+    return grammar.depth == 0 && !members ? expect::top : expect::after_value;
+  };
+
+  while (src != end)
+  {
+    char c = *src;
+    if (is_json_whitespace (c))
+    {
+      ++src;
+      continue;
+    }
+    switch (state)
+    {
+      case expect::top_after_string:
+        if (c == ':' && !any_value)
+        {
+          members = true;
+          stats.key (pending_key, pending_key_end, pending_matched);
+          grammar.read_key (pending_matched);
+          state = expect::value;
+          ++src;
+          continue;
+        }
+        stats.value (grammar, pending_key, pending_key_end, false);
+        grammar.read_value ();
+        any_value = true;
+        state = expect::top;
+        continue;
+      case expect::colon:
+        if (c != ':')
+          return fail (json_error::unexpected_character, src);
+        state = expect::value;
+        ++src;
+        continue;
+      case expect::after_value:
+        stats.phase (json_phase::filler);
+        if (c == ',')
+        {
+          stats.byte (grammar, c);
+          grammar.read_byte (c);
+          state = grammar.in_array () ? expect::value : expect::key;
+          ++src;
+          continue;
+        }
+        if (c != '}' && c != ']')
+          return fail (json_error::unexpected_character, src);
+        break;
+      case expect::key_or_close:
+        if (c == '}')
+          break;
+        [[fallthrough]];
+      case expect::key:
+      {
+        if (c != '"')
+          return fail (json_error::unexpected_character, src);
+        stats.phase (json_phase::key);
+        const char *key = src++;
+        if (json_error body_error = validate_json_string_body (&src, end);
+            body_error != json_error::none)
+          return fail (body_error, src);
+        ++src;
+        bool matched = match_key (grammar, matches, key, src);
+        stats.key (key, src, matched);
+        grammar.read_key (matched);
+        state = expect::colon;
+        continue;
+      }
+      case expect::value_or_close:
+        if (c == ']')
+          break;
+        [[fallthrough]];
+      case expect::top:
+      case expect::value:
+        if (c == '"')
+        {
+          stats.phase (json_phase::value);
+          const char *open_quote = src++;
+          if (json_error body_error = validate_json_string_body (&src, end);
+              body_error != json_error::none)
+            return fail (body_error, src);
+          ++src;
+          if (state == expect::top)
+          {
+            pending_key = open_quote;
+            pending_key_end = src;
+            pending_matched = match_key (grammar, matches, open_quote, src);
+            state = expect::top_after_string;
+            continue;
+          }
+          // will not replace an empty string
+          bool replaced = grammar.replaces_value () && src - open_quote > 2;
+          if (replaced)
+          {
+            copy_to (open_quote + 1);
+            dest = replacement (open_quote + 1, src - 1, dest);
+            copied = src - 1;
+          }
+          stats.value (grammar, open_quote, src, replaced);
+          grammar.read_value ();
+          state = after_value ();
+          continue;
+        }
+        stats.phase (json_phase::filler);
+        stats.byte (grammar, c);
+        if (c == '{' || c == '[')
+        {
+          if (json_error open_error = grammar.open (c); open_error != json_error::none)
+            return fail (open_error, src);
+          state = c == '{' ? expect::key_or_close : expect::value_or_close;
+          ++src;
+          continue;
+        }
+        if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n')
+        {
+          json_error scalar_error = c == 't' || c == 'f' || c == 'n'
+              ? validate_json_literal (&src, end) : validate_json_number (&src, end);
+          if (scalar_error != json_error::none)
+            return fail (scalar_error, src);
+          grammar.read_scalar ();
+          state = after_value ();
+          continue;
+        }
+        // closes nothing
+        if (state == expect::top && (c == '}' || c == ']'))
+          return fail (json_error::bad_bracket, src);
+        return fail (json_error::unexpected_character, src);
+    }
+
+    // c closes an array or an object
+    stats.byte (grammar, c);
+    if (json_error close_error = grammar.close (c); close_error != json_error::none)
+      return fail (close_error, src);
+    state = after_value ();
+    ++src;
+  }
+
+  if (state == expect::top_after_string)
+  {
+    stats.value (grammar, pending_key, pending_key_end, false);
+    grammar.read_value ();
+  }
+  else if (state != expect::top && !(state == expect::after_value && grammar.depth == 0))
+    return fail (json_error::unexpected_end, end);
+  copy_to (end);
+  stats.finish (end - begin);
+  return dest - dest_begin;
+}
+
+} // namespace detail
+
+/**
+ * The engines that json_replace can run with.
+ * scanner reads the json one byte at a time between strings, and copies strings with
+ * string_kernel. structural_index builds an index of the bytes that matter with index_kernel
+ * first, and suits large documents with long runs between replaced values. validating reads
+ * the input as strict json, at a small cost, and reports where it stops being valid.
+ */
+enum class json_engine
+{
+  scanner,
+  structural_index,
+  validating,
+};
+
+/**
+ * The engine used by json_replace, and everything built on it, that is not given one. It is
+ * read once by every call, and is only meant to be set before any thread replaces, since
+ * setting it while one does is a data race. ReplaceContext, jr_context and the functions that
+ * take an engine keep their own instead.
+ */
+inline json_engine replace_engine = json_engine::scanner;
+
+namespace detail
+{
+
+/**
+ * Runs the scanner or the structural index engine, as engine says, from where grammar says
+ * src is. See json_replace_from for the other parameters.
+ * @param engine json_engine::structural_index, or the scanner for any other
+ * @return Length of the copy, which is only complete without an error.
+ */
+template <typename Matcher, typename Replacement, typename Stats>
+size_t json_replace_engine_from (const char *src, const char *end, char *dest,
+                                 json_grammar &grammar, const Matcher &matches,
+                                 const Replacement &replacement, Stats &stats,
+                                 ReplaceError &error, json_engine engine)
+{
+  if (engine == json_engine::structural_index)
+    return json_replace_indexed_from (src, end, dest, grammar, matches, replacement, stats,
+                                      error);
+  // nothing before the first replaced value changes, so it is copied in one go
+  json_error code = json_error::none;
+  const char *first = skip_to_first_replacement (src, end, grammar, matches, stats, code);
+  if (dest != src && first != src)
+    memcpy (dest, src, first - src);
+  if (code == json_error::none && first == end && !grammar.complete ())
+    code = json_error::unexpected_end;
+  if (code != json_error::none)
+    error = {code, static_cast<size_t> (first - src)};
+  if (first == end || error)
+    return first - src;
+  size_t len = (first - src) + json_replace_from (first, end, dest + (first - src), grammar,
+                                                  matches, replacement, stats, error);
+  if (error)
+    error.offset += first - src;
+  return len;
+}
+
+} // namespace detail
+
+/**
+ * Reads through the json and creates a copy of it where all keys accepted by matches have
+ * their corresponding values replaced by replacement, with engine.
+ * Never reads at or past end, and never throws itself: failure is returned through error.
+ * The copy is not null terminated, and is never longer than max_replaced_len of src.
+ * dest can be src itself, in which case nothing is written before the first replaced value.
+ * @param src string to read from.
+ * @param end end of src.
+ * @param dest buffer to write the copy into.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param error set to where and why reading stopped, and left alone if it reached end
+ * @param stats told about everything that is read, and left out for no stats. Counting only
+ *              costs anything with stats such as json_replace_stats or json_timed_stats.
+ * @param engine engine to run, replace_engine unless given
+ * @return Length of the copy, which is only complete without an error.
+ */
+template <typename Matcher, typename Replacement, typename Stats = no_stats>
+size_t json_replace_no_throw (const char *src, const char *end, char *dest,
+                              const Matcher &matches, const Replacement &replacement,
+                              ReplaceError &error, Stats &&stats = Stats (),
+                              json_engine engine = replace_engine)
+{
+  if (engine == json_engine::validating)
+    return detail::json_replace_validated_from (src, end, dest, matches, replacement, stats,
+                                                error);
+  json_grammar grammar;
+  detail::select_paths (grammar, matches);
+  size_t len = detail::json_replace_engine_from (src, end, dest, grammar, matches, replacement,
+                                                 stats, error, engine);
+  stats.finish (error ? error.offset : end - src);
+  return len;
+}
+
+/**
+ * Same as json_replace_no_throw, but throws the error instead, as std::invalid_argument.
+ * @return Length of the copy.
+ */
+template <typename Matcher, typename Replacement, typename Stats = no_stats>
+size_t json_replace_no_try_catch (const char *src, const char *end, char *dest,
+                                  const Matcher &matches, const Replacement &replacement,
+                                  Stats &&stats = Stats (),
+                                  json_engine engine = replace_engine) noexcept (false)
+{
+  ReplaceError error;
+  size_t len = json_replace_no_throw (src, end, dest, matches, replacement, error, stats,
+                                      engine);
+  if (error)
+    detail::throw_replace_error (error);
+  return len;
+}
+
+/**
+ * Looks for the first place where a key accepted by matches could be, if matches can tell
+ * without reading the json, as suffix_matcher and KeyMatcher can.
+ * @return where the key could be, which is src if matches can not tell, or end if no key in
+ *         src can match
+ */
+template <typename Matcher>
+const char *find_key_candidate (const char *src, const char *end, const Matcher &matches)
+{
+  if constexpr (requires { matches.find_candidate (src, end); })
+    return matches.find_candidate (src, end);
+  else
+    return src;
+}
+
+/**
+ * Replaces values inside of buf itself, moving everything after a replaced value back.
+ * Nothing is written before the first replaced value, so a buffer with nothing to replace is
+ * only read.
+ * @param buf json to replace in.
+ * @param len length of buf.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings, and
+ *                    can not have a max_growth.
+ * @return New length of buf.
+ */
+template <typename Matcher, typename Replacement>
+size_t json_replace_inplace_with (char *buf, size_t len, const Matcher &matches,
+                                  const Replacement &replacement) noexcept (false)
+{
+  if (replacement.max_growth () != 0)
+    throw std::length_error (JSON_REPLACE_INPLACE_GROWTH_ERROR_MSG);
+  return json_replace_no_try_catch (buf, buf + len, buf, matches, replacement);
+}
+
+/**
+ * Runs json_replace_no_try_catch over src into a buffer owned by the caller.
+ * @param src string to read from.
+ * @param len length of src.
+ * @param dest buffer to write the copy into.
+ * @param cap size of dest. Has to be at least max_replaced_len (len, replacement), which is
+ *            len for replacements that never make a value longer.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param stats told about everything that is read, and left out for no stats
+ * @return Length of the copy.
+ */
+template <typename Matcher, typename Replacement, typename Stats = no_stats>
+size_t json_replace_into_with (const char *src, size_t len, char *dest, size_t cap,
+                               const Matcher &matches, const Replacement &replacement,
+                               Stats &&stats = Stats ()) noexcept (false)
+{
+  if (cap < max_replaced_len (len, replacement))
+    throw std::length_error (JSON_REPLACE_OUTPUT_CAPACITY_ERROR_MSG);
+  return json_replace_no_try_catch (src, src + len, dest, matches, replacement, stats);
+}
+
+/**
+ * Runs the validating engine over src into a buffer owned by the caller, whichever
+ * replace_engine is set. Never throws, so a malformed input costs no more than a valid one.
+ * @param src string to read from.
+ * @param len length of src.
+ * @param dest buffer to write the copy into, which can be src itself.
+ * @param cap size of dest. Has to be at least max_replaced_len (len, replacement).
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param error set to where and why reading stopped, or to json_error::none
+ * @param stats told about everything that is read, and left out for no stats
+ * @return Length of the copy, which is only complete without an error.
+ */
+template <typename Matcher, typename Replacement, typename Stats = no_stats>
+size_t json_replace_validated_with (const char *src, size_t len, char *dest, size_t cap,
+                                    const Matcher &matches, const Replacement &replacement,
+                                    ReplaceError &error, Stats &&stats = Stats ()) noexcept
+{
+  error = ReplaceError ();
+  if (!fits_replaced_len (len, cap, replacement))
+  {
+    error.code = json_error::output_capacity;
+    return 0;
+  }
+  return detail::json_replace_validated_from (src, src + len, dest, matches, replacement, stats,
+                                              error);
+}
+
+/**
+ * Runs json_replace_no_throw over src into a buffer owned by the caller. Never throws, so a
+ * malformed input costs no more than a valid one, as opposed to json_replace_into_with.
+ * @param src string to read from.
+ * @param len length of src.
+ * @param dest buffer to write the copy into, which can be src itself.
+ * @param cap size of dest. Has to be at least max_replaced_len (len, replacement).
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param error set to where and why reading stopped, or to json_error::none
+ * @param stats told about everything that is read, and left out for no stats
+ * @param engine engine to run, replace_engine unless given
+ * @return Length of the copy, which is only complete without an error.
+ */
+template <typename Matcher, typename Replacement, typename Stats = no_stats>
+size_t json_replace_checked_with (const char *src, size_t len, char *dest, size_t cap,
+                                  const Matcher &matches, const Replacement &replacement,
+                                  ReplaceError &error, Stats &&stats = Stats (),
+                                  json_engine engine = replace_engine) noexcept
+{
+  error = ReplaceError ();
+  if (!fits_replaced_len (len, cap, replacement))
+  {
+    error.code = json_error::output_capacity;
+    return 0;
+  }
+  return json_replace_no_throw (src, src + len, dest, matches, replacement, error, stats,
+                                engine);
+}
+
+/**
+ * Reads through the json as the scanner does, without writing anything, and counts how long
+ * its copy with replaced values is, so that a buffer of exactly that length can be allocated
+ * before the copy is written into it.
+ * @param src string to read from.
+ * @param len length of src.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement tells how long the replace value of every replaced body is
+ * @param error set to where and why reading stopped, or to json_error::none
+ * @return Length of the copy, which is only exact without an error.
+ */
+template <typename Matcher, typename Replacement>
+size_t json_replaced_len_with (const char *src, size_t len, const Matcher &matches,
+                               const Replacement &replacement, ReplaceError &error) noexcept
+{
+  error = ReplaceError ();
+  const char *begin = src;
+  const char *end = src + len;
+  json_grammar grammar;
+  detail::select_paths (grammar, matches);
+  no_stats stats;
+  json_error code = json_error::none;
+  while ((src = detail::skip_to_first_replacement (src, end, grammar, matches, stats, code)) !=
+             end &&
+         code == json_error::none)
+  {
+    // src is the opening quote of a replaced value
+    const char *body = src + 1;
+    const char *close = detail::skip_json_string_body (body, end);
+    if (close == end)
+    {
+      code = json_error::unexpected_end;
+      src = end;
+      break;
+    }
+    // will not replace an empty string
+    if (close != body)
+      len = len - (close - body) + replacement.replaced_len (body, close);
+    grammar.read_value ();
+    src = close + 1;
+  }
+  if (code == json_error::none && !grammar.complete ())
+    code = json_error::unexpected_end;
+  if (code != json_error::none)
+    error = {code, static_cast<size_t> (src - begin)};
+  return len;
+}
+
+namespace detail
+{
+
+/**
+ * Makes a new string of exactly the length of the copy that write writes, so that it holds no
+ * more memory than it needs. A copy that can be up to JSON_REPLACE_SCRATCH_SIZE bytes long is
+ * written into a buffer kept by the thread, and copied from there into the new string, which is
+ * then allocated only once, while a longer one is written into the new string itself, which is
+ * shrunk after.
+ * @param cap longest that the copy can be
+ * @param write called with a buffer of cap bytes, and returns the length it wrote into it
+ * @return New string with the copy.
+ */
+template <typename Write>
+std::string make_replaced_string (size_t cap, const Write &write) noexcept (false)
+{
+  if (cap <= JSON_REPLACE_SCRATCH_SIZE)
+  {
+    thread_local std::vector<char> scratch (JSON_REPLACE_SCRATCH_SIZE);
+    return std::string (scratch.data (), write (scratch.data ()));
+  }
+  std::string new_str (cap, '\0');
+  new_str.resize (write (&new_str[0]));
+  new_str.shrink_to_fit ();
+  return new_str;
+}
+
+} // namespace detail
+
+/**
+ * Runs json_replace_no_try_catch over str into a new string, which is as long as the copy, and
+ * holds no more memory than that.
+ * @param str string to read from, which does not need to be null terminated.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param stats told about everything that is read, and left out for no stats
+ * @return New string with replaced values.
+ */
+template <typename Matcher, typename Replacement, typename Stats = no_stats>
+std::string json_replace_with (std::string_view str, const Matcher &matches,
+                               const Replacement &replacement,
+                               Stats &&stats = Stats ()) noexcept (false)
+{
+  ReplaceError error;
+  std::string new_str = detail::make_replaced_string (max_replaced_len (str.size (), replacement),
+                                                      [&] (char *dest)
+  {
+    return json_replace_no_throw (str.data (), str.data () + str.size (), dest, matches,
+                                  replacement, error, stats);
+  });
+  // thrown once, instead of caught and thrown again
+  if (error)
+    detail::throw_replace_error (error);
+  return new_str;
+}
+
+/**
+ * Same as json_replace_with, unless no key in str can match, as found by find_key_candidate.
+ * Such input is returned as is, without being copied, or read as json, which means it is not
+ * checked for errors.
+ * @param str string to read from, which does not need to be null terminated.
+ * @param storage where the new string is kept, if one is made.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @return str, or storage with replaced values.
+ */
+template <typename Matcher, typename Replacement>
+std::string_view json_replace_view_with (std::string_view str, std::string &storage,
+                                         const Matcher &matches,
+                                         const Replacement &replacement) noexcept (false)
+{
+  const char *end = str.data () + str.size ();
+  if (find_key_candidate (str.data (), end, matches) == end)
+    return str;
+  storage = json_replace_with (str, matches, replacement);
+  return storage;
+}
+
+/**
+ * Replaces the values of all keys that end with Suffix with Replace, with both chosen at
+ * compile time.
+ * Ex. json_replacer<"_SSN", '#'>::replace (R"("user_SSN": "123")") --> "user_SSN": "#"
+ * @tparam Suffix suffix of the keys whose values are replaced
+ * @tparam Replace character replaced values are replaced with
+ */
+template <FixedString Suffix, char Replace>
+struct json_replacer
+{
+  /**
+   * Reads through the json and writes a copy of it into a buffer owned by the caller, where
+   * all keys that end with Suffix have their corresponding values replaced with Replace.
+   * Does not allocate. src does not need to be null terminated, and the copy is not either.
+   * @param src string to read from.
+   * @param len length of src.
+   * @param dest buffer to write the copy into.
+   * @param cap size of dest. Has to be at least len, since values are only ever shortened.
+   * @return Length of the copy.
+   */
+  static size_t replace_into (const char *src, size_t len, char *dest,
+                              size_t cap) noexcept (false)
+  {
+    return json_replace_into_with (src, len, dest, cap, suffix_matcher<Suffix> (),
+                                   char_replacement<Replace> ());
+  }
+
+  /**
+   * Same as replace_into (src.data (), src.size (), dest, cap).
+   */
+  static size_t replace_into (std::string_view src, char *dest, size_t cap) noexcept (false)
+  {
+    return replace_into (src.data (), src.size (), dest, cap);
+  }
+
+  /**
+   * Replaces, inside of buf itself, the values of all keys that end with Suffix with Replace.
+   * Nothing before the first replaced value is written.
+   * @param buf json to replace in.
+   * @param len length of buf.
+   * @return New length of buf.
+   */
+  static size_t replace_inplace (char *buf, size_t len) noexcept (false)
+  {
+    return json_replace_inplace_with (buf, len, suffix_matcher<Suffix> (),
+                                      char_replacement<Replace> ());
+  }
+
+  /**
+   * Reads through the json and creates a copy of it where all keys that end with Suffix have
+   * their corresponding values replaced with Replace.
+   * @param str string to read from, which does not need to be null terminated.
+   * @return New string with replaced values.
+   */
+  static std::string replace (std::string_view str) noexcept (false)
+  {
+    return json_replace_with (str, suffix_matcher<Suffix> (), char_replacement<Replace> ());
+  }
+
+  /**
+   * Counts how long replace (str) is, without writing it, so that exactly that much can be
+   * allocated for replace_into.
+   * @param str string to read from, which does not need to be null terminated.
+   * @return Length of replace (str).
+   */
+  static size_t replaced_len (std::string_view str) noexcept (false)
+  {
+    ReplaceError error;
+    size_t len = json_replaced_len_with (str.data (), str.size (), suffix_matcher<Suffix> (),
+                                         char_replacement<Replace> (), error);
+    if (error)
+      detail::throw_replace_error (error);
+    return len;
+  }
+
+  /**
+   * Same as replace (str), except that when no key in str ends with Suffix, str itself is
+   * returned without being copied or checked for errors.
+   * @param str string to read from, which does not need to be null terminated.
+   * @param storage where the new string is kept, if one is made.
+   * @return str, or storage with replaced values.
+   */
+  static std::string_view replace_view (std::string_view str, std::string &storage)
+      noexcept (false)
+  {
+    return json_replace_view_with (str, storage, suffix_matcher<Suffix> (),
+                                   char_replacement<Replace> ());
+  }
+};
+
+/**
+ * The replacer used by json_replace and json_replace_into.
+ */
+using default_json_replacer = json_replacer<JSON_REPLACE_TARGET_SUFFIX, JSON_REPLACE_CHAR>;
+
+/**
+ * Reads through the json and writes a copy of it into a buffer owned by the caller, where all
+ * keys that end with JSON_REPLACE_TARGET_SUFFIX have their corresponding values replaced with
+ * JSON_REPLACE_CHAR. Does not allocate. src does not need to be null terminated, and the copy is
+ * not either.
+ * @param src string to read from.
+ * @param len length of src.
+ * @param dest buffer to write the copy into.
+ * @param cap size of dest. Has to be at least len, since values are only ever shortened.
+ * @return Length of the copy.
+ */
+inline size_t json_replace_into (const char *src, size_t len, char *dest, size_t cap)
+    noexcept (false)
+{
+  return default_json_replacer::replace_into (src, len, dest, cap);
+}
+
+/**
+ * Reads through the json and writes a copy of it into a buffer owned by the caller, where all
+ * keys that end with JSON_REPLACE_TARGET_SUFFIX have their corresponding values replaced with
+ * JSON_REPLACE_CHAR. Does not allocate. The copy is not null terminated.
+ * @param src string to read from.
+ * @param dest buffer to write the copy into.
+ * @param cap size of dest. Has to be at least src.size ().
+ * @return Length of the copy.
+ */
+inline size_t json_replace_into (std::string_view src, char *dest, size_t cap) noexcept (false)
+{
+  return default_json_replacer::replace_into (src, dest, cap);
+}
+
+/**
+ * Reads through the json and creates a copy of it where all keys that end with
+ * JSON_REPLACE_TARGET_SUFFIX have their corresponding values replaced with JSON_REPLACE_CHAR.
+ * @param str string to read from, which does not need to be null terminated.
+ * @return New string with replaced values.
+ */
+inline std::string json_replace (std::string_view str) noexcept (false)
+{
+  return default_json_replacer::replace (str);
+}
+
+/**
+ * Reads through the json and creates a copy of it where all keys that end with
+ * JSON_REPLACE_TARGET_SUFFIX have their corresponding values replaced with JSON_REPLACE_CHAR.
+ * @param str C-string to read from.
+ * @return New string with replaced values.
+ */
+inline std::string json_replace (const char *str) noexcept (false)
+{
+  return json_replace (std::string_view (str));
+}
+
+/**
+ * Reads through the json and creates a copy of it where all keys that end with
+ * JSON_REPLACE_TARGET_SUFFIX have their corresponding values replaced with JSON_REPLACE_CHAR.
+ * @param str string to read from.
+ * @return New string with replaced values.
+ */
+inline std::string json_replace (const std::string &str) noexcept (false)
+{
+  return json_replace (std::string_view (str));
+}
+
+/**
+ * Counts how long json_replace (str) is, without writing it, so that a buffer of exactly that
+ * length can be given to json_replace_into.
+ * @param str string to read from, which does not need to be null terminated.
+ * @return Length of json_replace (str).
+ */
+inline size_t json_replaced_len (std::string_view str) noexcept (false)
+{
+  return default_json_replacer::replaced_len (str);
+}
+
+/**
+ * Same as json_replace (str), and adds what was read to stats.
+ * @param stats json_replace_stats, or json_timed_stats to also time every json_phase
+ */
+template <bool Timed>
+std::string json_replace (std::string_view str, basic_json_replace_stats<Timed> &stats)
+    noexcept (false)
+{
+  return json_replace_with (str, suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                            char_replacement<JSON_REPLACE_CHAR> (), stats);
+}
+
+/**
+ * Same as json_replace (str), except that when no key in str ends with JSON_REPLACE_TARGET_SUFFIX,
+ * str itself is returned without being copied, or read as json. Such input is not checked for
+ * errors, so this is meant for input that is known to be json.
+ * @param str string to read from, which does not need to be null terminated.
+ * @param storage where the new string is kept, if one is made.
+ * @return str, or storage with replaced values.
+ */
+inline std::string_view json_replace_view (std::string_view str, std::string &storage)
+    noexcept (false)
+{
+  return default_json_replacer::replace_view (str, storage);
+}
+
+/**
+ * Replaces, inside of buf itself, the values of all keys that end with JSON_REPLACE_TARGET_SUFFIX
+ * with JSON_REPLACE_CHAR. Since values only ever get shorter, everything after a replaced value is
+ * moved back, and nothing before the first replaced value is written.
+ * @param buf json to replace in, which does not need to be null terminated.
+ * @param len length of buf.
+ * @return New length of buf.
+ */
+inline size_t json_replace_inplace (char *buf, size_t len) noexcept (false)
+{
+  return json_replace_inplace_with (buf, len, suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                                    char_replacement<JSON_REPLACE_CHAR> ());
+}
+
+/**
+ * Same as json_replace_inplace (str.data (), str.size ()), and resizes str to the result.
+ */
+inline void json_replace_inplace (std::string &str) noexcept (false)
+{
+  str.resize (json_replace_inplace (str.data (), str.size ()));
+}
+
+/**
+ * Reads through the json as strict json and writes a copy of it into a buffer owned by the
+ * caller, where all keys that end with JSON_REPLACE_TARGET_SUFFIX have their corresponding values
+ * replaced with JSON_REPLACE_CHAR. Does not throw or allocate, and stops at the first byte that is
+ * not valid.
+ * @param src string to read from.
+ * @param len length of src.
+ * @param dest buffer to write the copy into, which can be src itself.
+ * @param cap size of dest. Has to be at least len, since values are only ever shortened.
+ * @param error set to where and why reading stopped, or to json_error::none
+ * @return Length of the copy, which is only complete without an error.
+ */
+inline size_t json_replace_validated (const char *src, size_t len, char *dest, size_t cap,
+                                      ReplaceError &error) noexcept
+{
+  return json_replace_validated_with (src, len, dest, cap,
+                                      suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                                      char_replacement<JSON_REPLACE_CHAR> (), error);
+}
+
+/**
+ * Does the same as json_replace_into (src, len, dest, cap) with replace_engine, but returns
+ * failure through error instead of throwing it. Does not throw or allocate.
+ * @param src string to read from.
+ * @param len length of src.
+ * @param dest buffer to write the copy into, which can be src itself.
+ * @param cap size of dest. Has to be at least len, since values are only ever shortened.
+ * @param error set to where and why reading stopped, or to json_error::none
+ * @return Length of the copy, which is only complete without an error.
+ */
+inline size_t json_replace_checked (const char *src, size_t len, char *dest, size_t cap,
+                                    ReplaceError &error) noexcept
+{
+  return json_replace_checked_with (src, len, dest, cap,
+                                    suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                                    char_replacement<JSON_REPLACE_CHAR> (), error);
+}
+
+#if defined(__cpp_lib_expected)
+/**
+ * Same as json_replace_checked (src.data (), src.size (), dest, cap, error).
+ * @return Length of the copy, or where and why reading stopped.
+ */
+inline std::expected<size_t, ReplaceError> json_replace_checked (std::string_view src, char *dest,
+                                                                 size_t cap) noexcept
+{
+  ReplaceError error;
+  size_t len = json_replace_checked (src.data (), src.size (), dest, cap, error);
+  if (error)
+    return std::unexpected (error);
+  return len;
+}
+
+/**
+ * Same as json_replace (str), but returns failure instead of throwing it, apart from
+ * std::bad_alloc.
+ * @return New string with replaced values, or where and why reading stopped.
+ */
+inline std::expected<std::string, ReplaceError> json_replace_checked (std::string_view str)
+{
+  ReplaceError error;
+  std::string new_str = detail::make_replaced_string (str.size (), [&] (char *dest)
+  {
+    return json_replace_checked (str.data (), str.size (), dest, str.size (), error);
+  });
+  if (error)
+    return std::unexpected (error);
+  return new_str;
+}
+#endif
+
+/**
+ * Reads through the json and writes a copy of it into a buffer owned by the caller, where all
+ * keys accepted by matcher have their corresponding values replaced with Replace.
+ * Does not allocate. src does not need to be null terminated, and the copy is not either.
+ * @tparam Replace character replaced values are replaced with
+ * @param src string to read from.
+ * @param len length of src.
+ * @param dest buffer to write the copy into.
+ * @param cap size of dest. Has to be at least len, since values are only ever shortened.
+ * @param matcher patterns of the keys whose values are replaced
+ * @return Length of the copy.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+size_t json_replace_into (const char *src, size_t len, char *dest, size_t cap,
+                          const KeyMatcher &matcher) noexcept (false)
+{
+  return json_replace_into_with (src, len, dest, cap, matcher, char_replacement<Replace> ());
+}
+
+/**
+ * Same as json_replace_inplace (buf, len), with the keys whose values are replaced chosen by
+ * matcher, and replaced with Replace.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+size_t json_replace_inplace (char *buf, size_t len, const KeyMatcher &matcher) noexcept (false)
+{
+  return json_replace_inplace_with (buf, len, matcher, char_replacement<Replace> ());
+}
+
+/**
+ * Same as json_replace_validated (src, len, dest, cap, error), with the keys whose values are
+ * replaced chosen by matcher, and replaced with Replace.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+size_t json_replace_validated (const char *src, size_t len, char *dest, size_t cap,
+                               const KeyMatcher &matcher, ReplaceError &error) noexcept
+{
+  return json_replace_validated_with (src, len, dest, cap, matcher, char_replacement<Replace> (),
+                                      error);
+}
+
+/**
+ * Same as json_replace_checked (src, len, dest, cap, error), with the keys whose values are
+ * replaced chosen by matcher, and replaced with Replace.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+size_t json_replace_checked (const char *src, size_t len, char *dest, size_t cap,
+                             const KeyMatcher &matcher, ReplaceError &error) noexcept
+{
+  return json_replace_checked_with (src, len, dest, cap, matcher, char_replacement<Replace> (),
+                                    error);
+}
+
+#if defined(__cpp_lib_expected)
+/**
+ * Same as json_replace_checked (src, dest, cap), with the keys whose values are replaced
+ * chosen by matcher, and replaced with Replace.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+std::expected<size_t, ReplaceError> json_replace_checked (std::string_view src, char *dest,
+                                                          size_t cap,
+                                                          const KeyMatcher &matcher) noexcept
+{
+  ReplaceError error;
+  size_t len = json_replace_checked<Replace> (src.data (), src.size (), dest, cap, matcher,
+                                              error);
+  if (error)
+    return std::unexpected (error);
+  return len;
+}
+#endif
+
+/**
+ * Reads through the json and creates a copy of it where all keys accepted by matcher have
+ * their corresponding values replaced with Replace.
+ * @tparam Replace character replaced values are replaced with
+ * @param str string to read from, which does not need to be null terminated.
+ * @param matcher patterns of the keys whose values are replaced
+ * @return New string with replaced values.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+std::string json_replace (std::string_view str, const KeyMatcher &matcher) noexcept (false)
+{
+  return json_replace_with (str, matcher, char_replacement<Replace> ());
+}
+
+/**
+ * Reads through the json and creates a copy of it where the values at the paths of selector
+ * are replaced with Replace, along with every string inside of them.
+ * @tparam Replace character replaced values are replaced with
+ * @param str string to read from, which does not need to be null terminated.
+ * @param selector paths of the values that are replaced
+ * @return New string with replaced values.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+std::string json_replace (std::string_view str, const KeyPathMatcher &selector) noexcept (false)
+{
+  return json_replace_with (str, selector, char_replacement<Replace> ());
+}
+
+/**
+ * Counts how long json_replace (str, matcher) is, without writing it, so that a buffer of
+ * exactly that length can be given to json_replace_into.
+ * @param str string to read from, which does not need to be null terminated.
+ * @param matcher patterns of the keys whose values are replaced
+ * @return Length of json_replace (str, matcher).
+ */
+inline size_t json_replaced_len (std::string_view str, const KeyMatcher &matcher) noexcept (false)
+{
+  ReplaceError error;
+  size_t len = json_replaced_len_with (str.data (), str.size (), matcher,
+                                       char_replacement<JSON_REPLACE_CHAR> (), error);
+  if (error)
+    detail::throw_replace_error (error);
+  return len;
+}
+
+/**
+ * Same as json_replace (str, matcher), and adds what was read to stats.
+ * @param stats json_replace_stats, or json_timed_stats to also time every json_phase
+ */
+template <char Replace = JSON_REPLACE_CHAR, bool Timed>
+std::string json_replace (std::string_view str, const KeyMatcher &matcher,
+                          basic_json_replace_stats<Timed> &stats) noexcept (false)
+{
+  return json_replace_with (str, matcher, char_replacement<Replace> (), stats);
+}
+
+/**
+ * Reads through the json and creates a copy of it where all keys accepted by matcher have
+ * their corresponding values replaced by replacement, such as pad_replacement,
+ * hash_replacement or literal_replacement.
+ * @param str string to read from, which does not need to be null terminated.
+ * @return New string with replaced values.
+ */
+template <typename Replacement>
+std::string json_replace (std::string_view str, const KeyMatcher &matcher,
+                          const Replacement &replacement) noexcept (false)
+{
+  return json_replace_with (str, matcher, replacement);
+}
+
+/**
+ * Same as json_replace_view (str, storage), with the keys whose values are replaced chosen by
+ * matcher, and replaced with Replace.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+std::string_view json_replace_view (std::string_view str, std::string &storage,
+                                    const KeyMatcher &matcher) noexcept (false)
+{
+  return json_replace_view_with (str, storage, matcher, char_replacement<Replace> ());
+}
+
+/**
+ * The byte offsets of every key and string value of a json, as found by the scanner, so that
+ * the same json can be replaced again with other keys, by json_remask_with, without reading
+ * it as json: only the indexed keys are compared, and the spans between replaced values are
+ * copied as they are. It can be saved next to the json with save, and read back with load.
+ * An index belongs to the exact bytes it was built from. json_remask_with checks that they
+ * are as long and have quotes where the index says, but not that every byte is the same.
+ */
+class JsonKeyIndex
+{
+public:
+  /**
+   * A key or a string value, from its opening quote to one past its closing quote.
+   */
+  struct entry
+  {
+    size_t begin;
+    size_t end;
+    // for a key, the index of the first entry after its value, and 0 for a string value
+    size_t after;
+  };
+
+  JsonKeyIndex () = default;
+
+  /**
+   * Reads json the way the scanner does, and records all of its keys and string values.
+   * @param json string to read from, which does not need to be null terminated.
+   */
+  explicit JsonKeyIndex (std::string_view json) noexcept (false) : length_ (json.size ())
+  {
+    const char *begin = json.data ();
+    const char *src = begin;
+    const char *end = begin + json.size ();
+    json_grammar grammar;
+    // keys whose values are still being read, with the depth they are at
+    std::vector<std::pair<size_t, size_t>> open_keys;
+    json_error code = json_error::none;
+    while (src != end)
+    {
+      if (*src != '"')
+      {
+        if ((code = grammar.read_byte (*src)) != json_error::none)
+          break;
+        ++src;
+      }
+      else
+      {
+        bool key = grammar.at_key ();
+        const char *string_begin = src;
+        src = detail::skip_json_string_body (src + 1, end);
+        if (src == end)
+        {
+          code = json_error::unexpected_end;
+          break;
+        }
+        ++src;
+        entries_.push_back ({static_cast<size_t> (string_begin - begin),
+                             static_cast<size_t> (src - begin), 0});
+        if (key)
+        {
+          open_keys.emplace_back (entries_.size () - 1, grammar.depth);
+          grammar.read_key (false);
+          continue;
+        }
+        grammar.read_value ();
+      }
+      // a value ends back at the depth of its key, once a key is expected again, and a key
+      // that is left without a value ends with its object
+      while (!open_keys.empty () && (open_keys.back ().second > grammar.depth ||
+                                     (open_keys.back ().second == grammar.depth &&
+                                      grammar.expect_key)))
+      {
+        entries_[open_keys.back ().first].after = entries_.size ();
+        open_keys.pop_back ();
+      }
+    }
+    if (code == json_error::none && !grammar.complete ())
+      code = json_error::unexpected_end;
+    if (code != json_error::none)
+      detail::throw_replace_error ({code, static_cast<size_t> (src - begin)});
+  }
+
+  /**
+   * @return length of the json the index was built from
+   */
+  size_t length () const
+  {
+    return length_;
+  }
+
+  const std::vector<entry> &entries () const
+  {
+    return entries_;
+  }
+
+  /**
+   * @return the index as bytes, which load reads back: a magic number, the length of the
+   *         json, the number of entries, and three numbers for every entry, all of them 8 byte
+   *         little endian
+   */
+  std::string save () const noexcept (false)
+  {
+    std::string out (index_magic, sizeof (index_magic));
+    out.reserve (sizeof (index_magic) + 8 * (2 + 3 * entries_.size ()));
+    auto put = [&out] (uint64_t value)
+    {
+      for (size_t byte = 0; byte < 8; ++byte)
+        out.push_back (static_cast<char> (value >> (8 * byte)));
+    };
+    put (length_);
+    put (entries_.size ());
+    for (const entry &e : entries_)
+    {
+      put (e.begin);
+      put (e.end);
+      put (e.after);
+    }
+    return out;
+  }
+
+  /**
+   * Reads an index written by save, and checks that its entries are in order, inside of the
+   * json, and that every key is followed by its value, so that json_remask_with never reads
+   * outside of a json of the right length, whatever the bytes.
+   * @return the index
+   */
+  static JsonKeyIndex load (std::string_view data) noexcept (false)
+  {
+    size_t pos = sizeof (index_magic);
+    if (data.size () < pos + 16 || memcmp (data.data (), index_magic, pos) != 0)
+      throw std::invalid_argument (JSON_REPLACE_KEY_INDEX_FORMAT_ERROR_MSG);
+    auto get = [&data, &pos] ()
+    {
+      uint64_t value = 0;
+      for (size_t byte = 0; byte < 8; ++byte)
+        value |= static_cast<uint64_t> (static_cast<uint8_t> (data[pos + byte])) << (8 * byte);
+      pos += 8;
+      return value;
+    };
+    JsonKeyIndex index;
+    index.length_ = get ();
+    uint64_t count = get ();
+    if ((data.size () - pos) % 24 != 0 || count != (data.size () - pos) / 24)
+      throw std::invalid_argument (JSON_REPLACE_KEY_INDEX_FORMAT_ERROR_MSG);
+    index.entries_.resize (count);
+    size_t last_end = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+      entry &e = index.entries_[i];
+      e.begin = get ();
+      e.end = get ();
+      e.after = get ();
+      if (e.begin < last_end || e.begin > e.end || e.end - e.begin < 2 || e.end > index.length_ ||
+          (e.after != 0 && (e.after <= i || e.after > count)))
+        throw std::invalid_argument (JSON_REPLACE_KEY_INDEX_FORMAT_ERROR_MSG);
+      last_end = e.end;
+    }
+    return index;
+  }
+
+private:
+  static constexpr char index_magic[8] = {'J', 'R', 'K', 'E', 'Y', 'I', 'X', '1'};
+
+  size_t length_ = 0;
+  std::vector<entry> entries_;
+};
+
+/**
+ * Replaces src again with the keys accepted by matches, using the index built from it, so
+ * that the keys are compared from the index and nothing else is read as json. Gives the same
+ * copy as json_replace_no_try_catch over src: the value strings that follow a matching key,
+ * up to the end of its value, are replaced, unless they are empty.
+ * @param src json that index was built from.
+ * @param len length of src.
+ * @param index its keys and string values.
+ * @param dest buffer to write the copy into, which can not overlap src.
+ * @param cap size of dest. Has to be at least max_replaced_len (len, replacement).
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @return Length of the copy.
+ */
+template <typename Matcher, typename Replacement>
+size_t json_remask_into_with (const char *src, size_t len, const JsonKeyIndex &index,
+                              char *dest, size_t cap, const Matcher &matches,
+                              const Replacement &replacement) noexcept (false)
+{
+  static_assert (!std::is_same_v<Matcher, KeyPathMatcher>, "the index does not keep the paths "
+                                                           "of keys");
+  if (len != index.length ())
+    throw std::invalid_argument (JSON_REPLACE_KEY_INDEX_DOCUMENT_ERROR_MSG);
+  if (cap < max_replaced_len (len, replacement))
+    throw std::length_error (JSON_REPLACE_OUTPUT_CAPACITY_ERROR_MSG);
+  char *dest_begin = dest;
+  const char *copied = src;
+  // entries before this one are inside of the value of a matching key
+  size_t masked_until = 0;
+  const std::vector<JsonKeyIndex::entry> &entries = index.entries ();
+  for (size_t i = 0; i < entries.size (); ++i)
+  {
+    const JsonKeyIndex::entry &e = entries[i];
+    bool key = e.after != 0;
+    // keys inside of a replaced value are not compared, and empty strings are not replaced
+    if (i < masked_until ? key || e.end - e.begin == 2 : !key)
+      continue;
+    const char *string_begin = src + e.begin;
+    const char *string_end = src + e.end;
+    if (*string_begin != '"' || string_end[-1] != '"')
+      throw std::invalid_argument (JSON_REPLACE_KEY_INDEX_DOCUMENT_ERROR_MSG);
+    if (key)
+    {
+      if (matches (string_begin, string_end))
+        masked_until = e.after;
+      continue;
+    }
+    memcpy (dest, copied, string_begin + 1 - copied);
+    dest = replacement (string_begin + 1, string_end - 1, dest + (string_begin + 1 - copied));
+    copied = string_end - 1;
+  }
+  memcpy (dest, copied, src + len - copied);
+  return dest + (src + len - copied) - dest_begin;
+}
+
+/**
+ * Runs json_remask_into_with over str into a new string, which is as long as the copy.
+ * @param str json that index was built from.
+ * @param index its keys and string values.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @return New string with replaced values.
+ */
+template <typename Matcher, typename Replacement>
+std::string json_remask_with (std::string_view str, const JsonKeyIndex &index,
+                              const Matcher &matches,
+                              const Replacement &replacement) noexcept (false)
+{
+  size_t cap = max_replaced_len (str.size (), replacement);
+  return detail::make_replaced_string (cap, [&] (char *dest)
+  {
+    return json_remask_into_with (str.data (), str.size (), index, dest, cap, matches,
+                                  replacement);
+  });
+}
+
+/**
+ * Same as json_replace (str, matcher), using the index built from str.
+ * Ex. JsonKeyIndex index (json);
+ *     json_remask (json, index, KeyMatcher ({"_X"})) == json_replace (json, KeyMatcher ({"_X"}))
+ * @tparam Replace character replaced values are replaced with
+ * @param str json that index was built from.
+ * @param index its keys and string values.
+ * @param matcher patterns of the keys whose values are replaced
+ * @return New string with replaced values.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+std::string json_remask (std::string_view str, const JsonKeyIndex &index,
+                         const KeyMatcher &matcher) noexcept (false)
+{
+  return json_remask_with (str, index, matcher, char_replacement<Replace> ());
+}
+
+/**
+ * A fixed set of threads that runs a number of independent tasks. Every worker starts with an
+ * equal range of the tasks, and a worker whose range runs out steals the back half of the
+ * range of another worker, so uneven tasks still keep all workers busy.
+ * The thread that calls run is one of the workers.
+ */
+class WorkStealingPool
+{
+public:
+  /**
+   * @param threads number of workers, or 0 for one per hardware thread
+   */
+  explicit WorkStealingPool (size_t threads = 0)
+      : ranges_ (threads ? threads : std::max (1u, std::thread::hardware_concurrency ()))
+  {
+    for (size_t worker = 1; worker < ranges_.size (); ++worker)
+      threads_.emplace_back ([this, worker] { wait_for_work (worker); });
+  }
+
+  ~WorkStealingPool ()
+  {
+    {
+      std::lock_guard<std::mutex> lock (mutex_);
+      stopping_ = true;
+    }
+    start_.notify_all ();
+    for (std::thread &thread : threads_)
+      thread.join ();
+  }
+
+  WorkStealingPool (const WorkStealingPool &) = delete;
+  WorkStealingPool &operator= (const WorkStealingPool &) = delete;
+
+  /**
+   * @return number of workers, including the thread that calls run
+   */
+  size_t size () const
+  {
+    return ranges_.size ();
+  }
+
+  /**
+   * Runs job once for every task in [0, task_count), and returns when all of them are done.
+   * Only one run can be in progress at a time.
+   * If any job throws, the first exception is rethrown here after the others are done.
+   * @param task_count number of tasks
+   * @param job called with the task and the worker running it, which is less than size ()
+   */
+  void run (size_t task_count, const std::function<void (size_t task, size_t worker)> &job)
+      noexcept (false)
+  {
+    {
+      std::lock_guard<std::mutex> lock (mutex_);
+      for (size_t worker = 0; worker < ranges_.size (); ++worker)
+      {
+        ranges_[worker].next = task_count * worker / ranges_.size ();
+        ranges_[worker].end = task_count * (worker + 1) / ranges_.size ();
+      }
+      job_ = &job;
+      error_ = nullptr;
+      busy_ = threads_.size ();
+      ++generation_;
+    }
+    start_.notify_all ();
+    work (0);
+    std::unique_lock<std::mutex> lock (mutex_);
+    done_.wait (lock, [this] { return busy_ == 0; });
+    job_ = nullptr;
+    if (error_)
+      std::rethrow_exception (error_);
+  }
+
+private:
+  struct task_range
+  {
+    std::mutex mutex;
+    size_t next = 0;
+    size_t end = 0;
+  };
+
+  void wait_for_work (size_t worker)
+  {
+    size_t seen = 0;
+    while (true)
+    {
+      {
+        std::unique_lock<std::mutex> lock (mutex_);
+        start_.wait (lock, [this, seen] { return stopping_ || generation_ != seen; });
+        if (stopping_)
+          return;
+        seen = generation_;
+      }
+      work (worker);
+      std::lock_guard<std::mutex> lock (mutex_);
+      if (--busy_ == 0)
+        done_.notify_one ();
+    }
+  }
+
+  void work (size_t worker)
+  {
+    size_t task;
+    while (next_task (worker, task))
+    {
+      try
+      {
+        (*job_) (task, worker);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock (mutex_);
+        if (!error_)
+          error_ = std::current_exception ();
+      }
+    }
+  }
+
+  bool next_task (size_t worker, size_t &task)
+  {
+    task_range &own = ranges_[worker];
+    {
+      std::lock_guard<std::mutex> lock (own.mutex);
+      if (own.next != own.end)
+      {
+        task = own.next++;
+        return true;
+      }
+    }
+    for (size_t i = 1; i < ranges_.size (); ++i)
+    {
+      task_range &victim = ranges_[(worker + i) % ranges_.size ()];
+      size_t stolen_begin, stolen_end;
+      {
+        std::lock_guard<std::mutex> lock (victim.mutex);
+        if (victim.next == victim.end)
+          continue;
+        stolen_end = victim.end;
+        stolen_begin = victim.next + (victim.end - victim.next) / 2;
+        victim.end = stolen_begin;
+      }
+      std::lock_guard<std::mutex> lock (own.mutex);
+      own.next = stolen_begin;
+      own.end = stolen_end;
+      // a victim with a single task left gives it away whole
+      if (own.next == own.end)
+        continue;
+      task = own.next++;
+      return true;
+    }
+    return false;
+  }
+
+  std::vector<task_range> ranges_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const std::function<void (size_t, size_t)> *job_ = nullptr;
+  std::exception_ptr error_;
+  size_t busy_ = 0;
+  size_t generation_ = 0;
+  bool stopping_ = false;
+};
+
+/**
+ * What json_replace_batch_into_with keeps between the two runs over the pool: the chunks the
+ * input was cut into, and the arena of every worker. Reusing one of these across batches keeps
+ * them from allocating once they have grown.
+ */
+struct json_batch_buffers
+{
+  struct chunk
+  {
+    const char *begin;
+    const char *end;
+    size_t worker;
+    size_t arena_offset;
+    size_t len;
+    size_t offset;
+  };
+
+  std::vector<chunk> chunks;
+  std::vector<std::vector<char>> arenas;
+};
+
+/**
+ * Replaces values in newline delimited json the same way json_replace does, with the records
+ * split between the workers of pool. The input is cut at newlines into chunks of many records,
+ * every worker writes the chunks it takes into its own arena, and the chunks are then copied
+ * into dest in their original order.
+ * @param ndjson records separated by '\n', none of which contains a raw newline.
+ * @param pool workers to run on
+ * @param dest buffer to write the copy into, of at least
+ *             max_replaced_len (ndjson.size (), replacement) bytes.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param buffers where the chunks and arenas are kept, which can be reused by later batches
+ * @param engine engine that every worker runs, replace_engine unless given
+ * @return Length of the copy.
+ */
+template <typename Matcher, typename Replacement>
+size_t json_replace_batch_into_with (std::string_view ndjson, WorkStealingPool &pool, char *dest,
+                                     const Matcher &matches, const Replacement &replacement,
+                                     json_batch_buffers &buffers,
+                                     json_engine engine = replace_engine) noexcept (false)
+{
+  using chunk = json_batch_buffers::chunk;
+
+  // several chunks per worker, so there is something left to steal from a slow one
+  const size_t min_chunk_size = 1 << 16;
+  size_t chunk_size = std::max (min_chunk_size, ndjson.size () / (pool.size () * 8) + 1);
+  std::vector<chunk> &chunks = buffers.chunks;
+  chunks.clear ();
+  const char *src = ndjson.data ();
+  const char *src_end = src + ndjson.size ();
+  while (src != src_end)
+  {
+    const char *cut = src + std::min<size_t> (chunk_size, src_end - src);
+    if (cut != src_end)
+    {
+      const char *newline = static_cast<const char *> (memchr (cut, '\n', src_end - cut));
+      cut = newline ? newline + 1 : src_end;
+    }
+    chunks.push_back ({src, cut, 0, 0, 0, 0});
+    src = cut;
+  }
+
+  std::vector<std::vector<char>> &arenas = buffers.arenas;
+  arenas.resize (std::max (arenas.size (), pool.size ()));
+  for (std::vector<char> &arena : arenas)
+  {
+    arena.clear ();
+    arena.reserve (ndjson.size () / pool.size () + chunk_size);
+  }
+  pool.run (chunks.size (), [&] (size_t task, size_t worker)
+  {
+    chunk &c = chunks[task];
+    std::vector<char> &arena = arenas[worker];
+    c.worker = worker;
+    c.arena_offset = arena.size ();
+    arena.resize (arena.size () + max_replaced_len (c.end - c.begin, replacement));
+    c.len = json_replace_no_try_catch (c.begin, c.end, arena.data () + c.arena_offset, matches,
+                                       replacement, no_stats (), engine);
+    arena.resize (c.arena_offset + c.len);
+  });
+
+  size_t total = 0;
+  for (chunk &c : chunks)
+  {
+    c.offset = total;
+    total += c.len;
+  }
+  pool.run (chunks.size (), [&] (size_t task, size_t)
+  {
+    const chunk &c = chunks[task];
+    memcpy (dest + c.offset, arenas[c.worker].data () + c.arena_offset, c.len);
+  });
+  return total;
+}
+
+/**
+ * Runs json_replace_batch_into_with into a new string.
+ */
+template <typename Matcher, typename Replacement>
+std::string json_replace_batch_with (std::string_view ndjson, WorkStealingPool &pool,
+                                     const Matcher &matches,
+                                     const Replacement &replacement) noexcept (false)
+{
+  json_batch_buffers buffers;
+  std::string new_str (max_replaced_len (ndjson.size (), replacement), '\0');
+  new_str.resize (json_replace_batch_into_with (ndjson, pool, &new_str[0], matches, replacement,
+                                                buffers));
+  return new_str;
+}
+
+/**
+ * Reads through newline delimited json on all workers of pool, and creates a copy of it where
+ * all keys that end with JSON_REPLACE_TARGET_SUFFIX have their corresponding values replaced with
+ * JSON_REPLACE_CHAR.
+ * @param ndjson records separated by '\n', none of which contains a raw newline.
+ * @param pool workers to run on
+ * @return New string with replaced values, in the same order.
+ */
+inline std::string json_replace_batch (std::string_view ndjson, WorkStealingPool &pool)
+    noexcept (false)
+{
+  return json_replace_batch_with (ndjson, pool, suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                                  char_replacement<JSON_REPLACE_CHAR> ());
+}
+
+/**
+ * Same as json_replace_batch (ndjson, pool), with the keys whose values are replaced chosen by
+ * matcher.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+std::string json_replace_batch (std::string_view ndjson, WorkStealingPool &pool,
+                                const KeyMatcher &matcher) noexcept (false)
+{
+  return json_replace_batch_with (ndjson, pool, matcher, char_replacement<Replace> ());
+}
+
+/**
+ * What json_replace_parallel_into_with keeps between runs: the summary of every chunk the
+ * input was cut into, the grammar levels at every cut, and the pieces between the cuts, which
+ * are replaced into the arenas of batch. Reusing one of these keeps them from allocating once
+ * they have grown.
+ */
+struct json_split_buffers
+{
+  /**
+   * The brackets of a part of a chunk that are not matched inside of that part.
+   */
+  struct brackets
+  {
+    std::string closed; // brackets that close levels opened before the part, in order
+    std::vector<const char *> open; // brackets that are left open, outermost first
+
+    /**
+     * @return false if bracket does not close the innermost bracket left open
+     */
+    bool read (const char *bracket)
+    {
+      if (*bracket == '{' || *bracket == '[')
+        open.push_back (bracket);
+      else if (open.empty ())
+        closed.push_back (*bracket);
+      else if ((*open.back () == '{') != (*bracket == '}'))
+        return false;
+      else
+        open.pop_back ();
+      return true;
+    }
+  };
+
+  /**
+   * What a chunk looks like if it starts outside of, or inside of, a string.
+   */
+  struct chunk_start
+  {
+    const char *comma; // first ',' outside of strings, or nullptr
+    brackets head; // brackets before comma
+    brackets tail; // brackets after comma
+    bool plain; // no bracket mismatch, and no backslash outside of strings
+  };
+
+  struct chunk
+  {
+    const char *begin;
+    const char *end;
+    bool odd_quotes; // ends inside of a string if it starts outside of one, and the other way
+    chunk_start starts[2]; // [1] is read as if the chunk starts inside of a string
+  };
+
+  size_t min_chunk_size = 1 << 16;
+  std::vector<chunk> chunks;
+  std::vector<uint8_t> levels; // levels of the grammar at the start of every piece
+  std::vector<size_t> level_offsets; // where the levels of every piece start, and the end
+  std::vector<ReplaceError> errors; // of every piece
+  json_batch_buffers batch; // the pieces between the cuts, and the arenas
+};
+
+namespace detail
+{
+
+/**
+ * Stage 1 of json_replace_parallel_into_with. Reads the quotes, backslashes and structural
+ * characters of a chunk with the structural index kernels, for both a chunk that starts outside
+ * of a string and one that starts inside of one, since that is only known once every chunk
+ * before it is read. Either way the quotes are the same, so only which side of them a
+ * structural character is on changes.
+ * @param src start of the whole json, which is read back from the chunk for backslashes
+ * @param c chunk to read, whose begin and end are set
+ */
+inline void summarize_json_chunk (const char *src, json_split_buffers::chunk &c)
+{
+  json_index_carry carry;
+  // backslashes are only ever inside of strings, so a run of them escapes the same either way
+  const char *run = c.begin;
+  while (run != src && run[-1] == '\\')
+    --run;
+  carry.odd_backslash = (c.begin - run) % 2;
+  for (json_split_buffers::chunk_start &start : c.starts)
+  {
+    start.comma = nullptr;
+    start.head.closed.clear ();
+    start.head.open.clear ();
+    start.tail.closed.clear ();
+    start.tail.open.clear ();
+    start.plain = true;
+  }
+  size_t len = c.end - c.begin;
+  for (size_t i = 0; i < len; i += 64)
+  {
+    // the last block is padded with whitespace, so nothing past end is read
+    const char *block = c.begin + i;
+    char padded[64];
+    if (len - i < 64)
+    {
+      memset (padded, ' ', sizeof (padded));
+      memcpy (padded, block, len - i);
+      block = padded;
+    }
+    json_block bits;
+    index_kernel->classify (block, &bits);
+    uint64_t quote = bits.quote & ~find_escaped (bits.backslash, carry.odd_backslash);
+    uint64_t in_string = index_kernel->prefix_xor (quote) ^ carry.in_string;
+    carry.in_string = static_cast<uint64_t> (static_cast<int64_t> (in_string) >> 63);
+    uint64_t outside[2] = {~in_string, in_string};
+    for (size_t s = 0; s < 2; ++s)
+    {
+      json_split_buffers::chunk_start &start = c.starts[s];
+      if (bits.backslash & outside[s])
+        start.plain = false;
+      for (uint64_t structural = bits.structural & outside[s]; structural != 0;
+           structural &= structural - 1)
+      {
+        const char *p = c.begin + i + std::countr_zero (structural);
+        if (*p == ':')
+          continue;
+        if (*p == ',')
+        {
+          if (start.comma == nullptr)
+            start.comma = p;
+          continue;
+        }
+        if (!(start.comma ? start.tail : start.head).read (p))
+          start.plain = false;
+      }
+    }
+  }
+  c.odd_quotes = carry.in_string != 0;
+}
+
+/**
+ * Finds whether the object or array opened at bracket is the value of a key accepted by
+ * matches, by reading back from it for the key the same way json_grammar would have read it.
+ * @param src start of the whole json, which bracket is in, outside of any string
+ * @param in_object whether bracket is inside of an object, or outside of all brackets
+ * @param known set to false if that can not be told without reading the json from src, which
+ *              only happens for strings that follow each other without a comma
+ * @return whether every string value inside of bracket is replaced
+ */
+template <typename Matcher>
+bool opens_replaced_value (const char *src, const char *bracket, bool in_object,
+                           const Matcher &matches, bool &known)
+{
+  auto skip_back = [src] (const char *p)
+  {
+    while (p != src && (is_json_whitespace (p[-1]) || p[-1] == ':'))
+      --p;
+    return p;
+  };
+  const char *key_end = skip_back (bracket);
+  // only a key right before the bracket makes json_grammar replace its value
+  if (!in_object || key_end == src || key_end[-1] != '"')
+    return false;
+  // the opening quote is the first one before the closing quote that is not escaped
+  const char *key = key_end - 1;
+  while (true)
+  {
+    if (key == src)
+    {
+      known = false;
+      return false;
+    }
+    --key;
+    if (*key != '"')
+      continue;
+    const char *run = key;
+    while (run != src && run[-1] == '\\')
+      --run;
+    if ((key - run) % 2 == 0)
+      break;
+  }
+  // the string is a key unless it follows the key of the same member
+  const char *before = skip_back (key);
+  if (before != src && before[-1] == '"')
+  {
+    known = false;
+    return false;
+  }
+  return matches (key, key_end);
+}
+
+} // namespace detail
+
+/**
+ * Replaces values in a single json the same way json_replace does, split between the workers
+ * of pool, for input too large to wait on one thread for. It runs in three stages over pool:
+ *   1. The input is cut into chunks, and summarize_json_chunk reads each one for its quote
+ *      parity, and its brackets both as if it started inside and outside of a string.
+ *   2. A prefix xor over the quote parities tells which one every chunk is. Going through the
+ *      chunks in order, their brackets then give the levels of the grammar at the first comma
+ *      of every chunk, where the input is cut again into pieces. A grammar right after a comma
+ *      always expects a key next, so the levels are all that the pieces start from.
+ *   3. Every piece is replaced from its levels into the arena of its worker, by the scanner
+ *      or the structural index engine, as engine says. The pieces are then copied
+ *      into dest at offsets from a prefix sum over their lengths.
+ * Falls back to json_replace_no_throw on one thread for anything the chunks can not tell,
+ * such as a backslash outside of strings, which json_grammar reads as a scalar, or an error
+ * from any piece, so that both the output and the error are the same as json_replace_no_throw
+ * gives. The validating engine, which does not read through a json_grammar, always runs on
+ * one thread, and KeyPathMatcher, which needs whole paths at the cuts, is not supported.
+ * @param json string to read from, which does not need to be null terminated.
+ * @param pool workers to run on
+ * @param dest buffer to write the copy into, of at least
+ *             max_replaced_len (json.size (), replacement) bytes.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param buffers where the chunks, pieces and arenas are kept, which can be reused
+ * @param error set to where and why reading stopped, and left alone if it reached the end
+ * @param engine engine that every piece runs, replace_engine unless given
+ * @return Length of the copy, which is only complete without an error.
+ */
+template <typename Matcher, typename Replacement>
+size_t json_replace_parallel_into_with (std::string_view json, WorkStealingPool &pool,
+                                        char *dest, const Matcher &matches,
+                                        const Replacement &replacement,
+                                        json_split_buffers &buffers, ReplaceError &error,
+                                        json_engine engine = replace_engine) noexcept (false)
+{
+  static_assert (!std::is_same_v<Matcher, KeyPathMatcher>,
+                 "a KeyPathMatcher needs the whole path at every cut, and not only the levels");
+  using chunk = json_split_buffers::chunk;
+  using piece = json_batch_buffers::chunk;
+
+  const char *src = json.data ();
+  const char *src_end = src + json.size ();
+  auto sequential = [&] ()
+  {
+    return json_replace_no_throw (src, src_end, dest, matches, replacement, error, no_stats (),
+                                  engine);
+  };
+  if (engine == json_engine::validating)
+    return sequential ();
+
+  // several chunks per worker, so there is something left to steal from a slow one
+  size_t chunk_size = std::max (buffers.min_chunk_size, json.size () / (pool.size () * 4) + 1);
+  size_t chunk_count = (json.size () + chunk_size - 1) / chunk_size;
+  // on a single worker, reading every chunk first only adds to the time
+  if (chunk_count < 2 || pool.size () < 2)
+    return sequential ();
+  std::vector<chunk> &chunks = buffers.chunks;
+  chunks.resize (chunk_count);
+  pool.run (chunk_count, [&] (size_t task, size_t)
+  {
+    chunk &c = chunks[task];
+    c.begin = src + task * chunk_size;
+    c.end = task + 1 == chunk_count ? src_end : c.begin + chunk_size;
+    detail::summarize_json_chunk (src, c);
+  });
+
+  std::vector<uint8_t> &levels = buffers.levels;
+  std::vector<size_t> &level_offsets = buffers.level_offsets;
+  std::vector<piece> &pieces = buffers.batch.chunks;
+  levels.clear ();
+  // the first piece starts outside of all brackets
+  level_offsets.assign (2, 0);
+  pieces.clear ();
+  std::vector<uint8_t> stack;
+  auto replay = [&] (const json_split_buffers::brackets &part)
+  {
+    for (char bracket : part.closed)
+    {
+      if (stack.empty () || ((stack.back () & json_grammar::object) != 0) != (bracket == '}'))
+        return false;
+      stack.pop_back ();
+    }
+    for (const char *bracket : part.open)
+    {
+      if (stack.size () == JSON_REPLACE_MAX_DEPTH)
+        return false;
+      bool in_object = stack.empty () || stack.back () & json_grammar::object;
+      bool known = true;
+      bool masked = detail::opens_replaced_value (src, bracket, in_object, matches, known) ||
+          (!stack.empty () && stack.back () & json_grammar::masked);
+      if (!known)
+        return false;
+      stack.push_back ((*bracket == '{' ? json_grammar::object : 0) |
+                       (masked ? json_grammar::masked : 0));
+    }
+    return true;
+  };
+  const char *piece_begin = src;
+  bool in_string = false;
+  for (size_t i = 0; i < chunk_count; ++i)
+  {
+    const json_split_buffers::chunk_start &start = chunks[i].starts[in_string];
+    if (!start.plain || !replay (start.head))
+      return sequential ();
+    if (start.comma != nullptr && i != 0)
+    {
+      pieces.push_back ({piece_begin, start.comma + 1, 0, 0, 0, 0});
+      piece_begin = start.comma + 1;
+      levels.insert (levels.end (), stack.begin (), stack.end ());
+      level_offsets.push_back (levels.size ());
+    }
+    if (!replay (start.tail))
+      return sequential ();
+    in_string ^= chunks[i].odd_quotes;
+  }
+  pieces.push_back ({piece_begin, src_end, 0, 0, 0, 0});
+  if (pieces.size () < 2)
+    return sequential ();
+
+  std::vector<std::vector<char>> &arenas = buffers.batch.arenas;
+  arenas.resize (std::max (arenas.size (), pool.size ()));
+  for (std::vector<char> &arena : arenas)
+  {
+    arena.clear ();
+    arena.reserve (json.size () / pool.size () + chunk_size);
+  }
+  buffers.errors.assign (pieces.size (), ReplaceError ());
+  pool.run (pieces.size (), [&] (size_t task, size_t worker)
+  {
+    piece &c = pieces[task];
+    std::vector<char> &arena = arenas[worker];
+    json_grammar grammar;
+    grammar.depth = level_offsets[task + 1] - level_offsets[task];
+    std::copy (levels.begin () + level_offsets[task], levels.begin () + level_offsets[task + 1],
+               grammar.levels);
+    c.worker = worker;
+    c.arena_offset = arena.size ();
+    arena.resize (arena.size () + max_replaced_len (c.end - c.begin, replacement));
+    no_stats stats;
+    c.len = detail::json_replace_engine_from (c.begin, c.end, arena.data () + c.arena_offset,
+                                              grammar, matches, replacement, stats,
+                                              buffers.errors[task], engine);
+    arena.resize (c.arena_offset + c.len);
+  });
+
+  size_t total = 0;
+  for (size_t i = 0; i < pieces.size (); ++i)
+  {
+    // every piece but the last one ends inside of the json
+    const ReplaceError &piece_error = buffers.errors[i];
+    bool cut = i + 1 != pieces.size () && piece_error.code == json_error::unexpected_end &&
+        piece_error.offset == static_cast<size_t> (pieces[i].end - pieces[i].begin);
+    if (piece_error && !cut)
+      return sequential ();
+    pieces[i].offset = total;
+    total += pieces[i].len;
+  }
+  pool.run (pieces.size (), [&] (size_t task, size_t)
+  {
+    const piece &c = pieces[task];
+    memcpy (dest + c.offset, arenas[c.worker].data () + c.arena_offset, c.len);
+  });
+  return total;
+}
+
+/**
+ * Runs json_replace_parallel_into_with into a new string.
+ */
+template <typename Matcher, typename Replacement>
+std::string json_replace_parallel_with (std::string_view json, WorkStealingPool &pool,
+                                        const Matcher &matches,
+                                        const Replacement &replacement) noexcept (false)
+{
+  json_split_buffers buffers;
+  ReplaceError error;
+  std::string new_str (max_replaced_len (json.size (), replacement), '\0');
+  new_str.resize (json_replace_parallel_into_with (json, pool, &new_str[0], matches,
+                                                   replacement, buffers, error));
+  if (error)
+    detail::throw_replace_error (error);
+  return new_str;
+}
+
+/**
+ * Reads through a single json on all workers of pool, and creates a copy of it where all keys
+ * that end with JSON_REPLACE_TARGET_SUFFIX have their corresponding values replaced with
+ * JSON_REPLACE_CHAR. Unlike json_replace_batch, this splits one large document, and not a list of
+ * records.
+ * @param json string to read from, which does not need to be null terminated.
+ * @param pool workers to run on
+ * @return New string with replaced values.
+ */
+inline std::string json_replace_parallel (std::string_view json, WorkStealingPool &pool)
+    noexcept (false)
+{
+  return json_replace_parallel_with (json, pool, suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                                     char_replacement<JSON_REPLACE_CHAR> ());
+}
+
+/**
+ * Same as json_replace_parallel (json, pool), with the keys whose values are replaced chosen
+ * by matcher.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+std::string json_replace_parallel (std::string_view json, WorkStealingPool &pool,
+                                   const KeyMatcher &matcher) noexcept (false)
+{
+  return json_replace_parallel_with (json, pool, matcher, char_replacement<Replace> ());
+}
+
+/**
+ * A growable buffer that json_replace_many writes a whole batch into, kept from one batch to
+ * the next so that it is only allocated a few times.
+ */
+class OutputBuffer
+{
+public:
+  OutputBuffer () = default;
+  OutputBuffer (const OutputBuffer &) = delete;
+  OutputBuffer &operator= (const OutputBuffer &) = delete;
+
+  const char *data () const
+  {
+    return data_.get ();
+  }
+
+  size_t size () const
+  {
+    return size_;
+  }
+
+  /**
+   * @return size of the allocation, which only grows
+   */
+  size_t capacity () const
+  {
+    return capacity_;
+  }
+
+  std::string_view view () const
+  {
+    return std::string_view (data_.get (), size_);
+  }
+
+  void clear ()
+  {
+    size_ = 0;
+  }
+
+  /**
+   * Makes room for len more bytes, at least doubling the capacity when it grows, so that
+   * slowly growing batches only allocate a few times.
+   * @return where the next byte goes, which is only added to the buffer by commit
+   */
+  char *reserve (size_t len) noexcept (false)
+  {
+    if (len > capacity_ - size_)
+    {
+      size_t capacity = std::max (size_ + len, 2 * capacity_);
+      std::unique_ptr<char[]> data (new char[capacity]);
+      if (size_ != 0)
+        memcpy (data.get (), data_.get (), size_);
+      data_ = std::move (data);
+      capacity_ = capacity;
+    }
+    return data_.get () + size_;
+  }
+
+  /**
+   * Adds the next len bytes, as written after reserve, to the buffer.
+   */
+  void commit (size_t len)
+  {
+    size_ += len;
+  }
+
+private:
+  std::unique_ptr<char[]> data_;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
+
+/**
+ * Replaces values in a whole batch of records, one after the other, into one contiguous
+ * buffer. Only out can allocate, and only when the batch is larger than any before it. No
+ * record is copied into a string, measured with strlen, or unwound from: a record that is not
+ * read as json is left out.
+ * @param records json records, which do not need to be null terminated.
+ * @param out cleared, then holds the replaced records one after the other.
+ * @param offsets has one more entry than records. Record i is written to
+ *                [offsets[i], offsets[i + 1]) in out, which is empty if it failed.
+ * @param matches called with the start and end of every key, including its quotes.
+ * @param replacement writes the replace value in place of the body of replaced strings
+ * @param errors empty, or set to where and why reading each record stopped.
+ * @param engine engine to run, replace_engine unless given
+ * @return Number of records that failed.
+ */
+template <typename Matcher, typename Replacement>
+size_t json_replace_many_with (std::span<const std::string_view> records, OutputBuffer &out,
+                               std::span<size_t> offsets, const Matcher &matches,
+                               const Replacement &replacement,
+                               std::span<ReplaceError> errors = {},
+                               json_engine engine = replace_engine) noexcept (false)
+{
+  if (offsets.size () != records.size () + 1 ||
+      (!errors.empty () && errors.size () != records.size ()))
+    throw std::length_error (JSON_REPLACE_MANY_OFFSETS_ERROR_MSG);
+  size_t total = 0;
+  for (std::string_view record : records)
+    total += max_replaced_len (record.size (), replacement);
+  out.clear ();
+  char *dest = out.reserve (total);
+  size_t failed = 0;
+  for (size_t i = 0; i < records.size (); ++i)
+  {
+    offsets[i] = out.size ();
+    ReplaceError error;
+    size_t len = json_replace_no_throw (records[i].data (), records[i].data () + records[i].size (),
+                                        dest, matches, replacement, error, no_stats (), engine);
+    if (error)
+    {
+      ++failed;
+      len = 0;
+    }
+    if (!errors.empty ())
+      errors[i] = error;
+    out.commit (len);
+    dest += len;
+  }
+  offsets[records.size ()] = out.size ();
+  return failed;
+}
+
+/**
+ * Reads through every record and writes them into out one after the other, where all keys
+ * that end with JSON_REPLACE_TARGET_SUFFIX have their corresponding values replaced with
+ * JSON_REPLACE_CHAR. See json_replace_many_with.
+ * @param records json records, which do not need to be null terminated.
+ * @param out cleared, then holds the replaced records one after the other.
+ * @param offsets has one more entry than records, and is set to where each record starts,
+ *                followed by the end of the last one.
+ * @param errors empty, or set to where and why reading each record stopped.
+ * @return Number of records that failed, and were left out.
+ */
+inline size_t json_replace_many (std::span<const std::string_view> records, OutputBuffer &out,
+                                 std::span<size_t> offsets,
+                                 std::span<ReplaceError> errors = {}) noexcept (false)
+{
+  return json_replace_many_with (records, out, offsets,
+                                 suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                                 char_replacement<JSON_REPLACE_CHAR> (), errors);
+}
+
+/**
+ * Same as json_replace_many (records, out, offsets, errors), with the keys whose values are
+ * replaced chosen by matcher, and replaced with Replace.
+ */
+template <char Replace = JSON_REPLACE_CHAR>
+size_t json_replace_many (std::span<const std::string_view> records, OutputBuffer &out,
+                          std::span<size_t> offsets, const KeyMatcher &matcher,
+                          std::span<ReplaceError> errors = {}) noexcept (false)
+{
+  return json_replace_many_with (records, out, offsets, matcher, char_replacement<Replace> (),
+                                 errors);
+}
+
+/**
+ * Replaces values the same way json_replace does, into buffers that are kept and reused from
+ * one call to the next, so that once they have grown to the largest input, replacing does not
+ * allocate at all. Meant to be kept for the life of a thread, one per thread.
+ *
+ * Ex. ReplaceContext context;
+ *     for (std::string_view record : records)
+ *       send (context.replace (record));
+ */
+class ReplaceContext
+{
+public:
+  /**
+   * Replaces the values of keys that end with JSON_REPLACE_TARGET_SUFFIX with JSON_REPLACE_CHAR,
+   * with the replace_engine of when it is made.
+   */
+  ReplaceContext () = default;
+
+  /**
+   * @param matcher chooses the keys whose values are replaced
+   * @param replace character replaced values are replaced with, which can not be a quote or a
+   *                backslash
+   * @param engine engine that every call runs, whatever replace_engine is set to later
+   */
+  explicit ReplaceContext (KeyMatcher matcher, char replace = JSON_REPLACE_CHAR,
+                           json_engine engine = replace_engine)
+      : matcher_ (std::move (matcher)), replace_ (replace), engine_ (engine)
+  {
+  }
+
+  ReplaceContext (const ReplaceContext &) = delete;
+  ReplaceContext &operator= (const ReplaceContext &) = delete;
+
+  /**
+   * Reads through the json and creates a copy of it in the arena of the context, where all
+   * matching keys have their corresponding values replaced.
+   * @param str string to read from, which does not need to be null terminated.
+   * @return The copy, which stays valid until the next call on this context.
+   */
+  std::string_view replace (std::string_view str) noexcept (false)
+  {
+    ReplaceError error;
+    std::string_view replaced = replace (str, error);
+    if (error)
+      detail::throw_replace_error (error);
+    return replaced;
+  }
+
+  /**
+   * Same as replace (str), but returns failure through error instead of throwing it. Only
+   * growing the arena can throw.
+   * @param error set to where and why reading stopped, or to json_error::none
+   * @return The copy, which is only complete without an error.
+   */
+  std::string_view replace (std::string_view str, ReplaceError &error) noexcept (false)
+  {
+    char *dest = reserve (str.size ());
+    size_t len;
+    if (matcher_)
+      len = json_replace_checked_with (str.data (), str.size (), dest, str.size (), *matcher_,
+                                       runtime_char_replacement {replace_}, error, no_stats (),
+                                       engine_);
+    else
+      len = json_replace_checked_with (str.data (), str.size (), dest, str.size (),
+                                       suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                                       char_replacement<JSON_REPLACE_CHAR> (), error,
+                                       no_stats (), engine_);
+    return std::string_view (dest, len);
+  }
+
+  /**
+   * Same as replace, over newline delimited json split between the workers of pool, the same
+   * way json_replace_batch does. The chunks and arenas of the workers are kept as well.
+   * @param ndjson records separated by '\n', none of which contains a raw newline.
+   * @param pool workers to run on
+   * @return The copy, which stays valid until the next call on this context.
+   */
+  std::string_view replace_batch (std::string_view ndjson, WorkStealingPool &pool)
+      noexcept (false)
+  {
+    char *dest = reserve (ndjson.size ());
+    size_t len;
+    if (matcher_)
+      len = json_replace_batch_into_with (ndjson, pool, dest, *matcher_,
+                                          runtime_char_replacement {replace_}, batch_, engine_);
+    else
+      len = json_replace_batch_into_with (ndjson, pool, dest,
+                                          suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                                          char_replacement<JSON_REPLACE_CHAR> (), batch_,
+                                          engine_);
+    return std::string_view (dest, len);
+  }
+
+  /**
+   * @return size of the arena, which only grows
+   */
+  size_t capacity () const
+  {
+    return capacity_;
+  }
+
+private:
+  /**
+   * Grows the arena to at least len bytes, at least doubling it so that slowly growing inputs
+   * only allocate a few times.
+   */
+  char *reserve (size_t len)
+  {
+    if (len > capacity_)
+    {
+      capacity_ = std::max (len, 2 * capacity_);
+      arena_.reset (new char[capacity_]);
+    }
+    return arena_.get ();
+  }
+
+  std::optional<KeyMatcher> matcher_;
+  char replace_ = JSON_REPLACE_CHAR;
+  json_engine engine_ = replace_engine;
+  std::unique_ptr<char[]> arena_;
+  size_t capacity_ = 0;
+  json_batch_buffers batch_;
+};
+
+/**
+ * Replaces values the same way json_replace does, over input that arrives in chunks of any
+ * size. Each chunk is handed to feed, and the output is passed to the sink in pieces as soon
+ * as it is known, so memory use does not grow with the input. Only the key being read is kept
+ * whole, since it has to be matched before it can be written, and the nesting of the json is
+ * kept in a fixed array.
+ *
+ * Ex. JsonReplaceStream stream ([] (const char *data, size_t len) { fwrite (data, 1, len, out); });
+ *     while ((len = fread (buf, 1, sizeof (buf), in)) > 0)
+ *       stream.feed (buf, len);
+ *     stream.finish ();
+ */
+class JsonReplaceStream
+{
+public:
+  using Sink = std::function<void (const char *data, size_t len)>;
+
+  /**
+   * Replaces the values of keys that end with JSON_REPLACE_TARGET_SUFFIX with JSON_REPLACE_CHAR.
+   * @param sink called with every piece of output, in order
+   */
+  explicit JsonReplaceStream (Sink sink)
+      : JsonReplaceStream (std::move (sink), suffix_matcher<JSON_REPLACE_TARGET_SUFFIX> (),
+                           JSON_REPLACE_CHAR)
+  {
+  }
+
+  /**
+   * Replaces the values of keys accepted by matcher with replace.
+   * @param sink called with every piece of output, in order
+   * @param matcher patterns of the keys whose values are replaced
+   * @param replace character replaced values are replaced with
+   */
+  JsonReplaceStream (Sink sink, KeyMatcher matcher, char replace = JSON_REPLACE_CHAR)
+      : JsonReplaceStream (std::move (sink),
+                           [matcher = std::move (matcher)] (const char *key, const char *key_end)
+                           { return matcher (key, key_end); },
+                           replace)
+  {
+  }
+
+  /**
+   * Reads the next chunk of the json, and writes all output it completes to the sink.
+   * After an exception was thrown, the stream can not be used anymore.
+   * @param data next chunk of the json
+   * @param len length of data
+   */
+  void feed (const char *data, size_t len) noexcept (false)
+  {
+    const char *end = data + len;
+    while (data != end)
+      data = step (data, end);
+    flush ();
+  }
+
+  /**
+   * Same as feed (data.data (), data.size ()).
+   */
+  void feed (std::string_view data) noexcept (false)
+  {
+    feed (data.data (), data.size ());
+  }
+
+  /**
+   * Marks the end of the json and writes everything that is left to the sink.
+   * Afterwards the stream starts over, and can be fed the next json.
+   * Throws std::invalid_argument if the json ended in the middle of a key or value.
+   */
+  void finish () noexcept (false)
+  {
+    flush ();
+    if (state_ != state::between || !grammar_.complete ())
+      throw std::invalid_argument (JSON_REPLACE_END_ERROR_MSG);
+  }
+
+private:
+  /**
+   * Where the stream is inside of a string, between two chunks.
+   */
+  enum class state : uint8_t
+  {
+    between,       // not inside any string
+    key,           // inside a key
+    key_escape,    // right after a '\\' inside a key
+    string_start,  // right after the opening quote of a value that is replaced
+    string,        // inside a value
+    string_escape, // right after a '\\' inside a value
+  };
+
+  static constexpr size_t buffer_size = 1 << 16;
+
+  template <typename Matcher>
+  JsonReplaceStream (Sink sink, Matcher matcher, char replace)
+      : sink_ (std::move (sink)), matches_ (std::move (matcher)), replace_char_ (replace)
+  {
+    buffer_.reserve (buffer_size);
+  }
+
+  void emit (const char *data, size_t len)
+  {
+    if (buffer_.size () + len > buffer_size)
+    {
+      flush ();
+      if (len >= buffer_size)
+      {
+        sink_ (data, len);
+        return;
+      }
+    }
+    buffer_.insert (buffer_.end (), data, data + len);
+  }
+
+  void emit (char c)
+  {
+    if (buffer_.size () == buffer_size)
+      flush ();
+    buffer_.push_back (c);
+  }
+
+  void flush ()
+  {
+    if (!buffer_.empty ())
+      sink_ (buffer_.data (), buffer_.size ());
+    buffer_.clear ();
+  }
+
+  /**
+   * Reads from src until the end of the current state or of the chunk.
+   * @return where reading stopped
+   */
+  const char *step (const char *src, const char *end)
+  {
+    switch (state_)
+    {
+      case state::between:
+      {
+        const char *stop = src;
+        for (; stop != end && *stop != '"'; ++stop)
+          if (grammar_.read_classified_byte (*stop) != json_error::none)
+            throw std::invalid_argument (JSON_REPLACE_NESTING_ERROR_MSG);
+        emit (src, stop - src);
+        if (stop == end)
+          return end;
+        if (grammar_.at_key ())
+        {
+          key_.assign (1, '"');
+          state_ = state::key;
+          return stop + 1;
+        }
+        emit ('"');
+        replace_ = grammar_.replaces_value ();
+        state_ = replace_ ? state::string_start : state::string;
+        return stop + 1;
+      }
+
+      case state::key:
+      {
+        const char *stop = string_kernel->scan (src, end);
+        key_.append (src, stop);
+        if (stop == end)
+          return end;
+        key_.push_back (*stop);
+        if (*stop == '\\')
+        {
+          state_ = state::key_escape;
+          return stop + 1;
+        }
+        grammar_.read_key (matches_ (key_.data (), key_.data () + key_.size ()));
+        emit (key_.data (), key_.size ());
+        state_ = state::between;
+        return stop + 1;
+      }
+
+      case state::key_escape:
+        key_.push_back (*src);
+        state_ = state::key;
+        return src + 1;
+
+      case state::string_start:
+        if (*src == '"')
+        {
+          // will not replace an empty string
+          end_string ();
+          return src + 1;
+        }
+        emit (replace_char_);
+        state_ = state::string;
+        return src;
+
+      case state::string:
+      {
+        const char *stop = string_kernel->scan (src, end);
+        if (!replace_)
+          emit (src, stop - src);
+        if (stop == end)
+          return end;
+        if (*stop == '\\')
+        {
+          if (!replace_)
+            emit (*stop);
+          state_ = state::string_escape;
+        }
+        else
+          end_string ();
+        return stop + 1;
+      }
+
+      case state::string_escape:
+        if (!replace_)
+          emit (*src);
+        state_ = state::string;
+        return src + 1;
+    }
+    return end;
+  }
+
+  void end_string ()
+  {
+    emit ('"');
+    grammar_.read_value ();
+    state_ = state::between;
+  }
+
+  Sink sink_;
+  std::function<bool (const char *key, const char *key_end)> matches_;
+  char replace_char_;
+  state state_ = state::between;
+  json_grammar grammar_;
+  bool replace_ = false;
+  std::string key_;
+  std::vector<char> buffer_;
+};
+
+#if defined(JSON_REPLACE_COROUTINES)
+
+/**
+ * A coroutine that yields pieces of output, as made by json_replace_pieces, and can be read
+ * with a range for loop. It only runs while the next piece is asked for, on the thread that
+ * asks. Every piece stays valid until the next one is asked for, and an exception thrown while
+ * making a piece is thrown from there, after every piece before it was yielded.
+ */
+class JsonReplaceGenerator
+{
+public:
+  struct promise_type
+  {
+    std::string_view piece;
+    std::exception_ptr error;
+
+    JsonReplaceGenerator get_return_object ()
+    {
+      return JsonReplaceGenerator (std::coroutine_handle<promise_type>::from_promise (*this));
+    }
+
+    std::suspend_always initial_suspend () noexcept
+    {
+      return {};
+    }
+
+    std::suspend_always final_suspend () noexcept
+    {
+      return {};
+    }
+
+    std::suspend_always yield_value (std::string_view next) noexcept
+    {
+      piece = next;
+      return {};
+    }
+
+    void return_void () {}
+
+    void unhandled_exception ()
+    {
+      error = std::current_exception ();
+    }
+  };
+
+  class iterator
+  {
+  public:
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+
+    explicit iterator (std::coroutine_handle<promise_type> coroutine) : coroutine_ (coroutine)
+    {
+    }
+
+    std::string_view operator* () const
+    {
+      return coroutine_.promise ().piece;
+    }
+
+    iterator &operator++ () noexcept (false)
+    {
+      resume (coroutine_);
+      return *this;
+    }
+
+    void operator++ (int) noexcept (false)
+    {
+      ++*this;
+    }
+
+    bool operator== (std::default_sentinel_t) const
+    {
+      return coroutine_.done ();
+    }
+
+  private:
+    std::coroutine_handle<promise_type> coroutine_;
+  };
+
+  JsonReplaceGenerator (JsonReplaceGenerator &&other) noexcept
+      : coroutine_ (std::exchange (other.coroutine_, nullptr))
+  {
+  }
+
+  JsonReplaceGenerator &operator= (JsonReplaceGenerator other) noexcept
+  {
+    std::swap (coroutine_, other.coroutine_);
+    return *this;
+  }
+
+  ~JsonReplaceGenerator ()
+  {
+    if (coroutine_)
+      coroutine_.destroy ();
+  }
+
+  /**
+   * Runs the coroutine up to its first piece, which can only be done once.
+   */
+  iterator begin () noexcept (false)
+  {
+    resume (coroutine_);
+    return iterator (coroutine_);
+  }
+
+  std::default_sentinel_t end () const
+  {
+    return std::default_sentinel;
+  }
+
+private:
+  explicit JsonReplaceGenerator (std::coroutine_handle<promise_type> coroutine)
+      : coroutine_ (coroutine)
+  {
+  }
+
+  /**
+   * Runs the coroutine up to its next piece, and throws what it threw instead, if anything.
+   */
+  static void resume (std::coroutine_handle<promise_type> coroutine) noexcept (false)
+  {
+    coroutine.resume ();
+    if (coroutine.promise ().error)
+      std::rethrow_exception (std::exchange (coroutine.promise ().error, nullptr));
+  }
+
+  std::coroutine_handle<promise_type> coroutine_;
+};
+
+/**
+ * Replaces the values of keys accepted by matcher with replace, through a JsonReplaceStream
+ * that is fed piece_size bytes at a time, and yields the output every time at least
+ * piece_size bytes of it are ready, and once more at the end. A large json can so be sent on
+ * as it is replaced, and whoever reads the pieces gets to run between every two of them.
+ * Ex. for (std::string_view piece : json_replace_pieces (json, KeyMatcher ({"_X"}), 1 << 14))
+ *       co_await socket.write (piece);
+ * @param json string to read from, which has to outlive the generator.
+ * @param matcher patterns of the keys whose values are replaced
+ * @param piece_size least number of bytes in every piece but the last one
+ * @param replace character replaced values are replaced with
+ * @return The pieces of the output, which are never empty. Throws std::invalid_argument from
+ *         where the piece is asked for if json ends in the middle of a key or value.
+ */
+inline JsonReplaceGenerator json_replace_pieces (std::string_view json, KeyMatcher matcher,
+                                                 size_t piece_size = JSON_REPLACE_PIECE_SIZE,
+                                                 char replace = JSON_REPLACE_CHAR)
+{
+  std::string piece;
+  piece.reserve (piece_size);
+  JsonReplaceStream stream ([&piece] (const char *data, size_t len) { piece.append (data, len); },
+                            std::move (matcher), replace);
+  for (size_t fed = 0; fed < json.size ();)
+  {
+    size_t len = std::min (std::max<size_t> (piece_size, 1), json.size () - fed);
+    stream.feed (json.data () + fed, len);
+    fed += len;
+    if (piece.size () >= piece_size && !piece.empty ())
+    {
+      co_yield std::string_view (piece);
+      piece.clear ();
+    }
+  }
+  stream.finish ();
+  if (!piece.empty ())
+    co_yield std::string_view (piece);
+}
+
+/**
+ * Same as json_replace_pieces (json, matcher, piece_size), for the keys that end with
+ * JSON_REPLACE_TARGET_SUFFIX, whose values are replaced with JSON_REPLACE_CHAR.
+ */
+inline JsonReplaceGenerator json_replace_pieces (std::string_view json,
+                                                 size_t piece_size = JSON_REPLACE_PIECE_SIZE)
+{
+  return json_replace_pieces (json, KeyMatcher ({JSON_REPLACE_TARGET_SUFFIX}), piece_size);
+}
+
+#endif
+
+/**
+ * How a json is compressed, as told by detect_json_codec from its first bytes.
+ */
+enum class json_codec : uint8_t
+{
+  plain,
+  gzip,
+  zstd,
+};
+
+/**
+ * @param data first bytes of the input, of which 4 are enough to tell
+ * @return the codec whose magic number data starts with, or json_codec::plain
+ */
+inline json_codec detect_json_codec (const char *data, size_t len)
+{
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *> (data);
+  if (len >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b)
+    return json_codec::gzip;
+  if (len >= 4 && bytes[0] == 0x28 && bytes[1] == 0xb5 && bytes[2] == 0x2f && bytes[3] == 0xfd)
+    return json_codec::zstd;
+  return json_codec::plain;
+}
+
+/**
+ * @return whether json_replace was built with codec, which for gzip needs JSON_REPLACE_ZLIB
+ *         and for zstd needs JSON_REPLACE_ZSTD
+ */
+constexpr bool json_codec_available (json_codec codec)
+{
+  switch (codec)
+  {
+    case json_codec::gzip:
+#if defined(JSON_REPLACE_ZLIB)
+      return true;
+#else
+      return false;
+#endif
+    case json_codec::zstd:
+#if defined(JSON_REPLACE_ZSTD)
+      return true;
+#else
+      return false;
+#endif
+    default:
+      return true;
+  }
+}
+
+/**
+ * Decompresses gzip or zstd input as it arrives, and feeds it to a JsonReplaceStream one
+ * block at a time, so that the plain json is only ever held one cache sized block at a time.
+ * The stream reads every block whole before the next one is decompressed, so a single block,
+ * written over again, is the whole ring. Concatenated gzip members and zstd frames are read
+ * one after the other, and input that is not compressed is fed to the stream as it is.
+ *
+ * Ex. JsonReplaceStream stream (sink);
+ *     JsonDecompressStream decompress (stream);
+ *     while ((len = fread (buf, 1, sizeof (buf), in)) > 0)
+ *       decompress.feed (buf, len);
+ *     decompress.finish ();
+ */
+class JsonDecompressStream
+{
+public:
+  /**
+   * @param stream fed with the plain json
+   * @param block_size size of the block that is decompressed into
+   */
+  explicit JsonDecompressStream (JsonReplaceStream &stream, size_t block_size = 1 << 17)
+      : stream_ (stream), block_ (block_size)
+  {
+  }
+
+  ~JsonDecompressStream ()
+  {
+#if defined(JSON_REPLACE_ZLIB)
+    if (codec_ == json_codec::gzip)
+      inflateEnd (&zlib_);
+#endif
+#if defined(JSON_REPLACE_ZSTD)
+    ZSTD_freeDCtx (zstd_);
+#endif
+  }
+
+  JsonDecompressStream (const JsonDecompressStream &) = delete;
+  JsonDecompressStream &operator= (const JsonDecompressStream &) = delete;
+
+  /**
+   * Decompresses the next chunk of the input, and feeds all of its output to the stream.
+   * Throws std::invalid_argument if the input is not valid, or is compressed with a codec
+   * that json_replace was built without.
+   */
+  void feed (const char *data, size_t len) noexcept (false)
+  {
+    if (!detected_)
+    {
+      // the magic number can be split between chunks
+      size_t taken = std::min<size_t> (len, 4 - magic_.size ());
+      magic_.append (data, taken);
+      if (magic_.size () < 4)
+        return;
+      detect ();
+      decompress (magic_.data (), magic_.size ());
+      data += taken;
+      len -= taken;
+    }
+    decompress (data, len);
+  }
+
+  /**
+   * Marks the end of the input, and finishes the stream.
+   * Throws std::invalid_argument if the input ends in the middle of a gzip member or a zstd
+   * frame, and whatever JsonReplaceStream::finish throws.
+   */
+  void finish () noexcept (false)
+  {
+    if (!detected_)
+    {
+      detect ();
+      decompress (magic_.data (), magic_.size ());
+    }
+    if (!complete_)
+      throw std::invalid_argument (JSON_REPLACE_DECOMPRESS_ERROR_MSG);
+    stream_.finish ();
+  }
+
+private:
+  void detect () noexcept (false)
+  {
+    detected_ = true;
+    codec_ = detect_json_codec (magic_.data (), magic_.size ());
+    if (!json_codec_available (codec_))
+      throw std::invalid_argument (JSON_REPLACE_CODEC_SUPPORT_ERROR_MSG);
+#if defined(JSON_REPLACE_ZLIB)
+    // 32 more window bits reads both gzip and zlib headers
+    if (codec_ == json_codec::gzip && inflateInit2 (&zlib_, 15 + 32) != Z_OK)
+      throw std::bad_alloc ();
+#endif
+#if defined(JSON_REPLACE_ZSTD)
+    if (codec_ == json_codec::zstd && (zstd_ = ZSTD_createDCtx ()) == nullptr)
+      throw std::bad_alloc ();
+#endif
+  }
+
+  void decompress (const char *data, size_t len) noexcept (false)
+  {
+    if (len == 0)
+      return;
+    switch (codec_)
+    {
+      case json_codec::plain:
+        stream_.feed (data, len);
+        break;
+      case json_codec::gzip:
+#if defined(JSON_REPLACE_ZLIB)
+        inflate_gzip (data, len);
+#endif
+        break;
+      case json_codec::zstd:
+#if defined(JSON_REPLACE_ZSTD)
+        decompress_zstd (data, len);
+#endif
+        break;
+    }
+  }
+
+#if defined(JSON_REPLACE_ZLIB)
+  void inflate_gzip (const char *data, size_t len) noexcept (false)
+  {
+    zlib_.next_in = reinterpret_cast<Bytef *> (const_cast<char *> (data));
+    zlib_.avail_in = static_cast<uInt> (len);
+    while (zlib_.avail_in > 0)
+    {
+      // another member starts after the end of the last one
+      if (complete_ && inflateReset (&zlib_) != Z_OK)
+        throw std::invalid_argument (JSON_REPLACE_DECOMPRESS_ERROR_MSG);
+      complete_ = false;
+      do
+      {
+        zlib_.next_out = reinterpret_cast<Bytef *> (block_.data ());
+        zlib_.avail_out = static_cast<uInt> (block_.size ());
+        int result = inflate (&zlib_, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+          throw std::invalid_argument (JSON_REPLACE_DECOMPRESS_ERROR_MSG);
+        stream_.feed (block_.data (), block_.size () - zlib_.avail_out);
+        complete_ = result == Z_STREAM_END;
+      } while (zlib_.avail_out == 0 && !complete_);
+    }
+  }
+#endif
+
+#if defined(JSON_REPLACE_ZSTD)
+  void decompress_zstd (const char *data, size_t len) noexcept (false)
+  {
+    ZSTD_inBuffer in = {data, len, 0};
+    bool flushed = false;
+    while (in.pos < in.size || !flushed)
+    {
+      ZSTD_outBuffer out = {block_.data (), block_.size (), 0};
+      size_t consumed = in.pos;
+      size_t result = ZSTD_decompressStream (zstd_, &out, &in);
+      if (ZSTD_isError (result))
+        throw std::invalid_argument (JSON_REPLACE_DECOMPRESS_ERROR_MSG);
+      stream_.feed (block_.data (), out.pos);
+      // 0 once a frame is decoded and flushed, while a call that does nothing after the end of
+      // a frame already asks for the next one
+      if (in.pos != consumed || out.pos != 0)
+        complete_ = result == 0;
+      flushed = out.pos < out.size;
+    }
+  }
+#endif
+
+  JsonReplaceStream &stream_;
+  std::vector<char> block_;
+  std::string magic_; // the first bytes, until the codec is known
+  bool detected_ = false;
+  bool complete_ = true; // at the end of a gzip member or a zstd frame
+  json_codec codec_ = json_codec::plain;
+#if defined(JSON_REPLACE_ZLIB)
+  z_stream zlib_ {};
+#endif
+#if defined(JSON_REPLACE_ZSTD)
+  ZSTD_DCtx *zstd_ = nullptr;
+#endif
+};
+
+/**
+ * Compresses output with gzip or zstd, and passes it to a sink one block at a time, such as
+ * the sink of a JsonReplaceStream, so that a compressed input can be replaced into a
+ * compressed output without the plain json being held whole.
+ *
+ * Ex. JsonCompressSink compress (json_codec::zstd, sink);
+ *     JsonReplaceStream stream ([&compress] (const char *data, size_t len)
+ *                               { compress.write (data, len); });
+ */
+class JsonCompressSink
+{
+public:
+  using Sink = std::function<void (const char *data, size_t len)>;
+
+  /**
+   * Throws std::invalid_argument for a codec that json_replace was built without.
+   * @param codec to compress with, where json_codec::plain passes the output on as it is
+   * @param sink called with every block of compressed output, in order
+   * @param level compression level, or 0 for the default of the codec
+   * @param block_size size of the block that is compressed into
+   */
+  JsonCompressSink (json_codec codec, Sink sink, int level = 0,
+                    size_t block_size = 1 << 17) noexcept (false)
+      : codec_ (codec), sink_ (std::move (sink)), block_ (block_size)
+  {
+    if (!json_codec_available (codec_))
+      throw std::invalid_argument (JSON_REPLACE_CODEC_SUPPORT_ERROR_MSG);
+#if defined(JSON_REPLACE_ZLIB)
+    // 16 more window bits writes a gzip header instead of a zlib one
+    if (codec_ == json_codec::gzip &&
+        deflateInit2 (&zlib_, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                      Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::bad_alloc ();
+#endif
+#if defined(JSON_REPLACE_ZSTD)
+    if (codec_ == json_codec::zstd)
+    {
+      if ((zstd_ = ZSTD_createCCtx ()) == nullptr)
+        throw std::bad_alloc ();
+      if (level)
+        ZSTD_CCtx_setParameter (zstd_, ZSTD_c_compressionLevel, level);
+    }
+#endif
+    (void) level;
+  }
+
+  ~JsonCompressSink ()
+  {
+#if defined(JSON_REPLACE_ZLIB)
+    if (codec_ == json_codec::gzip)
+      deflateEnd (&zlib_);
+#endif
+#if defined(JSON_REPLACE_ZSTD)
+    ZSTD_freeCCtx (zstd_);
+#endif
+  }
+
+  JsonCompressSink (const JsonCompressSink &) = delete;
+  JsonCompressSink &operator= (const JsonCompressSink &) = delete;
+
+  /**
+   * Compresses the next piece of output, and passes every block that fills up to the sink.
+   */
+  void write (const char *data, size_t len) noexcept (false)
+  {
+    compress (data, len, false);
+  }
+
+  /**
+   * Compresses everything that is left, and ends the compressed output.
+   */
+  void finish () noexcept (false)
+  {
+    compress (nullptr, 0, true);
+  }
+
+private:
+  void compress (const char *data, size_t len, bool end) noexcept (false)
+  {
+    switch (codec_)
+    {
+      case json_codec::plain:
+        (void) end;
+        if (len != 0)
+          sink_ (data, len);
+        break;
+      case json_codec::gzip:
+#if defined(JSON_REPLACE_ZLIB)
+      {
+        zlib_.next_in = reinterpret_cast<Bytef *> (const_cast<char *> (data));
+        zlib_.avail_in = static_cast<uInt> (len);
+        int result;
+        do
+        {
+          zlib_.next_out = reinterpret_cast<Bytef *> (block_.data ());
+          zlib_.avail_out = static_cast<uInt> (block_.size ());
+          result = deflate (&zlib_, end ? Z_FINISH : Z_NO_FLUSH);
+          if (result == Z_STREAM_ERROR)
+            throw std::runtime_error (JSON_REPLACE_COMPRESS_ERROR_MSG);
+          if (zlib_.avail_out != block_.size ())
+            sink_ (block_.data (), block_.size () - zlib_.avail_out);
+        } while (zlib_.avail_out == 0 || (end && result != Z_STREAM_END));
+      }
+#endif
+        break;
+      case json_codec::zstd:
+#if defined(JSON_REPLACE_ZSTD)
+      {
+        ZSTD_inBuffer in = {data, len, 0};
+        size_t left;
+        do
+        {
+          ZSTD_outBuffer out = {block_.data (), block_.size (), 0};
+          left = ZSTD_compressStream2 (zstd_, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+          if (ZSTD_isError (left))
+            throw std::runtime_error (JSON_REPLACE_COMPRESS_ERROR_MSG);
+          if (out.pos != 0)
+            sink_ (block_.data (), out.pos);
+        } while (in.pos < in.size || (end && left != 0));
+      }
+#endif
+        break;
+    }
+  }
+
+  json_codec codec_;
+  Sink sink_;
+  std::vector<char> block_;
+#if defined(JSON_REPLACE_ZLIB)
+  z_stream zlib_ {};
+#endif
+#if defined(JSON_REPLACE_ZSTD)
+  ZSTD_CCtx *zstd_ = nullptr;
+#endif
+};
+
+namespace detail
+{
+
+/**
+ * Throws the error of the last failed system call.
+ */
+[[noreturn]] inline void throw_system_error (const std::string &what) noexcept (false)
+{
+  throw std::system_error (errno, std::generic_category (), what);
+}
+
+inline void write_all (int fd, const char *data, size_t len) noexcept (false)
+{
+  while (len > 0)
+  {
+    ssize_t written = write (fd, data, len);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      throw_system_error ("write");
+    }
+    data += written;
+    len -= written;
+  }
+}
+
+} // namespace detail
+
+/**
+ * Moves json from one file descriptor to another through JsonReplaceStream, overlapping the
+ * reads and writes with the replacing, for input such as a pipe or a socket that can not be
+ * mapped. depth read buffers are kept in flight on io_uring, in buffers registered with the
+ * kernel when the locked memory limit allows it. Every buffer that completes is replaced while
+ * the next ones are read, and the output is submitted as a chain of linked writes, so it stays
+ * in order without waiting on any of them.
+ * Seekable input is read at explicit offsets, all at once. Reads of a pipe or a socket are
+ * linked instead, which keeps them in order. A short read ends such a chain, so those reads
+ * mostly complete one or a few at a time.
+ * Where io_uring is missing, or can not be set up, the same buffers are moved with
+ * nonblocking reads and writes, waiting on epoll only for the side that can not move. This
+ * sets O_NONBLOCK on in_fd and out_fd until the pipeline is destroyed, which every process
+ * that shares their file description, such as a shell sharing stdin, sees meanwhile, and
+ * keeps seeing if the process dies before the flags are restored.
+ *
+ * Ex. JsonReplacePipeline pipeline (STDIN_FILENO, STDOUT_FILENO, KeyMatcher ({"_X"}, {}));
+ *     pipeline.run ();
+ */
+class JsonReplacePipeline
+{
+public:
+  /**
+   * @param in_fd read from until its end
+   * @param out_fd written to, from its current position
+   * @param matcher patterns of the keys whose values are replaced
+   * @param replace character replaced values are replaced with
+   * @param depth number of read buffers, and of write buffers
+   * @param buffer_size size of every buffer
+   * @param use_io_uring false to run on epoll even where io_uring is there
+   */
+  JsonReplacePipeline (int in_fd, int out_fd, KeyMatcher matcher, char replace = JSON_REPLACE_CHAR,
+                       size_t depth = 4, size_t buffer_size = 1 << 20,
+                       bool use_io_uring = true) noexcept (false)
+      : in_fd_ (in_fd), out_fd_ (out_fd), buffer_size_ (buffer_size),
+        memory_ (new char[2 * depth * buffer_size]), reads_ (depth), writes_ (depth),
+        stream_ ([this] (const char *data, size_t len) { output (data, len); },
+                 std::move (matcher), replace)
+  {
+    for (size_t i = 0; i < depth; ++i)
+    {
+      reads_[i].data = memory_.get () + i * buffer_size;
+      writes_[i].data = memory_.get () + (depth + i) * buffer_size;
+      free_reads_.push_back (i);
+      free_writes_.push_back (i);
+    }
+    off_t offset = lseek (in_fd_, 0, SEEK_CUR);
+    seekable_ = offset >= 0;
+    read_offset_ = seekable_ ? offset : 0;
+#if defined(JSON_REPLACE_IO_URING)
+    if (use_io_uring)
+      setup_ring (4 * depth);
+#else
+    (void) use_io_uring;
+#endif
+  }
+
+  ~JsonReplacePipeline ()
+  {
+#if defined(JSON_REPLACE_IO_URING)
+    if (ring_fd_ >= 0)
+      close_ring ();
+#endif
+    for (const saved_flags &saved : saved_flags_)
+      fcntl (saved.fd, F_SETFL, saved.flags);
+#if defined(JSON_REPLACE_EPOLL)
+    if (epoll_fd_ >= 0)
+      close (epoll_fd_);
+#endif
+  }
+
+  JsonReplacePipeline (const JsonReplacePipeline &) = delete;
+  JsonReplacePipeline &operator= (const JsonReplacePipeline &) = delete;
+
+  /**
+   * Reads in_fd to its end, and returns once all of the output is written to out_fd.
+   * Throws std::system_error if a read or a write fails, and std::invalid_argument as
+   * JsonReplaceStream does. After an exception was thrown, the pipeline can not be used
+   * anymore.
+   */
+  void run () noexcept (false)
+  {
+#if defined(JSON_REPLACE_IO_URING)
+    if (ring_fd_ >= 0)
+    {
+      run_ring ();
+      return;
+    }
+#endif
+    run_polled ();
+  }
+
+  /**
+   * @return whether the pipeline runs on io_uring, and not on epoll
+   */
+  bool uses_io_uring () const
+  {
+    return ring_fd_ >= 0;
+  }
+
+private:
+  struct buffer
+  {
+    char *data = nullptr;
+    size_t begin = 0; // of what is left to write
+    size_t end = 0; // of what was read, or is to be written
+    uint64_t offset = 0; // where a seekable read starts
+    bool in_flight = false;
+    bool cancelled = false; // cut off with the rest of its chain, so nothing was read
+    bool at_end = false; // read the end of the input
+  };
+
+  struct saved_flags
+  {
+    int fd;
+    int flags;
+  };
+
+  static constexpr size_t none = SIZE_MAX;
+
+  /**
+   * Copies output of the stream into the write buffers, and hands full ones to the kernel.
+   * Waits for a write to complete only once all buffers are full.
+   */
+  void output (const char *data, size_t len) noexcept (false)
+  {
+    while (len > 0)
+    {
+      if (filling_ == none)
+      {
+        while (free_writes_.empty ())
+          wait_for_writes ();
+        filling_ = free_writes_.back ();
+        free_writes_.pop_back ();
+      }
+      buffer &b = writes_[filling_];
+      size_t n = std::min (len, buffer_size_ - b.end);
+      memcpy (b.data + b.end, data, n);
+      b.end += n;
+      data += n;
+      len -= n;
+      if (b.end == buffer_size_)
+        queue_filling ();
+    }
+  }
+
+  void queue_filling () noexcept (false)
+  {
+    if (filling_ == none || writes_[filling_].end == 0)
+      return;
+    write_order_.push_back (filling_);
+    filling_ = none;
+    start_writes ();
+  }
+
+  /**
+   * Frees the buffers at the front of write_order_ that are completely written.
+   */
+  void retire_writes ()
+  {
+    while (!write_order_.empty ())
+    {
+      buffer &b = writes_[write_order_.front ()];
+      if (b.in_flight || b.begin != b.end)
+        return;
+      b.begin = b.end = 0;
+      free_writes_.push_back (write_order_.front ());
+      write_order_.pop_front ();
+    }
+  }
+
+  void start_writes () noexcept (false)
+  {
+#if defined(JSON_REPLACE_IO_URING)
+    if (ring_fd_ >= 0)
+    {
+      submit_writes ();
+      return;
+    }
+#endif
+    write_ready ();
+  }
+
+  void wait_for_writes () noexcept (false)
+  {
+#if defined(JSON_REPLACE_IO_URING)
+    if (ring_fd_ >= 0)
+    {
+      submit_writes ();
+      if (!free_writes_.empty ())
+        return;
+      wait_for_completions ();
+      retire_writes ();
+      return;
+    }
+#endif
+    if (!write_ready ())
+      wait_polled (false, true);
+  }
+
+  /**
+   * Writes from the front of write_order_ until out_fd_ would block.
+   * @return whether all of write_order_ was written
+   */
+  bool write_ready () noexcept (false)
+  {
+    while (!write_order_.empty ())
+    {
+      buffer &b = writes_[write_order_.front ()];
+      ssize_t written = write (out_fd_, b.data + b.begin, b.end - b.begin);
+      if (written < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return false;
+        detail::throw_system_error ("write");
+      }
+      b.begin += written;
+      retire_writes ();
+    }
+    return true;
+  }
+
+  /**
+   * Starts a nonblocking read and write loop, which waits on epoll when neither can move.
+   * Regular files, which epoll does not take, are always ready, and are read and written
+   * with blocking calls.
+   */
+  void run_polled () noexcept (false)
+  {
+    in_waits_ = make_nonblocking (in_fd_);
+    // a socket read and written through one descriptor is only added once
+    out_waits_ = out_fd_ == in_fd_ ? in_waits_ : make_nonblocking (out_fd_);
+    buffer &b = reads_[0];
+    while (true)
+    {
+      ssize_t len = read (in_fd_, b.data, buffer_size_);
+      if (len > 0)
+      {
+        stream_.feed (b.data, len);
+        write_ready ();
+        continue;
+      }
+      if (len == 0)
+        break;
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        detail::throw_system_error ("read");
+      wait_polled (true, !write_ready ());
+    }
+#if defined(JSON_REPLACE_EPOLL)
+    // the input that ended is not waited for anymore, which its hangup would otherwise wake
+    if (in_waits_ && in_fd_ != out_fd_)
+      watch (in_fd_, 0);
+#endif
+    in_waits_ = false;
+    stream_.finish ();
+    queue_filling ();
+    while (!write_ready ())
+      wait_polled (false, true);
+  }
+
+  /**
+   * Sets O_NONBLOCK on fd, until the pipeline is destroyed, if epoll can wait for it.
+   * @return whether epoll can wait for fd, which it can not if it is always ready
+   */
+  bool make_nonblocking (int fd) noexcept (false)
+  {
+#if defined(JSON_REPLACE_EPOLL)
+    if (epoll_fd_ < 0 && (epoll_fd_ = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+      detail::throw_system_error ("epoll_create1");
+    // added and removed again, only to tell whether epoll takes fd
+    epoll_event event {};
+    event.data.fd = fd;
+    if (epoll_ctl (epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+      if (errno == EPERM)
+        return false;
+      detail::throw_system_error ("epoll_ctl");
+    }
+    if (epoll_ctl (epoll_fd_, EPOLL_CTL_DEL, fd, &event) < 0)
+      detail::throw_system_error ("epoll_ctl");
+    int flags = fcntl (fd, F_GETFL);
+    if (flags < 0 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) < 0)
+      detail::throw_system_error ("fcntl");
+    saved_flags_.push_back ({fd, flags});
+    return true;
+#else
+    (void) fd;
+    return false;
+#endif
+  }
+
+  /**
+   * Waits until in_fd_ can be read, if in, or out_fd_ can be written, if out.
+   */
+  void wait_polled (bool in, bool out) noexcept (false)
+  {
+#if defined(JSON_REPLACE_EPOLL)
+    in = in && in_waits_;
+    out = out && out_waits_;
+    if (!in && !out)
+      return;
+    uint32_t in_events = in ? uint32_t (EPOLLIN) : 0;
+    uint32_t out_events = out ? uint32_t (EPOLLOUT) : 0;
+    if (in_fd_ == out_fd_)
+      watch (in_fd_, in_events | out_events);
+    else
+    {
+      if (in_waits_)
+        watch (in_fd_, in_events);
+      if (out_waits_)
+        watch (out_fd_, out_events);
+    }
+    epoll_event events[2];
+    while (epoll_wait (epoll_fd_, events, 2, -1) < 0)
+      if (errno != EINTR)
+        detail::throw_system_error ("epoll_wait");
+#else
+    (void) in;
+    (void) out;
+#endif
+  }
+
+#if defined(JSON_REPLACE_EPOLL)
+  /**
+   * Makes epoll wait for events on fd, which is only registered while they are not 0, since
+   * epoll reports a hangup or an error of fd whatever events it waits for, and such a side
+   * that is not waited for would end every wait.
+   */
+  void watch (int fd, uint32_t events) noexcept (false)
+  {
+    uint32_t &watched = fd == in_fd_ ? watched_in_ : watched_out_;
+    if (events == watched)
+      return;
+    epoll_event event {};
+    event.events = events;
+    event.data.fd = fd;
+    int op = watched == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl (epoll_fd_, op, fd, &event) < 0)
+      detail::throw_system_error ("epoll_ctl");
+    watched = events;
+  }
+#endif
+
+#if defined(JSON_REPLACE_IO_URING)
+  enum operation : uint64_t
+  {
+    read_operation = 1,
+    write_operation = 2,
+    cancel_operation = 3,
+  };
+
+  void setup_ring (unsigned entries)
+  {
+    io_uring_params params {};
+    int fd = static_cast<int> (syscall (__NR_io_uring_setup, entries, &params));
+    if (fd < 0)
+      return;
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof (io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      sq_len = cq_len = std::max (sq_len, cq_len);
+    void *sq = mmap (nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                     IORING_OFF_SQ_RING);
+    void *cq = single ? sq : mmap (nullptr, cq_len, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    size_t sqes_len = params.sq_entries * sizeof (io_uring_sqe);
+    void *sqes = mmap (nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQES);
+    ring_fd_ = fd;
+    ring_maps_[0] = {sq == MAP_FAILED ? nullptr : sq, sq_len};
+    ring_maps_[1] = {single || cq == MAP_FAILED ? nullptr : cq, cq_len};
+    ring_maps_[2] = {sqes == MAP_FAILED ? nullptr : sqes, sqes_len};
+    // reading and writing from the position of a pipe needs IORING_FEAT_RW_CUR_POS
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+        !(params.features & IORING_FEAT_RW_CUR_POS))
+    {
+      close_ring ();
+      return;
+    }
+    char *sq_ptr = static_cast<char *> (sq);
+    char *cq_ptr = static_cast<char *> (cq);
+    sq_tail_ = reinterpret_cast<unsigned *> (sq_ptr + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *> (sq_ptr + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *> (sq_ptr + params.sq_off.array);
+    sqes_ = static_cast<io_uring_sqe *> (sqes);
+    cq_head_ = reinterpret_cast<unsigned *> (cq_ptr + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *> (cq_ptr + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *> (cq_ptr + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *> (cq_ptr + params.cq_off.cqes);
+    // read and write buffers, in that order, under the indices of the fixed operations
+    std::vector<iovec> buffers;
+    for (size_t i = 0; i < 2 * reads_.size (); ++i)
+      buffers.push_back ({memory_.get () + i * buffer_size_, buffer_size_});
+    fixed_ = syscall (__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, buffers.data (),
+                      static_cast<unsigned> (buffers.size ())) == 0;
+  }
+
+  void close_ring ()
+  {
+    // the kernel can still be writing into the buffers until every operation is done
+    closing_ = true;
+    if (reads_in_flight_ + writes_in_flight_ != 0)
+    {
+      for (size_t i = 0; i < reads_.size (); ++i)
+      {
+        if (reads_[i].in_flight)
+          prepare_cancel (read_operation, i);
+        if (writes_[i].in_flight)
+          prepare_cancel (write_operation, i);
+      }
+      submit ();
+    }
+    while (reads_in_flight_ + writes_in_flight_ != 0)
+      if (!wait_for_completions ())
+        break;
+    for (const std::pair<void *, size_t> &map : ring_maps_)
+      if (map.first != nullptr)
+        munmap (map.first, map.second);
+    close (ring_fd_);
+    ring_fd_ = -1;
+  }
+
+  io_uring_sqe &next_sqe ()
+  {
+    unsigned index = sq_pending_tail_++ & sq_mask_;
+    io_uring_sqe &sqe = sqes_[index];
+    memset (&sqe, 0, sizeof (sqe));
+    sq_array_[index] = index;
+    return sqe;
+  }
+
+  void prepare_rw (operation op, size_t index, int fd, char *data, size_t len,
+                   uint64_t offset, bool link)
+  {
+    io_uring_sqe &sqe = next_sqe ();
+    bool read = op == read_operation;
+    sqe.opcode = fixed_ ? (read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED)
+                        : (read ? IORING_OP_READ : IORING_OP_WRITE);
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t> (data);
+    sqe.len = static_cast<uint32_t> (len);
+    sqe.off = offset;
+    sqe.buf_index = static_cast<uint16_t> (read ? index : reads_.size () + index);
+    sqe.flags = link ? IOSQE_IO_LINK : 0;
+    sqe.user_data = op << 32 | index;
+  }
+
+  void prepare_cancel (operation op, size_t index)
+  {
+    io_uring_sqe &sqe = next_sqe ();
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.addr = op << 32 | index;
+    sqe.user_data = uint64_t (cancel_operation) << 32;
+  }
+
+  /**
+   * Hands every prepared operation to the kernel.
+   */
+  void submit () noexcept (false)
+  {
+    __atomic_store_n (sq_tail_, sq_pending_tail_, __ATOMIC_RELEASE);
+    while (sq_submitted_ != sq_pending_tail_)
+    {
+      long submitted = syscall (__NR_io_uring_enter, ring_fd_,
+                                sq_pending_tail_ - sq_submitted_, 0, 0, nullptr, 0);
+      if (submitted < 0)
+      {
+        if (errno == EINTR || errno == EAGAIN)
+          continue;
+        if (closing_)
+          return;
+        detail::throw_system_error ("io_uring_enter");
+      }
+      sq_submitted_ += static_cast<unsigned> (submitted);
+    }
+  }
+
+  /**
+   * Reads into every free buffer. Seekable input is read at offsets, while a pipe or a
+   * socket only gets a new chain of linked reads once the last one is done.
+   */
+  void submit_reads () noexcept (false)
+  {
+    if (at_end_ || free_reads_.empty () || (!seekable_ && reads_in_flight_ != 0))
+      return;
+    for (size_t count = 0; !free_reads_.empty () && (seekable_ || count < chain_); ++count)
+    {
+      size_t index = free_reads_.front ();
+      free_reads_.pop_front ();
+      buffer &b = reads_[index];
+      b = buffer {b.data};
+      b.in_flight = true;
+      b.offset = read_offset_;
+      if (seekable_)
+        read_offset_ += buffer_size_;
+      ++reads_in_flight_;
+      read_order_.push_back (index);
+      prepare_rw (read_operation, index, in_fd_, b.data, buffer_size_,
+                  seekable_ ? b.offset : uint64_t (-1),
+                  !seekable_ && !free_reads_.empty () && count + 1 < chain_);
+    }
+    submit ();
+  }
+
+  /**
+   * Writes everything in write_order_ as one chain of linked writes, once the last chain is
+   * done, so that a short write, which cuts off the rest of its chain, can be started over.
+   */
+  void submit_writes () noexcept (false)
+  {
+    if (writes_in_flight_ != 0)
+      return;
+    retire_writes ();
+    for (size_t i = 0; i < write_order_.size (); ++i)
+    {
+      buffer &b = writes_[write_order_[i]];
+      b.in_flight = true;
+      ++writes_in_flight_;
+      prepare_rw (write_operation, write_order_[i], out_fd_, b.data + b.begin, b.end - b.begin,
+                  uint64_t (-1), i + 1 != write_order_.size ());
+    }
+    if (writes_in_flight_ != 0)
+      submit ();
+  }
+
+  /**
+   * Waits for at least one operation to complete, and reads every completion there is.
+   * @return false if the wait failed while closing
+   */
+  bool wait_for_completions () noexcept (false)
+  {
+    while (syscall (__NR_io_uring_enter, ring_fd_, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (closing_)
+        return false;
+      detail::throw_system_error ("io_uring_enter");
+    }
+    unsigned head = *cq_head_;
+    while (head != __atomic_load_n (cq_tail_, __ATOMIC_ACQUIRE))
+    {
+      io_uring_cqe cqe = cqes_[head++ & cq_mask_];
+      __atomic_store_n (cq_head_, head, __ATOMIC_RELEASE);
+      complete (cqe.user_data >> 32, cqe.user_data & 0xffffffff, cqe.res);
+    }
+    return true;
+  }
+
+  void complete (uint64_t op, size_t index, int res) noexcept (false)
+  {
+    if (op == cancel_operation)
+      return;
+    bool read = op == read_operation;
+    buffer &b = read ? reads_[index] : writes_[index];
+    // a seekable read is started over, since the reads after it are at offsets already
+    if (read && seekable_ && !closing_ &&
+        (res == -EINTR || res == -EAGAIN || (res > 0 && b.end + res < buffer_size_)))
+    {
+      b.end += std::max (res, 0);
+      prepare_rw (read_operation, index, in_fd_, b.data + b.end, buffer_size_ - b.end,
+                  b.offset + b.end, false);
+      submit ();
+      return;
+    }
+    b.in_flight = false;
+    --(read ? reads_in_flight_ : writes_in_flight_);
+    if (res == -ECANCELED || res == -EINTR || res == -EAGAIN)
+      b.cancelled = read;
+    else if (res < 0)
+    {
+      if (closing_)
+        return;
+      errno = -res;
+      detail::throw_system_error (read ? "read" : "write");
+    }
+    else if (read)
+    {
+      b.end += res;
+      b.at_end = res == 0;
+      // a full read means there is more waiting, and a short one that there is not
+      chain_ = static_cast<size_t> (res) == buffer_size_ ? std::min (2 * chain_, reads_.size ())
+                                                         : 1;
+    }
+    else
+      b.begin += res;
+  }
+
+  void run_ring () noexcept (false)
+  {
+    submit_reads ();
+    while (!at_end_ || reads_in_flight_ != 0)
+    {
+      while (!read_order_.empty () && !reads_[read_order_.front ()].in_flight)
+      {
+        size_t index = read_order_.front ();
+        read_order_.pop_front ();
+        buffer &b = reads_[index];
+        at_end_ = at_end_ || b.at_end;
+        // reading ahead while this buffer is replaced
+        submit_reads ();
+        if (!b.cancelled && b.end != 0)
+          stream_.feed (b.data, b.end);
+        free_reads_.push_back (index);
+      }
+      submit_reads ();
+      if (!at_end_ || reads_in_flight_ != 0)
+        wait_for_completions ();
+    }
+    stream_.finish ();
+    queue_filling ();
+    while (true)
+    {
+      submit_writes ();
+      if (write_order_.empty ())
+        break;
+      wait_for_completions ();
+    }
+  }
+
+  bool fixed_ = false;
+  bool closing_ = false;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned *sq_array_ = nullptr;
+  unsigned sq_pending_tail_ = 0;
+  unsigned sq_submitted_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+  std::pair<void *, size_t> ring_maps_[3] = {};
+#endif
+
+  int in_fd_;
+  int out_fd_;
+  size_t buffer_size_;
+  std::unique_ptr<char[]> memory_; // every buffer, read buffers first
+  std::vector<buffer> reads_;
+  std::vector<buffer> writes_;
+  std::deque<size_t> free_reads_;
+  std::vector<size_t> free_writes_;
+  std::deque<size_t> read_order_; // reads in the order of the input
+  std::deque<size_t> write_order_; // buffers with output left to write, in order
+  size_t filling_ = none; // write buffer the stream writes into
+  size_t reads_in_flight_ = 0;
+  size_t writes_in_flight_ = 0;
+  bool seekable_ = false;
+  uint64_t read_offset_ = 0;
+  size_t chain_ = 1; // reads linked into the next chain, for input that is not seekable
+  bool at_end_ = false;
+  int ring_fd_ = -1;
+  int epoll_fd_ = -1;
+  bool in_waits_ = false;
+  bool out_waits_ = false;
+  uint32_t watched_in_ = 0;
+  uint32_t watched_out_ = 0;
+  std::vector<saved_flags> saved_flags_;
+  JsonReplaceStream stream_;
+};
+
+} // namespace jr
+
+#endif
@@ -0,0 +1,196 @@
+/**
+ * This file implements the C interface declared by json_replace.h on top of json_replace.hpp.
+ * No exception is let out of it: each is turned into a jr_status before returning to C.
+ */
+
+#include "json_replace.hpp"
+#include "json_replace.h"
+
+using namespace jr;
+
+static_assert (JR_OK == static_cast<int> (json_error::none) &&
+                   JR_TOO_DEEP == static_cast<int> (json_error::too_deep) &&
+                   JR_OUTPUT_CAPACITY == static_cast<int> (json_error::output_capacity),
+               "jr_status has to follow json_error");
+static_assert (JR_ENGINE_SCANNER == static_cast<int> (json_engine::scanner) &&
+                   JR_ENGINE_STRUCTURAL_INDEX ==
+                       static_cast<int> (json_engine::structural_index) &&
+                   JR_ENGINE_VALIDATING == static_cast<int> (json_engine::validating),
+               "jr_engine has to follow json_engine");
+
+/**
+ * The keys replaced by a context, the engine it runs, and the buffer that its output is
+ * written into.
+ */
+struct jr_context
+{
+  jr_context (KeyMatcher matcher, char replace) : matcher (std::move (matcher)), replace {replace}
+  {
+  }
+
+  KeyMatcher matcher;
+  runtime_char_replacement replace;
+  json_engine engine = json_engine::scanner;
+  OutputBuffer out;
+  std::vector<std::string_view> records; // of the last batch, kept for their allocation
+};
+
+/**
+ * Sets the outputs of a call from the error it returned.
+ * @return The status of error.
+ */
+static int jr_finish (const ReplaceError &error, size_t len, size_t *out_len,
+                      size_t *error_offset)
+{
+  *out_len = len;
+  if (error_offset)
+    *error_offset = error.offset;
+  return static_cast<int> (error.code);
+}
+
+/**
+ * Runs a call, and turns what it throws into a status.
+ */
+template <typename Call>
+static int jr_call (const Call &call) noexcept
+{
+  try
+  {
+    return call ();
+  }
+  catch (std::bad_alloc &)
+  {
+    return JR_OUT_OF_MEMORY;
+  }
+  catch (std::exception &)
+  {
+    return JR_INVALID_ARGUMENT;
+  }
+}
+
+extern "C" {
+
+const char *jr_status_message (int status)
+{
+  switch (status)
+  {
+    case JR_INVALID_ARGUMENT:
+      return "invalid argument";
+    case JR_OUT_OF_MEMORY:
+      return "out of memory";
+    default:
+      if (status < JR_OK || status > JR_OUTPUT_CAPACITY)
+        return "unknown status";
+      return ReplaceError {static_cast<json_error> (status), 0}.message ();
+  }
+}
+
+size_t jr_max_replaced_len (size_t len)
+{
+  return len;
+}
+
+int jr_replace_into (const char *src, size_t len, char *dest, size_t cap, size_t *out_len,
+                     size_t *error_offset)
+{
+  if ((!src && len != 0) || (!dest && cap != 0) || !out_len)
+    return JR_INVALID_ARGUMENT;
+  ReplaceError error;
+  size_t replaced = json_replace_checked (src, len, dest, cap, error);
+  return jr_finish (error, replaced, out_len, error_offset);
+}
+
+jr_context *jr_context_new (const char *const *suffixes, size_t suffix_count,
+                            const char *const *prefixes, size_t prefix_count, char replace)
+{
+  if (replace == '"' || replace == '\\' || (!suffixes && suffix_count != 0) ||
+      (!prefixes && prefix_count != 0))
+    return nullptr;
+  try
+  {
+    std::vector<std::string> suffix_list (suffixes, suffixes + suffix_count);
+    std::vector<std::string> prefix_list (prefixes, prefixes + prefix_count);
+    if (suffix_list.empty () && prefix_list.empty ())
+      suffix_list.push_back (JSON_REPLACE_TARGET_SUFFIX);
+    return new jr_context (KeyMatcher (suffix_list, prefix_list), replace);
+  }
+  catch (std::exception &)
+  {
+    return nullptr;
+  }
+}
+
+void jr_context_free (jr_context *context)
+{
+  delete context;
+}
+
+int jr_context_set_engine (jr_context *context, int engine)
+{
+  if (!context || engine < JR_ENGINE_SCANNER || engine > JR_ENGINE_VALIDATING)
+    return JR_INVALID_ARGUMENT;
+  context->engine = static_cast<json_engine> (engine);
+  return JR_OK;
+}
+
+int jr_context_replace_into (jr_context *context, const char *src, size_t len, char *dest,
+                             size_t cap, size_t *out_len, size_t *error_offset)
+{
+  if (!context || (!src && len != 0) || (!dest && cap != 0) || !out_len)
+    return JR_INVALID_ARGUMENT;
+  ReplaceError error;
+  size_t replaced = json_replace_checked_with (src, len, dest, cap, context->matcher,
+                                               context->replace, error, no_stats (),
+                                               context->engine);
+  return jr_finish (error, replaced, out_len, error_offset);
+}
+
+int jr_context_replace (jr_context *context, const char *src, size_t len, const char **out,
+                        size_t *out_len, size_t *error_offset)
+{
+  if (!context || (!src && len != 0) || !out || !out_len)
+    return JR_INVALID_ARGUMENT;
+  return jr_call ([&] ()
+  {
+    OutputBuffer &buffer = context->out;
+    buffer.clear ();
+    char *dest = buffer.reserve (len);
+    ReplaceError error;
+    size_t replaced = json_replace_checked_with (src, len, dest, len, context->matcher,
+                                                 context->replace, error, no_stats (),
+                                                 context->engine);
+    buffer.commit (replaced);
+    *out = buffer.data ();
+    return jr_finish (error, replaced, out_len, error_offset);
+  });
+}
+
+int jr_context_replace_many (jr_context *context, const char *data, const size_t *offsets,
+                             size_t count, const char **out, size_t *out_offsets,
+                             size_t *failed)
+{
+  if (!context || !offsets || !out || !out_offsets || (!data && offsets[count] != 0))
+    return JR_INVALID_ARGUMENT;
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (offsets[i] > offsets[i + 1])
+      return JR_INVALID_ARGUMENT;
+  }
+  return jr_call ([&] ()
+  {
+    std::vector<std::string_view> &records = context->records;
+    records.clear ();
+    for (size_t i = 0; i < count; ++i)
+      records.emplace_back (data + offsets[i], offsets[i + 1] - offsets[i]);
+    size_t failed_count = json_replace_many_with (records, context->out,
+                                                  std::span<size_t> (out_offsets, count + 1),
+                                                  context->matcher, context->replace, {},
+                                                  context->engine);
+    *out = context->out.data ();
+    if (failed)
+      *failed = failed_count;
+    return JR_OK;
+  });
+}
+
+}